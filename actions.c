@@ -39,6 +39,7 @@
 #include "user_prefs.h"
 #include "key_handler.h"
 #include "help.h"
+#include "search_index.h"
 
 #define MARK_LIST_SIZE (26*2)
 #define NUM_YANK_REGISTERS (26*2 + 10)
@@ -56,6 +57,11 @@ typedef struct search_thread_data_s
   off_t current;
   int abort;
 } search_thread_data_t;
+typedef struct save_thread_data_s
+{
+  int complete;
+  char what[SAVE_BOX_W];        /* what the save is doing */
+} save_thread_data_t;
 
 static off_t mark_list[MARK_LIST_SIZE];
 static yank_buf_t yank_buf[NUM_YANK_REGISTERS];
@@ -75,6 +81,9 @@ void run_external(void)
   char *tok, *delimiters = " ";
   char errstr[MAX_CMD_BUF], *arglist[MAX_CMD_BUF], dummy = 1;
   char *buf = NULL, *tmp_buf = NULL;
+  const char *span;
+  vf_iter_t it;
+  size_t len;
   pid_t pid;
   void (*s)(int);
 
@@ -160,9 +169,14 @@ void run_external(void)
       return;
     }
 
-    vf_get_buf(current_file, buf, start, size);
-
-    write(outpipe[1], buf, size);
+    /* feed the selection straight from the file */
+    vf_iter_init(&it, current_file, start, size);
+    while ((len = vf_iter_next(&it, &span)) > 0)
+    {
+      if (write(outpipe[1], span, len) < 0)
+        break;
+    }
+    vf_iter_term(&it);
     close(outpipe[1]);
 
     while (read(inpipe[0], &buf[i], 1) > 0 && buf[i] != EOF)
@@ -870,17 +884,45 @@ void *search_status_update_thread(void *search_data)
   pthread_exit(NULL);
 }
 
+/* Once every match is counted n and N look the next one up in the
+   index instead of searching for it */
+static BOOL index_ready(long *count)
+{
+  long at;
+  int percent;
+
+  return search_index_status(display_info.cursor_addr, &at, count,
+                             &percent) == INDEX_READY;
+}
+
 action_code_t action_move_cursor_prev_search(cursor_t cursor)
 {
   action_code_t error = E_SUCCESS;
-  search_aid_t search_aid;
-  off_t addr;
-  int read_size;
+  off_t found;
+  long count, k;
   pthread_t search_status_thread;
   pthread_attr_t attr;
   void *pthread_status;
   search_thread_data_t search_data;
 
+  if (index_ready(&count))
+  {
+    if (count == 0)
+    {
+      msg_box("Term \"%s\" not found", search_item[current_search].pattern);
+      return error;
+    }
+
+    k = search_index_find(display_info.cursor_addr) - 1;
+    if (k < 0)
+    {
+      msg_box("Beginning of file reached, wrapping");
+      k = count - 1;
+    }
+    place_cursor(search_index_get(k), CALIGN_NONE, cursor);
+    return error;
+  }
+
   search_data.start = display_info.cursor_addr;
   search_data.current = display_info.cursor_addr;
   search_data.end = 0;
@@ -892,43 +934,17 @@ action_code_t action_move_cursor_prev_search(cursor_t cursor)
   pthread_attr_destroy(&attr);
 
 /* now search backwards */
-  addr = display_info.cursor_addr;
-  read_size = LONG_SEARCH_BUF_SIZE;
-  while(!address_invalid(addr) && search_data.abort == 0 && read_size > 0)
-  {
-    search_data.current = addr;
-
-    if (address_invalid(addr - read_size))
-    {
-      read_size = addr;
-      addr = 0;
-    }
-    else
-    {
-      addr -= read_size;
-    }
-
-    if (read_size != 0)
-    {
-      /* overlap with current address already done by fill_search_buf */
-      fill_search_buf(addr, read_size, &search_aid, SEARCH_BACKWARD);
-
-      if (search_aid.hl_start != -1)
-      {
-        place_cursor(search_aid.hl_start, CALIGN_NONE, cursor);
-        free_search_buf(&search_aid);
-        search_data.current = search_data.end;
-        pthread_join(search_status_thread, &pthread_status);
-        return error;
-      }
-    }
-
-    free_search_buf(&search_aid);
-  }
+  found = search_range(0, display_info.cursor_addr, SEARCH_BACKWARD,
+                       &search_data.current, &search_data.abort);
 
   search_data.current = search_data.end;
   pthread_join(search_status_thread, &pthread_status);
 
+  if (found != -1)
+  {
+    place_cursor(found, CALIGN_NONE, cursor);
+    return error;
+  }
 
   if (search_data.abort == 1)
   {
@@ -949,43 +965,19 @@ action_code_t action_move_cursor_prev_search(cursor_t cursor)
   pthread_attr_destroy(&attr);
 
 /* now search future pages */
-  addr = display_info.file_size;
-  read_size = LONG_SEARCH_BUF_SIZE;
-  while(addr >= display_info.cursor_addr && search_data.abort == 0 && read_size > 0)
-  {
-    search_data.current = addr;
-
-    if ((addr - read_size) < display_info.cursor_addr)
-    {
-      read_size = addr - display_info.cursor_addr;
-      addr = display_info.cursor_addr;
-    }
-    else
-    {
-      addr -= read_size;
-    }
-
-    if (read_size != 0)
-    {
-      /* overlap with current address already done by fill_search_buf */
-      fill_search_buf(addr, read_size, &search_aid, SEARCH_BACKWARD);
-
-      if (search_aid.hl_start != -1)
-      {
-        place_cursor(search_aid.hl_start, CALIGN_NONE, cursor);
-        free_search_buf(&search_aid);
-        search_data.current = search_data.end;
-        pthread_join(search_status_thread, &pthread_status);
-        return error;
-      }
-    }
-
-    free_search_buf(&search_aid);
-  }
+  found = search_range(display_info.cursor_addr, display_info.file_size,
+                       SEARCH_BACKWARD, &search_data.current,
+                       &search_data.abort);
 
   search_data.current = search_data.end;
   pthread_join(search_status_thread, &pthread_status);
 
+  if (found != -1)
+  {
+    place_cursor(found, CALIGN_NONE, cursor);
+    return error;
+  }
+
   if (search_data.abort == 1)
     msg_box("Search aborted");
   else
@@ -997,37 +989,50 @@ action_code_t action_move_cursor_prev_search(cursor_t cursor)
 action_code_t  action_move_cursor_next_search(cursor_t cursor, BOOL advance_if_current_match)
 {
   action_code_t error = E_SUCCESS;
-  search_aid_t search_aid;
-  off_t addr;
-  int read_size;
+  off_t addr, end, found;
+  long count, k;
   pthread_t search_status_thread;
   pthread_attr_t attr;
   void *pthread_status;
   search_thread_data_t search_data;
 
   addr = display_info.cursor_addr;
-  read_size = LONG_SEARCH_BUF_SIZE;
+  if (advance_if_current_match)
+    addr++;
 
-  fill_search_buf(addr, read_size, &search_aid, SEARCH_FORWARD);
-
-  /* first search to make sure the overlap doesn't cause a backward cursor jump! */
-  while (search_aid.hl_start != -1 && search_aid.hl_start <= display_info.cursor_addr)
+  if (index_ready(&count))
   {
-    if (!advance_if_current_match && search_aid.hl_start == display_info.cursor_addr)
-      break;
-    buf_search(&search_aid);
+    if (count == 0)
+    {
+      msg_box("Term \"%s\" not found", search_item[current_search].pattern);
+      return error;
+    }
+
+    k = search_index_find(addr);
+    if (k == count)
+    {
+      msg_box("End of file reached, wrapping");
+      k = 0;
+    }
+    place_cursor(search_index_get(k), CALIGN_NONE, cursor);
+    return error;
   }
 
-  if (search_aid.hl_start != -1)
+  end = addr + LONG_SEARCH_BUF_SIZE;
+  if (end > display_info.file_size)
+    end = display_info.file_size;
+
+  /* the first chunk is searched before there is any progress to show */
+  search_data.abort = 0;
+  found = search_range(addr, end, SEARCH_FORWARD, &search_data.current,
+                       &search_data.abort);
+  if (found != -1)
   {
-    place_cursor(search_aid.hl_start, CALIGN_NONE, cursor);
-    free_search_buf(&search_aid);
+    place_cursor(found, CALIGN_NONE, cursor);
     return error;
   }
 
-  free_search_buf(&search_aid);
-
-  addr += read_size;
+  addr = end;
 
   search_data.start = display_info.cursor_addr;
   search_data.current = display_info.cursor_addr;
@@ -1040,27 +1045,18 @@ action_code_t  action_move_cursor_next_search(cursor_t cursor, BOOL advance_if_c
   pthread_attr_destroy(&attr);
 
 /* now search future pages */
-  while(!address_invalid(addr) && search_data.abort == 0)
-  {
-    search_data.current = addr;
-    fill_search_buf(addr, read_size, &search_aid, SEARCH_FORWARD);
-
-    if (search_aid.hl_start != -1)
-    {
-      place_cursor(search_aid.hl_start, CALIGN_NONE, cursor);
-      free_search_buf(&search_aid);
-      search_data.current = search_data.end;
-      pthread_join(search_status_thread, &pthread_status);
-      return error;
-    }
-
-    free_search_buf(&search_aid);
-    addr += read_size;
-  }
+  found = search_range(addr, display_info.file_size, SEARCH_FORWARD,
+                       &search_data.current, &search_data.abort);
 
   search_data.current = search_data.end;
   pthread_join(search_status_thread, &pthread_status);
 
+  if (found != -1)
+  {
+    place_cursor(found, CALIGN_NONE, cursor);
+    return error;
+  }
+
   if (search_data.abort == 1)
   {
     msg_box("Search aborted, The Wizard of Yendor is displeased");
@@ -1069,8 +1065,6 @@ action_code_t  action_move_cursor_next_search(cursor_t cursor, BOOL advance_if_c
   else
     msg_box("End of file reached, wrapping");
 
-  addr = 0;
-
   search_data.start = 0;
   search_data.current = 0;
   search_data.end = display_info.cursor_addr;
@@ -1082,27 +1076,18 @@ action_code_t  action_move_cursor_next_search(cursor_t cursor, BOOL advance_if_c
   pthread_attr_destroy(&attr);
 
 /* now search past pages */
-  while(addr <= display_info.cursor_addr && search_data.abort == 0)
-  {
-    search_data.current = addr;
-    fill_search_buf(addr, read_size, &search_aid, SEARCH_FORWARD);
-
-    if (search_aid.hl_start != -1 && search_aid.hl_start <= display_info.cursor_addr)
-    {
-      place_cursor(search_aid.hl_start, CALIGN_NONE, cursor);
-      free_search_buf(&search_aid);
-      search_data.current = search_data.end;
-      pthread_join(search_status_thread, &pthread_status);
-      return error;
-    }
-
-    free_search_buf(&search_aid);
-    addr += read_size;
-  }
+  found = search_range(0, display_info.cursor_addr + 1, SEARCH_FORWARD,
+                       &search_data.current, &search_data.abort);
 
   search_data.current = search_data.end;
   pthread_join(search_status_thread, &pthread_status);
 
+  if (found != -1)
+  {
+    place_cursor(found, CALIGN_NONE, cursor);
+    return error;
+  }
+
   if (search_data.abort == 1)
     msg_box("Search aborted");
   else
@@ -1111,6 +1096,33 @@ action_code_t  action_move_cursor_next_search(cursor_t cursor, BOOL advance_if_c
   return error;
 }
 
+/* :<k>n, to the kth match counting from 1 */
+action_code_t action_jump_to_match(long k, cursor_t cursor)
+{
+  action_code_t error = E_SUCCESS;
+  long at, count;
+  int percent;
+  index_state_t state;
+
+  if (search_item[current_search].used == FALSE)
+  {
+    msg_box("No search term set");
+    return error;
+  }
+
+  state = search_index_status(display_info.cursor_addr, &at, &count, &percent);
+  if (state == INDEX_COUNTING)
+    msg_box("Still counting matches, %d%% done", percent);
+  else if (state != INDEX_READY)
+    msg_box("Too many matches to jump to one");
+  else if (k < 1 || k > count)
+    msg_box("No match %ld, there %s %ld", k, count == 1 ? "is" : "are", count);
+  else
+    place_cursor(search_index_get(k - 1), CALIGN_NONE, cursor);
+
+  return error;
+}
+
 action_code_t action_do_search(int s, char *cmd, cursor_t cursor, search_direction_t direction)
 {
   action_code_t error = E_SUCCESS;
@@ -1268,9 +1280,40 @@ BOOL file_name_prompt(char *file_name)
   return FALSE;
 }
 
-void *save_status_update_thread(void *percent_complete)
+/* Scale a byte count for display, buf should hold 32 */
+static char *size_str(char *buf, off_t size)
+{
+  const char *units = "BKMGTPE";
+
+  while (size >= 10 * 1024 && units[1])
+  {
+    size /= 1024;
+    units++;
+  }
+  snprintf(buf, 32, "%jd %c%s", size, *units, *units == 'B' ? "" : "B");
+
+  return buf;
+}
+
+static void draw_save_window(WINDOW *save_window, int complete,
+                             const char *what)
+{
+  int i;
+
+  box(save_window, 0, 0);
+  wattron(save_window, A_STANDOUT);
+  for (i=1; i<=((complete * (SAVE_BOX_W-2))/100); i++)
+    mvwprintw(save_window, 1, i, " ");
+  wattroff(save_window, A_STANDOUT);
+  mvwprintw(save_window, 2, 1, "Saving... %3d%%", complete);
+  mvwprintw(save_window, 3, 1, "%.*s", SAVE_BOX_W - 2, what);
+  wrefresh(save_window);
+}
+
+void *save_status_update_thread(void *thread_data)
 {
-  int *complete = percent_complete, i=0;
+  save_thread_data_t *save_data = thread_data;
+  int *complete = &save_data->complete, i=0;
   WINDOW *save_window;
   struct timespec sleep;
   struct timespec slept;
@@ -1291,13 +1334,7 @@ void *save_status_update_thread(void *percent_complete)
   sleep.tv_nsec = 0;
   while(*complete != 100)
   {
-    box(save_window, 0, 0);
-    wattron(save_window, A_STANDOUT);
-    for (i=1; i<=((*complete * (SAVE_BOX_W-2))/100); i++)
-      mvwprintw(save_window, 1, i, " ");
-    wattroff(save_window, A_STANDOUT);
-    mvwprintw(save_window, 2, 1, "Saving... %3d%%", *complete);
-    wrefresh(save_window);
+    draw_save_window(save_window, *complete, save_data->what);
     nanosleep(&sleep, &slept);
     werase(save_window);
   }
@@ -1305,16 +1342,114 @@ void *save_status_update_thread(void *percent_complete)
   delwin(save_window);
   pthread_exit(NULL);
 }
+
+/* Put the progress window up, unless the save is over first */
+static void save_window_start(save_thread_data_t *save_data, pthread_t *thread)
+{
+  pthread_attr_t attr;
+
+  curs_set(0);
+  save_data->complete = 0;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+  pthread_create(thread, &attr, save_status_update_thread, (void *)save_data);
+  pthread_attr_destroy(&attr);
+}
+
+static void save_window_stop(save_thread_data_t *save_data, pthread_t thread)
+{
+  void *pthread_status;
+
+  save_data->complete = 100;
+  pthread_join(thread, &pthread_status);
+  curs_set(1);
+  print_screen(display_info.page_start);
+}
+
+/* A failed save in the background is worth interrupting for, a
+   finished one only shows in the status line */
+static void report_save(file_manager_t *f, off_t size)
+{
+  if (size == 0 && vf_need_save(f))
+  {
+    msg_box("Could not save %s", vf_get_fname_file(f));
+    update_status("[failed save]");
+  }
+  else if (f == current_file)
+  {
+    update_status("[saved]");
+  }
+}
+
+/* Wrap up any saves that finished in the background and make recent
+   edits durable in the journals, returns TRUE while some of either
+   are still outstanding */
+BOOL action_poll_saves(void)
+{
+  file_manager_t *tmp_file, *holder;
+  BOOL pending = FALSE;
+  off_t size;
+
+  holder = current_file;
+  if (holder == NULL)
+    return FALSE;
+
+  do
+  {
+    tmp_file = vf_get_next_fm_from_ring(file_ring);
+    if (vf_save_poll(tmp_file, &size))
+      report_save(tmp_file, size);
+    if (vf_save_pending(tmp_file))
+      pending = TRUE;
+    if (vf_journal_sync(tmp_file))
+      pending = TRUE;
+  } while (tmp_file != holder);
+
+  return pending;
+}
+
+/* Block, with the progress window up, until the background save of f
+   is done */
+static void wait_save(file_manager_t *f)
+{
+  WINDOW *save_window;
+  struct timespec sleep;
+  char what[SAVE_BOX_W];
+  off_t size;
+
+  if (FALSE == vf_save_pending(f))
+    return;
+
+  curs_set(0);
+  save_window = newwin(SAVE_BOX_H, SAVE_BOX_W, SAVE_BOX_Y, SAVE_BOX_X);
+  snprintf(what, sizeof(what), "%s", vf_get_fname_file(f));
+
+  sleep.tv_sec = 0;
+  sleep.tv_nsec = 100000000;
+  while (FALSE == vf_save_poll(f, &size))
+  {
+    draw_save_window(save_window, vf_save_progress(f), what);
+    nanosleep(&sleep, NULL);
+    werase(save_window);
+  }
+
+  delwin(save_window);
+  curs_set(1);
+  print_screen(display_info.page_start);
+  report_save(f, size);
+}
+
+/* Rewrites go on in the background while editing carries on, other
+   plans are quick or must not be read from while they run */
 action_code_t action_save(void)
 {
   action_code_t error = E_SUCCESS;
-  int complete;
-  char file_name[MAX_FILE_NAME];
+  save_thread_data_t save_data;
+  vf_save_plan_t plan;
+  char file_name[MAX_FILE_NAME], io[32];
   BOOL status;
   off_t size;
   pthread_t save_status_thread;
-  pthread_attr_t attr;
-  void *pthread_status;
 
   if (vf_need_create(current_file))
   {
@@ -1325,32 +1460,42 @@ action_code_t action_save(void)
     if (status == FALSE)
       return E_INVALID;
   }
+
+  /* edits made while it ran need a save of their own */
+  wait_save(current_file);
+
   if (vf_need_save(current_file))
   {
-    curs_set(0);
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-    pthread_create(&save_status_thread, &attr, save_status_update_thread,
-                   (void *)&complete);
-    pthread_attr_destroy(&attr);
-
-    size = vf_save(current_file, &complete);
+    if (vf_save_start(current_file))
+    {
+      update_status("[saving]");
+      return error;
+    }
+
+    vf_plan_save(current_file, &plan);
+    snprintf(save_data.what, sizeof(save_data.what), "%s, ~%s of I/O",
+             vf_plan_name(plan.plan), size_str(io, plan.io_bytes));
+    save_window_start(&save_data, &save_status_thread);
+
+    size = vf_save(current_file, &save_data.complete);
     if (size != display_info.file_size)
     {
-      complete = 100;
-      msg_box("Only saved %jd bytes, should have saved %jd bytes!!",
-              size, display_info.file_size);
+      save_data.complete = 100;
+      if (vf_save_partial(current_file))
+        msg_box("Save failed part way, \"%s\" on disk is only partly "
+                "written. The edits are still here, save again.",
+                vf_get_fname(current_file));
+      else
+        msg_box("Only saved %jd bytes, should have saved %jd bytes!!",
+                size, display_info.file_size);
       error = E_INVALID;
       update_status("[failed save]");
     }
 
-    pthread_join(save_status_thread, &pthread_status);
+    save_window_stop(&save_data, save_status_thread);
 
     if (error == E_SUCCESS)
       update_status("[saved]");
-
-    curs_set(1);
-    print_screen(display_info.page_start);
   }
   return error;
 }
@@ -1379,9 +1524,13 @@ action_code_t action_save_all(void)
 action_code_t action_save_as(char *name, BOOL keep_newname)
 {
   action_code_t error = E_SUCCESS;
+  save_thread_data_t save_data;
+  pthread_t save_status_thread;
   int complete;
   BOOL status;
 
+  wait_save(current_file);
+
   if (vf_need_create(current_file))
   {
     status = vf_create_file(current_file, name);
@@ -1390,24 +1539,35 @@ action_code_t action_save_as(char *name, BOOL keep_newname)
       msg_box("Could not create \"%s\" (does the file already exist?)", name);
       return E_INVALID;
     }
+    vf_save(current_file, &complete);
+    return error;
   }
-  else
+
+  snprintf(save_data.what, sizeof(save_data.what), "writing %s", name);
+  save_window_start(&save_data, &save_status_thread);
+  status = vf_copy_file(current_file, name, keep_newname, &save_data.complete);
+  save_window_stop(&save_data, save_status_thread);
+
+  if (status == FALSE)
   {
-    status = vf_copy_file(current_file, name, keep_newname);
-    if (status == FALSE)
-    {
-      msg_box("Could not create \"%s\" (does the file already exist?)", name);
-      return E_INVALID;
-    }
+    msg_box("Could not write \"%s\"", name);
+    return E_INVALID;
   }
 
-  vf_save(current_file, &complete);
+  if (keep_newname)
+    update_status("[saved]");
+  else
+    update_status("[written]");
+
   return error;
 }
 
 action_code_t action_quit(BOOL force)
 {
   action_code_t error = E_SUCCESS;
+
+  wait_save(current_file);
+
   if (vf_need_save(current_file) && force == FALSE)
     msg_box("File has unsaved changes");
   else
@@ -1432,6 +1592,11 @@ action_code_t action_quit_all(BOOL force)
   action_code_t error = E_SUCCESS;
   file_manager_t *tmp_file;
 
+  /* :wqa saves every file at once, then waits for them here */
+  while ((tmp_file = vf_get_next_fm_from_ring(file_ring)) != current_file)
+    wait_save(tmp_file);
+  wait_save(current_file);
+
   if (force != TRUE)
   {
     while ((tmp_file = vf_get_next_fm_from_ring(file_ring)) != current_file)
@@ -78,6 +78,7 @@ action_code_t action_visual_select_off(void);
 action_code_t action_visual_select_toggle(void);
 action_code_t action_move_cursor_prev_search(cursor_t cursor);
 action_code_t  action_move_cursor_next_search(cursor_t cursor, BOOL advance_if_current_match);
+action_code_t action_jump_to_match(long k, cursor_t cursor);
 action_code_t action_do_search(int s, char *cmd, cursor_t cursor,
                                search_direction_t direction);
 action_code_t action_search_highlight(void);
@@ -88,6 +89,7 @@ action_code_t action_undo(int count);
 action_code_t action_redo(int count);
 action_code_t action_save(void);
 action_code_t action_save_all(void);
+BOOL action_poll_saves(void);
 action_code_t action_save_as(char *name, BOOL keep_newname);
 action_code_t action_quit(BOOL force);
 action_code_t action_quit_all(BOOL force);
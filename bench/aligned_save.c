@@ -0,0 +1,97 @@
+/*************************************************************
+ *
+ * File:        aligned_save.c
+ * Description: Benchmark saving a block inserted and a block
+ *              deleted near the start of files of growing size
+ *
+ * Copyright (C) 2009 David Kelley
+ *
+ * This file is part of bviplus.
+ *
+ * Bviplus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bviplus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bviplus.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "virt_file.h"
+#include "bench.h"
+
+#define BLOCK     4096
+#define MIN_SIZE  (16 * 1024 * 1024)
+#define MAX_SIZE  (256 * 1024 * 1024)
+
+/* Time one save, and check the bytes either side of the edit */
+static void timed_save(file_manager_t * f, const char *what, off_t size)
+{
+  vf_save_plan_t p;
+  char before[16], after[16];
+  double t;
+  int complete;
+
+  vf_get_buf(f, before, BLOCK - 8, 16);
+  vf_plan_save(f, &p);
+
+  t = now();
+  vf_save(f, &complete);
+  t = now() - t;
+
+  vf_get_buf(f, after, BLOCK - 8, 16);
+
+  printf("%8jd MB %-8s %-22s %10.2f ms%s\n", size >> 20, what,
+         vf_plan_name(p.plan), t * 1e3,
+         memcmp(before, after, 16) ? "  MISMATCH" : "");
+}
+
+/* Files go in the directory given, since whether ranges can be
+   shifted depends on its filesystem. The plan shown is the one
+   chosen, where the filesystem refuses it the save falls back. */
+int main(int argc, char **argv)
+{
+  char name[MAX_PATH_LEN], block[BLOCK], *dir = ".";
+  file_manager_t f;
+  off_t size;
+
+  if (argc > 1)
+    dir = argv[1];
+  snprintf(name, sizeof(name), "%s/bviplus_bench_XXXXXX", dir);
+  close(mkstemp(name));
+
+  memset(block, 'b', BLOCK);
+
+  for (size=MIN_SIZE; size<=MAX_SIZE; size*=2)
+  {
+    make_file(name, size / (1024 * 1024), 0);
+
+    memset(&f, 0, sizeof(f));
+    vf_init(&f, name);
+
+    vf_insert_before(&f, block, BLOCK, BLOCK);
+    timed_save(&f, "insert", size);
+
+    vf_delete(&f, BLOCK, BLOCK);
+    timed_save(&f, "delete", size);
+
+    vf_insert_before(&f, block, BLOCK + 1, 1);
+    timed_save(&f, "1 byte", size);
+
+    vf_term(&f);
+  }
+
+  unlink(name);
+
+  return 0;
+}
@@ -0,0 +1,130 @@
+/*************************************************************
+ *
+ * File:        alloc.c
+ * Description: Benchmark piece node allocation and teardown of
+ *              a virtual file holding millions of pieces
+ *
+ * Copyright (C) 2009 David Kelley
+ *
+ * This file is part of bviplus.
+ *
+ * Bviplus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bviplus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bviplus.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "virt_file.h"
+#include "vf_backend.h"
+#include "bench.h"
+
+#define DEFAULT_PIECES 10000000
+#define STRIDE         4  /* one byte replaced every STRIDE bytes */
+
+/* Two inserts that run on from each other are one undo step, unless
+   the change was closed between them the way each key closes it */
+static BOOL check_undo_steps(void)
+{
+  file_manager_t f;
+  char buf[16];
+  BOOL ok;
+
+  memset(&f, 0, sizeof(f));
+  vf_init(&f, NULL);
+
+  vf_insert_before(&f, "foo", 0, 3);
+  vf_insert_before(&f, "bar", 3, 3);
+  ok = 1 == vf_undo(&f, 1, NULL) && 0 == vf_get_buf(&f, buf, 0, 16);
+  vf_redo(&f, 1, NULL);
+
+  vf_close_change(&f);
+  vf_insert_before(&f, "baz", 6, 3);
+  vf_close_change(&f);
+  vf_insert_before(&f, "qux", 9, 3);
+  ok = ok && 1 == vf_undo(&f, 1, NULL) && 9 == vf_get_buf(&f, buf, 0, 16) &&
+       1 == vf_undo(&f, 1, NULL) && 6 == vf_get_buf(&f, buf, 0, 16) &&
+       0 == memcmp(buf, "foobar", 6);
+
+  vf_term(&f);
+  printf("  undo steps  %s\n", ok ? "ok" : "FAILED");
+
+  return ok;
+}
+
+int main(int argc, char **argv)
+{
+  char name[] = "/tmp/bviplus_bench_XXXXXX";
+  file_manager_t f;
+  slab_t slab;
+  void **items;
+  double t;
+  long pieces = DEFAULT_PIECES, edits, i;
+  char c = 'x';
+  int fd;
+
+  if (argc > 1)
+    pieces = atol(argv[1]);
+  edits = pieces / 2;
+
+  /* sparse, every replace splits a file piece in three */
+  fd = mkstemp(name);
+  if (fd < 0 || ftruncate(fd, (off_t)edits * STRIDE + STRIDE))
+    return 1;
+  close(fd);
+
+  items = malloc(sizeof(void *) * pieces);
+  if (NULL == items)
+    return 1;
+
+  printf("%ld pieces\n", pieces);
+
+  t = now();
+  for (i=0; i<pieces; i++)
+    items[i] = malloc(sizeof(vbuf_t));
+  printf("  malloc      %8.1f ns/node\n", (now() - t) * 1e9 / pieces);
+  t = now();
+  for (i=0; i<pieces; i++)
+    free(items[i]);
+  printf("  free        %8.1f ns/node\n", (now() - t) * 1e9 / pieces);
+
+  slab_init(&slab, sizeof(vbuf_t));
+  t = now();
+  for (i=0; i<pieces; i++)
+    items[i] = slab_alloc(&slab);
+  printf("  slab_alloc  %8.1f ns/node\n", (now() - t) * 1e9 / pieces);
+  t = now();
+  slab_free_all(&slab);
+  printf("  slab bulk   %8.3f ms\n", (now() - t) * 1e3);
+  free(items);
+
+  memset(&f, 0, sizeof(f));
+  vf_init(&f, name);
+
+  t = now();
+  for (i=0; i<edits; i++)
+    vf_replace(&f, &c, i * STRIDE + 1, 1);
+  t = now() - t;
+  printf("  vf_replace  %8.1f ns/edit, %ld edits, %ld nodes\n", t * 1e9 / edits, edits,
+         f.vb_slab.count + f.ul_slab.count);
+
+  t = now();
+  vf_term(&f);
+  printf("  vf_term     %8.3f ms\n", (now() - t) * 1e3);
+
+  unlink(name);
+
+  return check_undo_steps() ? 0 : 1;
+}
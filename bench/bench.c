@@ -0,0 +1,58 @@
+/*************************************************************
+ *
+ * File:        bench.c
+ * Description: Helpers shared by the benchmarks
+ *
+ * Copyright (C) 2009 David Kelley
+ *
+ * This file is part of bviplus.
+ *
+ * Bviplus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bviplus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bviplus.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench.h"
+
+/* Seconds on a clock that only goes forward */
+double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* mb megabytes of random bytes, or of lower case letters if text is
+   set, written out so the first timed save does not pay for it */
+void make_file(const char *name, long mb, int text)
+{
+  FILE *fp;
+  char *buf;
+  long i;
+
+  buf = malloc(1024 * 1024);
+  for (i=0; i<1024 * 1024; i++)
+    buf[i] = text ? 'a' + rand() % 26 : rand();
+
+  fp = fopen(name, "w");
+  for (i=0; i<mb; i++)
+    fwrite(buf, 1, 1024 * 1024, fp);
+  fflush(fp);
+  fsync(fileno(fp));
+  fclose(fp);
+  free(buf);
+}
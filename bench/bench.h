@@ -0,0 +1,31 @@
+/*************************************************************
+ *
+ * File:        bench.h
+ * Description: Helpers shared by the benchmarks
+ *
+ * Copyright (C) 2009 David Kelley
+ *
+ * This file is part of bviplus.
+ *
+ * Bviplus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bviplus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bviplus.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *************************************************************/
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+double now(void);
+void make_file(const char *name, long mb, int text);
+
+#endif /* __BENCH_H__ */
@@ -0,0 +1,134 @@
+/*************************************************************
+ *
+ * File:        find.c
+ * Description: Benchmark n over a file not yet in the page cache
+ *              against reading the file straight through
+ *
+ * Copyright (C) 2009 David Kelley
+ *
+ * This file is part of bviplus.
+ *
+ * Bviplus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bviplus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bviplus.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "virt_file.h"
+#include "search.h"
+#include "app_state.h"
+#include "display.h"
+#include "user_prefs.h"
+#include "bench.h"
+
+#define DEFAULT_MB 1024
+
+/* Push the file out of the page cache */
+static void drop_cache(const char *name)
+{
+  int fd;
+
+  fd = open(name, O_RDONLY);
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+/* What the disk gives reading straight through */
+static double read_rate(const char *name, long mb)
+{
+  char *buf;
+  double t;
+  int fd;
+
+  buf = malloc(LONG_SEARCH_BUF_SIZE);
+  fd = open(name, O_RDONLY);
+
+  t = now();
+  while (read(fd, buf, LONG_SEARCH_BUF_SIZE) > 0)
+    ;
+  t = now() - t;
+
+  close(fd);
+  free(buf);
+
+  return mb / t;
+}
+
+static double find_rate(const char *name, long mb)
+{
+  file_manager_t f;
+  vf_stat_t st;
+  off_t current, found;
+  int abort = 0;
+  double t;
+
+  memset(&f, 0, sizeof(f));
+  vf_init(&f, name);
+  vf_stat(&f, &st);
+  current_file = &f;
+  display_info.file_size = st.file_size;
+
+  t = now();
+  found = search_range(0, st.file_size, SEARCH_FORWARD, &current, &abort);
+  t = now() - t;
+
+  if (found != -1)
+    printf("unexpected match at %lld\n", (long long)found);
+
+  vf_term(&f);
+  current_file = NULL;
+
+  return mb / t;
+}
+
+int main(int argc, char **argv)
+{
+  static char *patterns[] = { "zebra!", ".[^a-z]" };
+  char name[] = "/tmp/bviplus_bench_XXXXXX";
+  long mb = argc > 1 ? atol(argv[1]) : DEFAULT_MB;
+  double cold, warm;
+  int i;
+
+  close(mkstemp(name));
+  /* Lower case text, so neither pattern below is ever found and the
+     whole file is searched */
+  make_file(name, mb, 1);
+  search_init();
+
+  drop_cache(name);
+  printf("%16s %10s %10s\n", "", "cold MB/s", "warm MB/s");
+  cold = read_rate(name, mb);
+  warm = read_rate(name, mb);
+  printf("%16s %10.1f %10.1f\n", "read", cold, warm);
+
+  for (i=0; i<sizeof(patterns) / sizeof(patterns[0]); i++)
+  {
+    search_item[current_search].search_window = SEARCH_ASCII;
+    set_search_term(patterns[i]);
+
+    drop_cache(name);
+    cold = find_rate(name, mb);
+    warm = find_rate(name, mb);
+    printf("%16s %10.1f %10.1f\n", patterns[i], cold, warm);
+  }
+
+  search_cleanup();
+  unlink(name);
+
+  return 0;
+}
@@ -0,0 +1,94 @@
+/*************************************************************
+ *
+ * File:        first_byte.c
+ * Description: Benchmark scanning for the bytes a search match
+ *              can start with, scalar against vector
+ *
+ * Copyright (C) 2009 David Kelley
+ *
+ * This file is part of bviplus.
+ *
+ * Bviplus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bviplus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bviplus.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "search_scan.h"
+#include "bench.h"
+
+#define BUF_SIZE (256 * 1024 * 1024)
+
+/* Hop from candidate to candidate through the whole buffer */
+static double scan_all(byte_set_t *set, char *buf, scan_level_t level,
+                       long *found)
+{
+  double t = now();
+  int pos = 0;
+
+  *found = 0;
+  while ((pos = scan_set_at(set, buf, pos, BUF_SIZE, level)) < BUF_SIZE)
+  {
+    (*found)++;
+    pos++;
+  }
+
+  return now() - t;
+}
+
+int main(int argc, char **argv)
+{
+  static const char *level_name[] = { "scalar", "sse2", "avx2" };
+  static const char *sets[] = { "Q", "qQ", "XYZ", "0123456789" };
+  unsigned char map[256 / 8];
+  scan_level_t level, best = scan_best_level();
+  byte_set_t set;
+  char *random, *zero, *data;
+  long found;
+  double t;
+  int i, d;
+  const char *s;
+
+  random = malloc(BUF_SIZE);
+  zero = calloc(1, BUF_SIZE);
+  for (i=0; i<BUF_SIZE; i++)
+    random[i] = rand();
+
+  printf("%8s %12s %8s %10s %10s\n", "data", "set", "scanner", "found", "MB/s");
+
+  for (d=0; d<2; d++)
+  {
+    data = d ? zero : random;
+    for (i=0; i<sizeof(sets) / sizeof(sets[0]); i++)
+    {
+      memset(map, 0, sizeof(map));
+      for (s=sets[i]; *s; s++)
+        map[(unsigned char)*s >> 3] |= 1 << (*s & 7);
+      byte_set_build(&set, map);
+
+      for (level=SCAN_SCALAR; level<=best; level++)
+      {
+        t = scan_all(&set, data, level, &found);
+        printf("%8s %12s %8s %10ld %10.0f\n", d ? "zero" : "random",
+               sets[i], level_name[level], found, BUF_SIZE / 1048576.0 / t);
+      }
+    }
+  }
+
+  free(random);
+  free(zero);
+
+  return 0;
+}
@@ -0,0 +1,88 @@
+/*************************************************************
+ *
+ * File:        page_read.c
+ * Description: Benchmark page reads from the virtual file
+ *              against the number of nested edits below them
+ *
+ * Copyright (C) 2009 David Kelley
+ *
+ * This file is part of bviplus.
+ *
+ * Bviplus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bviplus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bviplus.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "virt_file.h"
+#include "bench.h"
+
+#define FILE_SIZE   (64 * 1024 * 1024)
+#define EDIT_REGION (64 * 1024)  /* edits pile up here so they nest */
+#define PAGE        4096
+#define READS       1000
+
+int main(int argc, char **argv)
+{
+  static const int steps[] = { 0, 1000, 10000, 100000, 1000000 };
+  char name[] = "/tmp/bviplus_bench_XXXXXX";
+  char page[PAGE], patch[8] = "patched", result;
+  file_manager_t f;
+  double t, read_us, char_us;
+  int i, j, k, done = 0;
+  off_t addr;
+
+  close(mkstemp(name));
+  make_file(name, FILE_SIZE / (1024 * 1024), 0);
+
+  memset(&f, 0, sizeof(f));
+  vf_init(&f, name);
+
+  printf("%10s %14s %14s\n", "edits", "us/page read", "us/page getc");
+
+  for (i=0; i<sizeof(steps) / sizeof(steps[0]); i++)
+  {
+    for (; done<steps[i]; done++)
+    {
+      addr = rand() % EDIT_REGION;
+      if (done & 1)
+        vf_insert_before(&f, patch, addr, 4);
+      else
+        vf_replace(&f, patch, addr, 8);
+    }
+
+    t = now();
+    for (j=0; j<READS; j++)
+      vf_get_buf(&f, page, rand() % (EDIT_REGION - PAGE), PAGE);
+    read_us = (now() - t) * 1e6 / READS;
+
+    t = now();
+    for (j=0; j<READS / 10; j++)
+    {
+      addr = rand() % (EDIT_REGION - PAGE);
+      for (k=0; k<PAGE; k++)
+        page[k] = vf_get_char(&f, &result, addr + k);
+    }
+    char_us = (now() - t) * 1e6 / (READS / 10);
+
+    printf("%10d %14.2f %14.2f\n", steps[i], read_us, char_us);
+  }
+
+  vf_term(&f);
+  unlink(name);
+
+  return 0;
+}
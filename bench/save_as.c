@@ -0,0 +1,87 @@
+/*************************************************************
+ *
+ * File:        save_as.c
+ * Description: Benchmark writing an edited file to a new name
+ *              against copying the original with cp
+ *
+ * Copyright (C) 2009 David Kelley
+ *
+ * This file is part of bviplus.
+ *
+ * Bviplus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bviplus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bviplus.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "virt_file.h"
+#include "bench.h"
+
+#define DEFAULT_MB 512
+#define EDITS      1000
+
+/* Files go in the directory given, copy_file_range may work there
+   or not */
+int main(int argc, char **argv)
+{
+  char name[MAX_PATH_LEN], copy[MAX_PATH_LEN + 8], cmd[4 * MAX_PATH_LEN];
+  char patch[8] = "patched", *dir = ".";
+  file_manager_t f;
+  double t, mb = DEFAULT_MB;
+  int i, complete;
+
+  if (argc > 1)
+    dir = argv[1];
+  if (argc > 2)
+    mb = atol(argv[2]);
+
+  snprintf(name, sizeof(name), "%s/bviplus_bench_XXXXXX", dir);
+  close(mkstemp(name));
+  snprintf(copy, sizeof(copy), "%s.copy", name);
+  make_file(name, (long)mb, 0);
+
+  memset(&f, 0, sizeof(f));
+  vf_init(&f, name);
+  for (i=0; i<EDITS; i++)
+  {
+    if (i & 1)
+      vf_insert_before(&f, patch, rand() % (off_t)(mb * 1024 * 1024), 4);
+    else
+      vf_replace(&f, patch, rand() % (off_t)(mb * 1024 * 1024 - 8), 8);
+  }
+
+  printf("%.0f MB, %d edits\n", mb, EDITS);
+
+  t = now();
+  vf_copy_file(&f, copy, FALSE, &complete);
+  t = now() - t;
+  printf("  vf_copy_file  %8.1f ms %8.1f MB/s\n", t * 1e3, mb / t);
+
+  unlink(copy);
+  /* the copy is fsynced, so make cp pay for that too */
+  snprintf(cmd, sizeof(cmd), "cp '%s' '%s' && sync '%s'", name, copy, copy);
+  t = now();
+  if (system(cmd))
+    return 1;
+  t = now() - t;
+  printf("  cp + sync     %8.1f ms %8.1f MB/s\n", t * 1e3, mb / t);
+
+  vf_term(&f);
+  unlink(copy);
+  unlink(name);
+
+  return 0;
+}
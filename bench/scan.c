@@ -0,0 +1,132 @@
+/*************************************************************
+ *
+ * File:        scan.c
+ * Description: Benchmark streaming the whole logical file by
+ *              copying it out in chunks against walking it
+ *              as spans in place
+ *
+ * Copyright (C) 2009 David Kelley
+ *
+ * This file is part of bviplus.
+ *
+ * Bviplus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bviplus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bviplus.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "virt_file.h"
+#include "bench.h"
+
+#define FILE_SIZE (256 * 1024 * 1024)
+#define CHUNK     (2 * 1024 * 1024)  /* as the search reads it */
+#define PASSES    4
+
+/* Touch every byte so neither loop can skip the data */
+static unsigned long sum(const char *buf, size_t len, unsigned long total)
+{
+  size_t i;
+
+  for (i=0; i<len; i++)
+    total += (unsigned char)buf[i];
+
+  return total;
+}
+
+static double copy_scan(file_manager_t *f, off_t size, unsigned long *total)
+{
+  double t = now();
+  off_t addr;
+  size_t len;
+  char *buf;
+
+  for (addr=0; addr<size; addr+=len)
+  {
+    buf = malloc(CHUNK);
+    len = vf_get_buf(f, buf, addr, CHUNK);
+    *total = sum(buf, len, *total);
+    free(buf);
+  }
+
+  return now() - t;
+}
+
+static double span_scan(file_manager_t *f, off_t size, unsigned long *total)
+{
+  double t = now();
+  const char *span;
+  vf_iter_t it;
+  size_t len;
+
+  vf_iter_init(&it, f, 0, size);
+  while ((len = vf_iter_next(&it, &span)) > 0)
+    *total = sum(span, len, *total);
+  vf_iter_term(&it);
+
+  return now() - t;
+}
+
+int main(int argc, char **argv)
+{
+  static const int steps[] = { 0, 100, 10000 };
+  char name[] = "/tmp/bviplus_bench_XXXXXX";
+  char patch[8] = "patched";
+  unsigned long a, b;
+  double copy_s, span_s;
+  file_manager_t f;
+  vf_stat_t st;
+  int i, j, done = 0;
+
+  close(mkstemp(name));
+  make_file(name, FILE_SIZE / (1024 * 1024), 0);
+
+  memset(&f, 0, sizeof(f));
+  vf_init(&f, name);
+
+  printf("%10s %14s %14s\n", "edits", "copy MB/s", "span MB/s");
+
+  for (i=0; i<sizeof(steps) / sizeof(steps[0]); i++)
+  {
+    for (; done<steps[i]; done++)
+    {
+      if (done & 1)
+        vf_insert_before(&f, patch, rand() % FILE_SIZE, 4);
+      else
+        vf_replace(&f, patch, rand() % (FILE_SIZE - 8), 8);
+    }
+    vf_stat(&f, &st);
+
+    copy_s = span_s = 0;
+    a = b = 0;
+    for (j=0; j<PASSES; j++)
+    {
+      copy_s += copy_scan(&f, st.file_size, &a);
+      span_s += span_scan(&f, st.file_size, &b);
+    }
+
+    if (a != b)
+      printf("MISMATCH\n");
+
+    printf("%10d %14.0f %14.0f\n", steps[i],
+           PASSES * (st.file_size / 1048576.0) / copy_s,
+           PASSES * (st.file_size / 1048576.0) / span_s);
+  }
+
+  vf_term(&f);
+  unlink(name);
+
+  return 0;
+}
@@ -0,0 +1,113 @@
+/*************************************************************
+ *
+ * File:        search.c
+ * Description: Benchmark the search engine over a large file
+ *              with patterns heavy in '.' and negated sets
+ *
+ * Copyright (C) 2009 David Kelley
+ *
+ * This file is part of bviplus.
+ *
+ * Bviplus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bviplus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bviplus.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "virt_file.h"
+#include "search.h"
+#include "app_state.h"
+#include "display.h"
+#include "user_prefs.h"
+#include "bench.h"
+
+#define DEFAULT_MB 1024
+
+/* Every match in the file, chunk by chunk the way n does it */
+static long count_matches(off_t size)
+{
+  search_aid_t aid;
+  size_t len;
+  off_t addr;
+  long count = 0;
+
+  for (addr=0; addr<size; addr+=len)
+  {
+    len = LONG_SEARCH_BUF_SIZE;
+    memset(&aid, 0, sizeof(aid));
+    aid.buf = vf_get_range(current_file, addr, &len, &aid.copy);
+    aid.buf_size = len;
+    aid.buf_start_addr = addr;
+    aid.hl_start = -1;
+    do
+    {
+      buf_search(&aid);
+      if (aid.hl_start != -1)
+        count++;
+    } while (aid.hl_start != -1);
+    free_search_buf(&aid);
+  }
+
+  return count;
+}
+
+int main(int argc, char **argv)
+{
+  static char *patterns[] = { ".[^a-z]", "[^0-9][^a-z]x", "[a-f].q[^a-z]",
+                              "q[^a-z]", "zebra" };
+  char name[] = "/tmp/bviplus_bench_XXXXXX";
+  long mb = argc > 1 ? atol(argv[1]) : DEFAULT_MB, count;
+  file_manager_t f;
+  vf_stat_t st;
+  double t;
+  int i, ic;
+
+  close(mkstemp(name));
+  /* Lower case text, so the negated sets below never match and every
+     offset has to be rejected */
+  make_file(name, mb, 1);
+
+  memset(&f, 0, sizeof(f));
+  vf_init(&f, name);
+  vf_stat(&f, &st);
+  current_file = &f;
+  display_info.file_size = st.file_size;
+  search_init();
+
+  printf("%16s %4s %10s %10s\n", "pattern", "ic", "matches", "MB/s");
+
+  for (i=0; i<sizeof(patterns) / sizeof(patterns[0]); i++)
+  {
+    for (ic=0; ic<2; ic++)
+    {
+      user_prefs[IGNORECASE].value = ic;
+      search_item[current_search].search_window = SEARCH_ASCII;
+      set_search_term(patterns[i]);
+
+      t = now();
+      count = count_matches(st.file_size);
+      t = now() - t;
+
+      printf("%16s %4d %10ld %10.1f\n", patterns[i], ic, count, mb / t);
+    }
+  }
+
+  search_cleanup();
+  vf_term(&f);
+  unlink(name);
+
+  return 0;
+}
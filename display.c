@@ -33,6 +33,7 @@
 #include "virt_file.h"
 #include "key_handler.h"
 #include "search.h"
+#include "search_index.h"
 
 display_info_t display_info;
 WINDOW *window_list[MAX_WINDOWS];
@@ -361,7 +362,7 @@ off_t visual_addr(void)
 }
 
 /* returns the number of bytes displayed on that line */
-int print_line(off_t page_addr, off_t line_addr, char *screen_buf, int screen_buf_size, search_aid_t *search_aid)
+int print_line(off_t page_addr, off_t line_addr, const char *screen_buf, int screen_buf_size, search_aid_t *search_aid)
 {
   int i, j, k,
       y, x = 1;
@@ -541,6 +542,53 @@ void update_file_tabs_window(void)
   vf_set_current_fm_from_ring(file_ring, current_file);
 }
 
+/* A count with its digits in threes, "10 482", into text of size len */
+static void group_digits(char *text, int len, long n)
+{
+  char digits[32];
+  int i, j, count;
+
+  count = snprintf(digits, sizeof(digits), "%ld", n);
+  for (i=0, j=0; i<count && j<len-1; i++)
+  {
+    if (i > 0 && (count - i) % 3 == 0 && j<len-2)
+      text[j++] = ' ';
+    text[j++] = digits[i];
+  }
+  text[j] = 0;
+}
+
+/* "[match 37 of 10 482] ", or how many so far while still counting */
+static int print_match_count(char *line, int len)
+{
+  char at_text[32], count_text[32];
+  long at, count;
+  int percent;
+  index_state_t state;
+
+  state = search_index_status(display_info.cursor_addr, &at, &count, &percent);
+  if (state == INDEX_NONE)
+    return 0;
+
+  group_digits(at_text, sizeof(at_text), at);
+  group_digits(count_text, sizeof(count_text), count);
+
+  if (state == INDEX_TOO_MANY)
+  {
+    group_digits(count_text, sizeof(count_text), INDEX_MAX_HITS);
+    return snprintf(line, len, "[over %s matches] ", count_text);
+  }
+  if (state == INDEX_COUNTING && at)
+    return snprintf(line, len, "[match %s of %s so far, %d%% counted] ",
+                    at_text, count_text, percent);
+  if (state == INDEX_COUNTING)
+    return snprintf(line, len, "[%s matches so far, %d%% counted] ",
+                    count_text, percent);
+  if (at)
+    return snprintf(line, len, "[match %s of %s] ", at_text, count_text);
+  return snprintf(line, len, "[%s match%s] ", count_text, count == 1 ? "" : "es");
+}
+
 void update_status_window(void)
 {
   int i, result, len;
@@ -556,6 +604,10 @@ void update_status_window(void)
     len += snprintf(line+len, MAX_FILE_NAME-len, " ");
   len += snprintf(line+len, MAX_FILE_NAME-len, "%s", display_info.status);
   len += snprintf(line+len, MAX_FILE_NAME-len, "%s", display_info.status_msg);
+  if (vf_save_pending(current_file))
+    len += snprintf(line+len, MAX_FILE_NAME-len, "[saving %d%%] ",
+                    vf_save_progress(current_file));
+  len += print_match_count(line+len, MAX_FILE_NAME-len);
   if (macro_key != -1)
     len += snprintf(line+len, MAX_FILE_NAME-len, "[recording '%c']", macro_key + 'a');
   if (is_visual_on()) {
@@ -678,7 +730,7 @@ void place_cursor(off_t addr, cursor_alignment_e calign, cursor_t cursor)
 }
 
 
-void print_screen_buf(off_t addr, char *screen_buf, int screen_buf_size, search_aid_t *search_aid)
+void print_screen_buf(off_t addr, const char *screen_buf, int screen_buf_size, search_aid_t *search_aid)
 {
   int i;
   off_t line_addr = addr;
@@ -712,15 +764,15 @@ void print_screen_buf(off_t addr, char *screen_buf, int screen_buf_size, search_
 void print_screen(off_t addr)
 {
   size_t screen_buf_size;
-  char *screen_buf;
+  const char *screen_buf;
+  char *copy;
   search_aid_t search_aid, *sa_p = NULL;
 
   display_info.page_start = addr;
   display_info.page_end = PAGE_END;
 
   screen_buf_size = PAGE_END - addr + 1;
-  screen_buf = (char *)malloc(screen_buf_size);
-  screen_buf_size = vf_get_buf(current_file, screen_buf, addr, screen_buf_size);
+  screen_buf = vf_get_range(current_file, addr, &screen_buf_size, &copy);
 
   if (search_item[current_search].used == TRUE)
   {
@@ -733,7 +785,7 @@ void print_screen(off_t addr)
   if (search_item[current_search].used == TRUE)
     free_search_buf(&search_aid);
 
-  free(screen_buf);
+  free(copy);
   update_file_tabs_window();
 }
 
@@ -120,7 +120,7 @@
 #define SCROLL_BOX_Y HEX_BOX_Y
 #define SCROLL_BOX_X HEX_BOX_X
 
-#define SAVE_BOX_H 4
+#define SAVE_BOX_H 5
 #define SAVE_BOX_W 52
 #define SAVE_BOX_Y (((HEX_BOX_H - SAVE_BOX_H) / 2) + HEX_BOX_Y)
 #define SAVE_BOX_X (((HEX_BOX_W - SAVE_BOX_W) / 2) + HEX_BOX_X)
@@ -192,10 +192,10 @@ void blob_standout(BOOL on);
 int is_visual_on(void);
 int visual_span(void);
 off_t visual_addr(void);
-int print_line(off_t page_addr, off_t line_addr, char *screen_buf, int screen_buf_size, search_aid_t *search_aid);
+int print_line(off_t page_addr, off_t line_addr, const char *screen_buf, int screen_buf_size, search_aid_t *search_aid);
 void update_status_window(void);
 void place_cursor(off_t addr, cursor_alignment_e calign, cursor_t cursor);
-void print_screen_buf(off_t addr, char *screen_buf, int screen_buf_size, search_aid_t *search_aid);
+void print_screen_buf(off_t addr, const char *screen_buf, int screen_buf_size, search_aid_t *search_aid);
 void print_screen(off_t addr);
 
 #endif /* __DISPLAY_H__ */
@@ -58,7 +58,8 @@ char *help_text[] = {
   "  :wq             Save and quit",
   "  :wqa            Save all and quit",
   "  :waq",
-  "  :w <name>       Save as <name>",
+  "  :w <name>       Write the edited file to <name>",
+  "  :saveas <name>  Save as <name> and keep editing it",
   " ",
   "Movement in command mode:",
   "  TAB KEY         Move between HEX/ASCII windows",
@@ -112,6 +113,8 @@ char *help_text[] = {
   "  \\<pattern>               Hex search",
   "  ?/<pattern>              Reverse ascii search",
   "  ?\\<pattern>              Reverse hex search",
+  "  :<k>n                    Jump to match k, once the matches are counted",
+  "  Matches are counted in the background and shown in the status bar",
   "  Pattern options:",
   "    \\            Escape the next character (do not interpret as special char)",
   "    .            Match any char/byte",
@@ -129,6 +132,7 @@ char *help_text[] = {
   "       Option               Arguments    Default   Alias      Effect",
   "       ------               ---------    -------   -----      ------",
   "  :set                                                        Show settings",
+  "  :stats                                                      Show memory and cache use of this file",
   "  :set binary               <on|off>     off       bin        Binary display *",
   "  :set little_endian        <on|off>     off       le         Little endian *",
   "  :set grouping             <1-16>       1         grp        Set byte grouping *",
@@ -138,7 +142,10 @@ char *help_text[] = {
   "  :set search_hl            <on|off>     on        hl         Search highlighting",
   "  :set search_immediate     <on|off>     on        si         Searching auto matically moves cursor to next match",
   "  :set ignorecase           <on|off>     on        case       Case sensativ search",
-  "  :set max_match            <0-n>        256       mm         Maximum search match size (0=no max, bigger=slower)",
+  "  :set max_match            <0-n>        256       mm         Longest match sure to be highlighted across screen edges",
+  "  :set block_cache          <0-n>        16384     bc         KiB cached per file when it can't be mapped (0=off)",
+  "  :set undo_levels          <0-n>        0         ul         Changes kept for undo per file (0=no limit)",
+  "  :set undo_memory          <0-n>        262144    um         KiB undo may hold per file (0=no limit)",
   " ",
   "  >                Increase blob_grouping_offset",
   "  <                Decrease blob_grouping_offset",
@@ -53,6 +53,8 @@ int mwgetch(WINDOW *w)
   else
   {
     k = wgetch(w);
+    if (k == ERR) /* timed out, no key to record */
+      return k;
     i = macro_record[macro_key].key_index++;
     macro_record[macro_key].key[i] = k;
     return k;
@@ -124,6 +126,40 @@ action_code_t show_set(void)
   return error;
 }
 
+#define NUM_STATS 5
+action_code_t show_stats(void)
+{
+  action_code_t error = E_SUCCESS;
+  char *text[NUM_STATS + 1];
+  int i;
+
+  vf_stat(current_file, &vfstat);
+
+  for (i=0; i<NUM_STATS; i++)
+    text[i] = (char *)malloc(256);
+  text[NUM_STATS] = NULL;
+
+  snprintf(text[0], 256, " File:            %s", vf_get_fname(current_file));
+  snprintf(text[1], 256, " Size:            %jd bytes (%jd on disk)",
+           vfstat.file_size, vfstat.disk_size);
+  snprintf(text[2], 256, " Undo history:    %ld changes holding %jd bytes",
+           vfstat.undo_changes, vfstat.undo_bytes);
+  snprintf(text[3], 256, " Edit buffer:     %jd bytes, %jd no longer used",
+           vfstat.add_size, vfstat.add_dead);
+  if (vfstat.cache_hits + vfstat.cache_misses == 0)
+    snprintf(text[4], 256, " Block cache:     not in use for this file");
+  else
+    snprintf(text[4], 256, " Block cache:     %lu hits, %lu misses",
+             vfstat.cache_hits, vfstat.cache_misses);
+
+  scrollable_window_display(text);
+
+  for (i=0; i<NUM_STATS; i++)
+    free(text[i]);
+
+  return error;
+}
+
 action_code_t do_set(void)
 {
   action_code_t error = E_SUCCESS;
@@ -290,12 +326,22 @@ action_code_t cmd_parse(char *cbuff)
         action_jump_to(num, CURSOR_REAL);
       return error;
     }
+    if (relative == 0 && endptr != tok && strcmp(endptr, "n") == 0)
+    {
+      action_jump_to_match(num, CURSOR_REAL);
+      return error;
+    }
 
     if (strncmp(tok, "set", MAX_CMD_BUF) == 0)
     {
       error = do_set();
       return error;
     }
+    if (strncmp(tok, "stats", MAX_CMD_BUF) == 0)
+    {
+      error = show_stats();
+      return error;
+    }
     if ((strncmp(tok, "next",     MAX_CMD_BUF) == 0) ||
         (strncmp(tok, "tabn",     MAX_CMD_BUF) == 0) ||
         (strncmp(tok, "bn",       MAX_CMD_BUF) == 0))
@@ -351,6 +397,13 @@ action_code_t cmd_parse(char *cbuff)
         current_file = vf_add_fm_to_ring(file_ring);
         if (vf_init(current_file, ftemp) == FALSE)
           fprintf(stderr, "Could not open %s\n", ftemp);
+        else if (vf_journal_found(current_file))
+        {
+          if (msg_prompt("Found unsaved edits to %s, recover them?", ftemp))
+            vf_journal_recover(current_file);
+          else
+            vf_journal_discard(current_file);
+        }
         update_display_info();
         print_screen(0);
       }
@@ -429,7 +482,7 @@ action_code_t cmd_parse(char *cbuff)
       if (tok == NULL)
         action_save();
       else
-        action_save_as(tok, FALSE);
+        action_save_as(tok, TRUE); /* so the file is clean to quit */
 
       action_quit(FALSE);
       return error;
@@ -1418,8 +1471,8 @@ void do_overwrite(int count)
       len3 = 0;
     else
       len3 = PAGE_SIZE - (len1 + len2);
-    if ((ins_addr + len2 + len3) > current_file->fm.size)
-      len3 = current_file->fm.size - (ins_addr + len2);
+    if ((ins_addr + len2 + len3) > display_info.file_size)
+      len3 = display_info.file_size - (ins_addr + len2);
 
     if (len1 != 0)
       vf_get_buf(current_file, screen_buf, page_start, len1);
@@ -1525,7 +1578,7 @@ void do_overwrite(int count)
       case ESC:
         break;
       default:
-        if ((ins_addr + char_count + tmp_char_count) >= current_file->fm.size)
+        if ((ins_addr + char_count + tmp_char_count) >= display_info.file_size)
         {
           flash();
           continue;
@@ -1623,6 +1676,9 @@ void handle_key(int c)
   static int esc_count = 0;
   static off_t jump_addr = -1;
 
+  /* whatever this key does to the file is its own undo step */
+  vf_close_change(current_file);
+
   if (c >= '0' && c <= '9')
   {
     int_c = c - '0';
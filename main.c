@@ -38,13 +38,16 @@
 #include "actions.h"
 #include "creadline.h"
 #include "user_prefs.h"
+#include "search_index.h"
 
 #define MILISECONDS(x) ((x) * 1000)
 #define SECONDS(x) (MILISECONDS(x) * 1000)
+#define SAVE_POLL_MS 250
 
 int main(int argc, char **argv)
 {
   int i, c;
+  BOOL saving, counting;
   file_manager_t *tmp_head;
 
   /* Create a file ring to contain any open file references for this process */
@@ -60,6 +63,22 @@ int main(int argc, char **argv)
       fprintf(stderr, "Could not open %s\n", argv[i]);
       vf_remove_fm_from_ring(file_ring, current_file);
     }
+    else if (vf_journal_found(current_file))
+    {
+      /* An earlier session crashed or was killed with edits unsaved */
+      printf("Found unsaved edits to %s, recover them? [y/N] ", argv[i]);
+      fflush(stdout);
+      c = getchar();
+      if (c == 'y' || c == 'Y')
+      {
+        if (vf_journal_recover(current_file) < 0)
+          fprintf(stderr, "Could not recover %s\n", argv[i]);
+      }
+      else
+        vf_journal_discard(current_file);
+      while (c != '\n' && c != EOF)
+        c = getchar();
+    }
   }
 
   /* Make sure we have at least one valid open file, otherwise init an empty file */
@@ -75,6 +94,7 @@ int main(int argc, char **argv)
   memset(macro_record, 0, sizeof(macro_record_t) * 26);
   action_init_yank();
   search_init();
+  search_index_init();
   ascii_search_hist = new_history();
   hex_search_hist = new_history();
   cmd_hist = new_history();
@@ -121,14 +141,27 @@ int main(int argc, char **argv)
   /* Main program loop. We loop here until we are told to quit. */
   while (app_state.quit == FALSE)
   {
+    /* Pick up saves that finished in the background and sync journals */
+    saving = action_poll_saves();
+    /* Count matches of the current search, starting over if it changed */
+    counting = search_index_poll();
     /* Update the status window each keypress so we can always see our current cursor address */
     update_status_window();
     update_panels();
     doupdate();
     /* Replace the cursor after updating the screen */
     place_cursor(display_info.cursor_addr, CALIGN_NONE, CURSOR_REAL);
-    /* Get and handle the users next key press */
+    /* Get and handle the users next key press, waking up now and then
+       while saves are running to show how they are getting on, or
+       while edits are waiting to go to the journal, or while matches
+       are being counted.  Matches are only counted while we wait. */
+    wtimeout(window_list[display_info.cursor_window],
+             saving || counting ? SAVE_POLL_MS : -1);
+    search_index_resume();
     c = mwgetch(window_list[display_info.cursor_window]);
+    search_index_pause();
+    if (c == ERR)
+      continue;
     update_status(NULL);
     handle_key(c);
   }
@@ -140,6 +173,7 @@ int main(int argc, char **argv)
   free_history(hex_search_hist);
   free_history(cmd_hist);
   free_history(file_hist);
+  search_index_cleanup();
   search_cleanup();
   action_clean_yank();
 
@@ -23,11 +23,15 @@
  *
  *************************************************************/
 
+#define _GNU_SOURCE /* memmem */
 #include <regex.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include "search.h"
+#include "search_dfa.h"
 #include "display.h"
 #include "app_state.h"
 #include "user_prefs.h"
@@ -35,186 +39,144 @@
 
 search_item_t search_item[MAX_SEARCHES];
 int current_search = 0;
+static int search_serial = 0;   /* bumped whenever the maps are built */
 
-void search_state_reset(search_state_t *search_state)
+static void build_literal(compiled_pattern_t *cpat);
+
+/* Should ascii searches ignore case right now */
+static int want_folded(void)
 {
-  int i;
-  search_state->criteria_index = 0;
-  for (i=0; i<search_item[current_search].compiled_pattern.criteria_count; i++)
-    search_state->match_state[i] = UNFULFILLED;
+  return search_item[current_search].search_window == SEARCH_ASCII &&
+         user_prefs[IGNORECASE].value != 0;
 }
 
-int matches(unsigned char byte, match_criteria_t *criteria)
+/* Turn each range into a bitmap so a byte is tested with one lookup.
+   With case folded, a byte is in the map when its upper case is the
+   upper case of some byte in the range. */
+static void build_maps(compiled_pattern_t *cpat, int fold)
 {
-  int i;
+  unsigned char upper[256];
+  match_criteria_t *c;
+  int i, j;
 
-  if (search_item[current_search].search_window == SEARCH_ASCII &&
-      user_prefs[IGNORECASE].value != 0)
+  for (i=0; i<cpat->criteria_count; i++)
   {
-    for (i=0; i<criteria->range_count; i++)
+    c = cpat->criteria[i];
+    memset(c->map, 0, sizeof(c->map));
+    memset(upper, 0, sizeof(upper));
+
+    for (j=0; j<c->range_count; j++)
     {
-      if (toupper(byte) == toupper(criteria->range[i]))
-        return 1;
+      c->map[c->range[j] >> 3] |= 1 << (c->range[j] & 7);
+      upper[toupper(c->range[j])] = 1;
     }
-  }
-  else
-  {
-    for (i=0; i<criteria->range_count; i++)
+
+    for (j=0; fold && j<256; j++)
     {
-      if (byte == criteria->range[i])
-        return 1;
+      if (upper[toupper(j)])
+        c->map[j >> 3] |= 1 << (j & 7);
     }
   }
 
-  return 0;
+  cpat->folded = fold;
+  build_literal(cpat);
+  search_serial++;
+
+  /* the DFAs are built as they are used, from the maps as they are now */
+  dfa_free(cpat->fwd);
+  dfa_free(cpat->rev);
+  cpat->fwd = dfa_create(cpat, DFA_FORWARD);
+  cpat->rev = dfa_create(cpat, DFA_REVERSE);
 }
 
-search_result_t rollback(unsigned char byte, search_state_t *search_state)
+/* A pattern of single bytes with no wildcards is a plain string and is
+   found with a substring search instead of the criteria machine */
+static void build_literal(compiled_pattern_t *cpat)
 {
-  int i;
-  compiled_pattern_t *cpat = &search_item[current_search].compiled_pattern;
+  match_criteria_t *c;
+  unsigned char key;
+  int i, j, len = cpat->criteria_count;
+
+  cpat->literal_len = 0;
 
-  for (i=search_state->criteria_index-1; i>=0; i--)
+  for (i=0; i<len; i++)
   {
-    if (search_state->match_state[i] == FULFILLED &&
-        cpat->criteria[i]->wildcard == NONE_OR_ONE)
-    {
-      search_state->match_state[i] = UNIQUELY_FULFILLED;
-      return INCOMPLETE_MATCH;
-    }
+    c = cpat->criteria[i];
+    if (c->wildcard != ONE_ONLY && c->wildcard != NO_WILDCARD)
+      return;
 
-    if (search_state->match_state[i] != UNIQUELY_FULFILLED)
+    key = cpat->folded ? toupper(c->range[0]) : c->range[0];
+    for (j=1; j<c->range_count; j++)
     {
-      if (matches(byte, cpat->criteria[i]))
-      {
-        search_state->criteria_index = i+1;
-        /* now try to advance to the next non-wildcard */
-        if (matches(byte, cpat->criteria[i+1]))
-        {
-          search_state->criteria_index = i+2;
-          search_state->match_state[i+1] = UNIQUELY_FULFILLED;
-        }
-
-        return INCOMPLETE_MATCH;
-      }
-
-      search_state->match_state[i] = UNFULFILLED;
+      if ((cpat->folded ? toupper(c->range[j]) : c->range[j]) != key)
+        return;
     }
+    cpat->literal[i] = key;
   }
 
-  return NO_MATCH;
+  for (i=0; i<256; i++)
+    cpat->shift[i] = len;
+  for (i=0; i<len-1; i++)
+    cpat->shift[cpat->literal[i]] = len - 1 - i;
+
+  cpat->literal_len = len;
 }
 
-search_result_t feed_search(char byte, search_state_t *search_state)
+/* Horspool over the text folded to upper case */
+static const char *folded_search(const char *buf, int size,
+                                 compiled_pattern_t *cpat)
 {
-  int i;
-  compiled_pattern_t *cpat = &search_item[current_search].compiled_pattern;
+  const unsigned char *text = (const unsigned char *)buf;
+  int len = cpat->literal_len, pos = 0, i;
 
-  for (i=0; i<=search_state->criteria_index; i++)
+  while (pos + len <= size)
   {
-    if (i >= cpat->criteria_count)
-      return NO_MATCH;
-
-    if (search_state->match_state[i] != UNIQUELY_FULFILLED)
-    {
-      if (matches(byte, cpat->criteria[i]))
-      {
-        /* handle match */
-        if ((i+1) == cpat->criteria_count)
-          return MATCH_FOUND;
+    for (i=len-1; i>=0 && toupper(text[pos+i]) == cpat->literal[i]; i--)
+      ;
+    if (i < 0)
+      return buf + pos;
+    pos += cpat->shift[toupper(text[pos+len-1])];
+  }
 
-        switch (cpat->criteria[i]->wildcard)
-        {
-          case NO_WILDCARD:
-          case ONE_ONLY:
-            search_state->match_state[i] = UNIQUELY_FULFILLED;
-            break;
-          case NONE_OR_ONE:
-            if (search_state->match_state[i] == UNFULFILLED)
-            {
-              search_state->match_state[i] = FULFILLED;
-              if (i == search_state->criteria_index)
-                search_state->criteria_index++; /* check also next criteria since
-                                                   this can be an empty set */
-            }
-            else
-              search_state->match_state[i] = UNIQUELY_FULFILLED;
-            break;
-          case NONE_OR_MORE:
-            search_state->match_state[i] = FULFILLED;
-            if (i == search_state->criteria_index)
-              search_state->criteria_index++; /* check also next criteria since
-                                                   this can be an empty set */
-            break;
-          case ONE_OR_MORE:
-            if (search_state->match_state[i] == FULFILLED)
-              search_state->criteria_index++; /* check also next criteria since
-                                                   this can be an empty set */
-            search_state->match_state[i] = FULFILLED;
-            break;
-          default:
-            return MATCH_ERROR;
-            break;
-        }
+  return NULL;
+}
 
-        if (i == search_state->criteria_index)
-        {
-          search_state->criteria_index++;
-          return INCOMPLETE_MATCH;
-        }
+/* The leftmost match starting at or after start in buf, using the
+   given DFAs for patterns which are not plain strings */
+static int find_in(compiled_pattern_t *cpat, dfa_t *fwd, dfa_t *rev,
+                   const char *buf, int size, int start,
+                   int *match_start, int *match_end)
+{
+  const char *hit = NULL;
 
-      }
-      else
-      {
-        /* handle unmatch */
-        switch (cpat->criteria[i]->wildcard)
-        {
-          case NO_WILDCARD:
-          case ONE_ONLY:
-            if (search_state->match_state[i] == UNFULFILLED)
-              return rollback(byte, search_state);
-            break;
-          case NONE_OR_ONE:
-            if (search_state->match_state[i] == UNFULFILLED &&
-                i == search_state->criteria_index)
-                search_state->criteria_index++; /* check also next criteria since
-                                                   this can be an empty set */
-            search_state->match_state[i] = UNIQUELY_FULFILLED;
-            break;
-          case NONE_OR_MORE:
-            search_state->match_state[i] = UNIQUELY_FULFILLED;
-            if (i == search_state->criteria_index)
-              search_state->criteria_index++; /* check also next criteria since
-                                                   this can be an empty set */
-            break;
-          case ONE_OR_MORE:
-            if (search_state->match_state[i] == UNFULFILLED)
-              return rollback(byte, search_state);
-            else
-            {
-              search_state->match_state[i] = UNIQUELY_FULFILLED;
-              if (i == search_state->criteria_index)
-                search_state->criteria_index++; /* check also next criteria since
-                                                   this can be an empty set */
-            }
-            break;
-          default:
-            return MATCH_ERROR;
-            break;
-        }
+  if (cpat->literal_len > 0)
+  {
+    if (start + cpat->literal_len > size)
+      return 0;
 
-      }
-    }
+    if (cpat->folded)
+      hit = folded_search(buf + start, size - start, cpat);
+    else
+      hit = memmem(buf + start, size - start,
+                   cpat->literal, cpat->literal_len);
+    if (hit == NULL)
+      return 0;
+
+    *match_start = hit - buf;
+    *match_end = *match_start + cpat->literal_len;
+    return 1;
   }
 
-  return INCOMPLETE_MATCH;
+  if (fwd == NULL || rev == NULL || start >= size)
+    return 0;
+
+  return dfa_find(fwd, rev, buf, size, start, match_start, match_end);
 }
 
 void buf_search(search_aid_t *search_aid)
 {
-  search_state_t search_state;
-  search_result_t result;
-  int start_offset = 0, end_offset = 0;
+  compiled_pattern_t *cpat = &search_item[current_search].compiled_pattern;
+  int start_offset = 0, match_start, match_end;
 
   if (search_aid == NULL)
     return;
@@ -229,46 +191,25 @@ void buf_search(search_aid_t *search_aid)
     return;
   }
 
+  /* ignorecase may have been set since the pattern was */
+  if (cpat->folded != want_folded())
+    build_maps(cpat, want_folded());
+
   if (search_aid->hl_start == -1)
     start_offset = 0;
   else
     start_offset = search_aid->hl_start - search_aid->buf_start_addr + 1;
 
-  do
-  {
-    end_offset = 0;
-    search_state_reset(&search_state);
-    do
-    {
-      result = feed_search(search_aid->buf[start_offset + end_offset], &search_state);
-      if (result == MATCH_ERROR)
-      {
-        update_status("SEARCH ERROR! BUG?");
-        return;
-      }
-      end_offset++;
-    } while( result == INCOMPLETE_MATCH                         &&
-             (start_offset + end_offset) < search_aid->buf_size &&
-             (user_prefs[MAX_MATCH].value ?
-               (end_offset - start_offset) < user_prefs[MAX_MATCH].value :
-                1)
-           );
-
-    if (result == MATCH_FOUND)
-    {
-      search_aid->hl_start = search_aid->buf_start_addr + start_offset;
-      search_aid->hl_end = search_aid->hl_start + end_offset; /* -1? */
-    }
-
-    start_offset++;
-  } while(result != MATCH_FOUND && start_offset < search_aid->buf_size);
-
-  if (result != MATCH_FOUND)
+  if (find_in(cpat, cpat->fwd, cpat->rev, search_aid->buf,
+              search_aid->buf_size, start_offset, &match_start, &match_end))
   {
-    search_aid->hl_start = -1;
-    search_aid->hl_end = -1;
+    search_aid->hl_start = search_aid->buf_start_addr + match_start;
+    search_aid->hl_end = search_aid->buf_start_addr + match_end;
+    return;
   }
 
+  search_aid->hl_start = -1;
+  search_aid->hl_end = -1;
 }
 
 void free_compiled_pattern(compiled_pattern_t *cpat)
@@ -277,6 +218,11 @@ void free_compiled_pattern(compiled_pattern_t *cpat)
   for (i=0; i<cpat->criteria_count; i++)
     free(cpat->criteria[i]);
   cpat->criteria_count = 0;
+  cpat->literal_len = 0;
+  dfa_free(cpat->fwd);
+  dfa_free(cpat->rev);
+  cpat->fwd = NULL;
+  cpat->rev = NULL;
 }
 
 void set_search_term(char *pattern)
@@ -555,6 +501,8 @@ void set_search_term(char *pattern)
     }
   }
 
+  build_maps(cpat, want_folded());
+
   search_item[current_search].used = TRUE;
 }
 
@@ -582,6 +530,7 @@ void search_cleanup(void)
 void fill_search_buf(off_t addr, int display_size, search_aid_t *search_aid, search_direction_t direction)
 {
   off_t a;
+  size_t len;
   search_aid_t tmp_aid;
 
   if (search_aid == NULL)
@@ -602,18 +551,18 @@ void fill_search_buf(off_t addr, int display_size, search_aid_t *search_aid, sea
   if (address_invalid(a))
     a = display_info.file_size;
 
-  search_aid->buf_size = a - search_aid->buf_start_addr;
+  len = a - search_aid->buf_start_addr;
 
-  search_aid->buf = (char *)malloc(search_aid->buf_size + 1);
+  search_aid->buf = vf_get_range(current_file,
+                                 search_aid->buf_start_addr,
+                                 &len,
+                                 &search_aid->copy);
+  search_aid->buf_size = len;
   if (search_aid->buf == NULL)
   {
     msg_box("Could not allocate memory for search buf");
     return;
   }
-  vf_get_buf(current_file,
-             search_aid->buf,
-             search_aid->buf_start_addr,
-             search_aid->buf_size);
 
   tmp_aid = *search_aid;
 
@@ -653,8 +602,408 @@ void free_search_buf(search_aid_t *search_aid)
   if (search_aid->buf == NULL)
     return;
 
-  free(search_aid->buf);
+  free(search_aid->copy);
 
   search_aid->buf = NULL;
+  search_aid->copy = NULL;
 }
 
+
+
+/* The current search made ready to use: the maps follow ignorecase.
+   Returns a number which changes whenever the search does. */
+int search_serial_now(void)
+{
+  compiled_pattern_t *cpat = &search_item[current_search].compiled_pattern;
+
+  /* ignorecase may have been set since the pattern was */
+  if (search_item[current_search].used && cpat->folded != want_folded())
+    build_maps(cpat, want_folded());
+
+  return search_serial;
+}
+
+/* Ready sc to search f, of file_size bytes, with the current search.
+   The DFAs fill in as they run so each thread has its own scanner. */
+BOOL scanner_init(search_scanner_t *sc, file_manager_t *f, off_t file_size)
+{
+  memset(sc, 0, sizeof(*sc));
+  sc->cpat = &search_item[current_search].compiled_pattern;
+  sc->f = f;
+  sc->file_size = file_size;
+
+  sc->space = malloc(LONG_SEARCH_BUF_SIZE + MAX_SEARCH_PAT_LEN);
+  if (sc->space == NULL)
+    return FALSE;
+
+  if (sc->cpat->literal_len > 0)
+    return TRUE;
+
+  sc->fwd = dfa_create(sc->cpat, DFA_FORWARD);
+  sc->tail = dfa_create(sc->cpat, DFA_ANCHORED);
+  sc->rev = dfa_create(sc->cpat, DFA_REVERSE);
+  if (sc->fwd && sc->tail && sc->rev)
+    return TRUE;
+
+  scanner_term(sc);
+  return FALSE;
+}
+
+void scanner_term(search_scanner_t *sc)
+{
+  dfa_free(sc->fwd);
+  dfa_free(sc->tail);
+  dfa_free(sc->rev);
+  dfa_free(sc->prefix);
+  free(sc->space);
+  free(sc->back);
+  memset(sc, 0, sizeof(*sc));
+}
+
+/* Walk d back over [stop, end) of the file from the state at *row,
+   VF_ITER_BOUNCE at a time, until it dies.  Returns the lowest offset
+   it accepted at, or -1, and -2 if the file could not be read. */
+static off_t stream_back(search_scanner_t *sc, dfa_t *d, int *row,
+                         off_t stop, off_t end)
+{
+  const char *buf;
+  size_t len;
+  off_t start, found = -1;
+  int first;
+
+  if (sc->back == NULL)
+    sc->back = malloc(VF_ITER_BOUNCE);
+  if (sc->back == NULL)
+    return -2;
+
+  while (end > stop && !d->dead[*row >> 8])
+  {
+    start = end - VF_ITER_BOUNCE > stop ? end - VF_ITER_BOUNCE : stop;
+    len = end - start;
+    buf = vf_read_range(sc->f, start, &len, sc->back);
+    if (buf == NULL || len != end - start)
+      return -2;
+
+    first = dfa_feed_back(d, row, buf, len - 1, 0);
+    if (first >= 0)
+      found = start + first;
+    end = start;
+  }
+
+  return found;
+}
+
+/* The leftmost match starting at or after buf[pos] and before the end
+   of the chunk in buf, which starts at addr and is len long.  The
+   match may run on past the chunk as far as it likes; the DFA carries
+   on over what follows in the file, taking no new starts, until every
+   match under way has ended or died.  Returns where it starts or -1. */
+static off_t stream_find(search_scanner_t *sc, const char *buf, off_t addr,
+                         int len, int pos)
+{
+  vf_iter_t it;
+  const char *span;
+  off_t span_addr, end = -1;
+  size_t span_len;
+  int row, hit;
+
+  if (pos >= len)
+    return -1;
+
+  /* the chunk but its last byte, after which no match may start */
+  row = sc->fwd->start_row;
+  hit = dfa_feed(sc->fwd, &row, buf, pos, len - 1);
+  if (hit < 0)
+  {
+    row = dfa_carry(sc->tail, sc->fwd, row);
+    hit = dfa_feed(sc->tail, &row, buf, len - 1, len);
+    if (hit >= 0 && sc->tail->dead[row >> 8])
+      return -1;
+  }
+
+  if (hit >= 0)
+  {
+    row = sc->rev->start_row;
+    hit = dfa_feed_back(sc->rev, &row, buf, hit, pos);
+    return hit >= 0 ? addr + hit : -1;
+  }
+
+  /* matches are still under way at the end of the chunk */
+  vf_iter_init(&it, sc->f, addr + len, sc->file_size - addr - len);
+  span_addr = addr + len;
+  while ((span_len = vf_iter_next(&it, &span)) > 0)
+  {
+    hit = dfa_feed(sc->tail, &row, span, 0, span_len);
+    if (hit >= 0)
+    {
+      if (!sc->tail->dead[row >> 8])
+        end = span_addr + hit + 1;
+      break;
+    }
+    span_addr += span_len;
+  }
+  vf_iter_term(&it);
+
+  if (end == -1)
+    return -1;
+
+  /* any match the walk back finds past the chunk starts too late */
+  row = sc->rev->start_row;
+  if (stream_back(sc, sc->rev, &row, addr + len, end) == -2 ||
+      sc->rev->dead[row >> 8])
+    return -1;
+
+  hit = dfa_feed_back(sc->rev, &row, buf, len - 1, pos);
+  return hit >= 0 ? addr + hit : -1;
+}
+
+/* Hand each match starting in [start, end), in order, to each until
+   it returns non zero.  end - start is at most LONG_SEARCH_BUF_SIZE.
+   Where the chunk is not in memory it is read into the scanner's
+   space, which holds a chunk and a plain string. */
+void scanner_matches(search_scanner_t *sc, off_t start, off_t end,
+                     int (*each)(void *data, off_t addr), void *data)
+{
+  const char *buf;
+  size_t len;
+  off_t hit;
+  int pos = 0, chunk, match_start, match_end;
+
+  /* a plain string needs all of itself, the DFAs stream on as needed */
+  len = end - start;
+  if (sc->cpat->literal_len > 0)
+    len += sc->cpat->literal_len - 1;
+  if (start + (off_t)len > sc->file_size)
+    len = sc->file_size - start;
+
+  buf = vf_read_range(sc->f, start, &len, sc->space);
+  if (buf == NULL)
+    return;
+
+  chunk = end - start < len ? end - start : len;
+
+  while (pos < chunk)
+  {
+    if (sc->cpat->literal_len > 0)
+    {
+      if (!find_in(sc->cpat, NULL, NULL, buf, len, pos,
+                   &match_start, &match_end) || match_start >= chunk)
+        break;
+      hit = start + match_start;
+    }
+    else
+    {
+      hit = stream_find(sc, buf, start, chunk, pos);
+      if (hit == -1)
+        break;
+    }
+
+    if (each(data, hit))
+      break;
+    pos = hit - start + 1;
+  }
+}
+
+/* Where the first match that a change at offset may alter can start:
+   the lowest start of a match still under way at offset, looking no
+   more than limit bytes back.  Returns offset if there are none, or -1
+   if they go back further than limit. */
+off_t scanner_reach(search_scanner_t *sc, off_t offset, off_t limit)
+{
+  off_t stop, first;
+  int row;
+
+  if (sc->cpat->literal_len > 0)
+  {
+    first = offset - (sc->cpat->literal_len - 1);
+    return first > 0 ? first : 0;
+  }
+
+  if (sc->prefix == NULL)
+    sc->prefix = dfa_create(sc->cpat, DFA_PREFIX);
+  if (sc->prefix == NULL)
+    return -1;
+
+  stop = offset > limit ? offset - limit : 0;
+  row = sc->prefix->start_row;
+  first = stream_back(sc, sc->prefix, &row, stop, offset);
+  if (first == -2 || (stop > 0 && !sc->prefix->dead[row >> 8]))
+    return -1;
+
+  return first >= 0 ? first : offset;
+}
+
+
+/* Shared by the workers of one search_range call */
+typedef struct range_search_s
+{
+  pthread_mutex_t lock;
+  search_direction_t direction;
+  off_t from;
+  off_t to;
+  off_t file_size;
+  long chunks;
+  long next_chunk;              /* the next chunk to hand out */
+  long prefetched;              /* chunks below this were read ahead */
+  long found_chunk;             /* nearest chunk with a match so far */
+  off_t found;
+  off_t *current;
+  int *abort;
+} range_search_t;
+
+/* Chunk k counts out from the cursor, so a lower k is always nearer */
+static void chunk_bounds(range_search_t *rs, long k, off_t *start, off_t *end)
+{
+  if (rs->direction == SEARCH_FORWARD)
+  {
+    *start = rs->from + (off_t)k * LONG_SEARCH_BUF_SIZE;
+    *end = *start + LONG_SEARCH_BUF_SIZE;
+    if (*end > rs->to)
+      *end = rs->to;
+  }
+  else
+  {
+    *end = rs->to - (off_t)k * LONG_SEARCH_BUF_SIZE;
+    *start = *end - LONG_SEARCH_BUF_SIZE;
+    if (*start < rs->from)
+      *start = rs->from;
+  }
+}
+
+/* Start reading chunks [first, last), which lie next to each other
+   in the file */
+static void prefetch_chunks(range_search_t *rs, long first, long last)
+{
+  off_t first_start, first_end, last_start, last_end;
+
+  chunk_bounds(rs, first, &first_start, &first_end);
+  chunk_bounds(rs, last - 1, &last_start, &last_end);
+
+  if (rs->direction == SEARCH_FORWARD)
+    vf_prefetch(current_file, first_start, last_end - first_start);
+  else
+    vf_prefetch(current_file, last_start, first_end - last_start);
+}
+
+/* The first match in a chunk going forward stops the scan, going
+   backward the last one is kept */
+static int first_match(void *data, off_t addr)
+{
+  *(off_t *)data = addr;
+  return 1;
+}
+
+static int last_match(void *data, off_t addr)
+{
+  *(off_t *)data = addr;
+  return 0;
+}
+
+/* Take chunks in order until one nearer than any left has a match,
+   keeping SEARCH_READ_AHEAD chunks past the last one taken on their
+   way in from the disk while the matching runs */
+static void *range_worker(void *data)
+{
+  range_search_t *rs = data;
+  search_scanner_t sc;
+  off_t start, end, found;
+  long k, first, last;
+
+  if (!scanner_init(&sc, current_file, rs->file_size))
+    return NULL;
+
+  while (*rs->abort == 0)
+  {
+    pthread_mutex_lock(&rs->lock);
+    k = rs->next_chunk++;
+    if (k >= rs->chunks || k > rs->found_chunk)
+    {
+      pthread_mutex_unlock(&rs->lock);
+      break;
+    }
+    chunk_bounds(rs, k, &start, &end);
+    *rs->current = rs->direction == SEARCH_FORWARD ? start : end;
+    first = rs->prefetched;
+    last = rs->next_chunk + SEARCH_READ_AHEAD;
+    if (last > rs->chunks)
+      last = rs->chunks;
+    if (last > first)
+      rs->prefetched = last;
+    pthread_mutex_unlock(&rs->lock);
+
+    if (last > first)
+      prefetch_chunks(rs, first, last);
+
+    found = -1;
+    scanner_matches(&sc, start, end,
+                    rs->direction == SEARCH_FORWARD ? first_match : last_match,
+                    &found);
+    if (found == -1)
+      continue;
+
+    pthread_mutex_lock(&rs->lock);
+    if (k < rs->found_chunk)
+    {
+      rs->found_chunk = k;
+      rs->found = found;
+    }
+    pthread_mutex_unlock(&rs->lock);
+  }
+
+  scanner_term(&sc);
+  return NULL;
+}
+
+/* Search [from, to) of the current file with the current search,
+   LONG_SEARCH_BUF_SIZE at a time spread over a thread per core.
+   Returns where the first match starts going forward, or the last
+   going backward, else -1.  current tracks progress and a non zero
+   abort stops the search. */
+off_t search_range(off_t from, off_t to, search_direction_t direction,
+                   off_t *current, int *abort)
+{
+  pthread_t threads[MAX_SEARCH_THREADS];
+  range_search_t rs;
+  long cpus;
+  int i, thread_count;
+
+  if (search_item[current_search].used == FALSE || from >= to)
+    return -1;
+
+  search_serial_now();
+
+  rs.direction = direction;
+  rs.from = from;
+  rs.to = to;
+  rs.file_size = display_info.file_size;
+  rs.chunks = (to - from + LONG_SEARCH_BUF_SIZE - 1) / LONG_SEARCH_BUF_SIZE;
+  rs.next_chunk = 0;
+  rs.prefetched = 0;
+  rs.found_chunk = rs.chunks;
+  rs.found = -1;
+  rs.current = current;
+  rs.abort = abort;
+  pthread_mutex_init(&rs.lock, NULL);
+
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  thread_count = cpus < 1 ? 1 : cpus > MAX_SEARCH_THREADS ? MAX_SEARCH_THREADS : cpus;
+  if (thread_count > rs.chunks)
+    thread_count = rs.chunks;
+
+  /* the calling thread is one of the workers */
+  for (i=1; i<thread_count; i++)
+  {
+    if (pthread_create(&threads[i], NULL, range_worker, &rs) != 0)
+      break;
+  }
+  thread_count = i;
+
+  range_worker(&rs);
+
+  for (i=1; i<thread_count; i++)
+    pthread_join(threads[i], NULL);
+
+  pthread_mutex_destroy(&rs.lock);
+
+  return rs.found;
+}
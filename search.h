@@ -33,6 +33,8 @@
 #define MAX_RANGE_COUNT 256
 #define MAX_SEARCH_PAT_LEN 256
 #define LONG_SEARCH_BUF_SIZE (1024*1024*2) /* 2MB */
+#define MAX_SEARCH_THREADS 16
+#define SEARCH_READ_AHEAD 4 /* chunks read ahead of the search */
 
 typedef enum
 {
@@ -46,14 +48,6 @@ typedef enum
   SEARCH_FORWARD
 } search_direction_t;
 
-typedef enum
-{
-  NO_MATCH,
-  INCOMPLETE_MATCH,
-  MATCH_FOUND,
-  MATCH_ERROR
-} search_result_t;
-
 typedef enum
 {
   NO_WILDCARD,
@@ -63,30 +57,24 @@ typedef enum
   ONE_ONLY
 } wildcard_t;
 
-typedef enum
-{
-  UNFULFILLED,
-  FULFILLED,
-  UNIQUELY_FULFILLED
-} match_state_t;
-
-typedef struct search_state_s
-{
-  int criteria_index;
-  match_state_t match_state[MAX_SEARCH_PAT_LEN];
-} search_state_t;
-
 typedef struct match_criteria_s
 {
   unsigned char range[256];
   int range_count;
+  unsigned char map[256 / 8];   /* range as a bitmap, case folded for ic */
   wildcard_t wildcard;
 } match_criteria_t;
 
 typedef struct compiled_pattern_s
 {
   int criteria_count;
+  int folded;                   /* the maps were built for ignorecase */
   match_criteria_t *criteria[MAX_SEARCH_PAT_LEN];
+  int literal_len;              /* 0 unless the pattern is a plain string */
+  unsigned char literal[MAX_SEARCH_PAT_LEN]; /* upper case when folded */
+  int shift[256];               /* Horspool skips for the folded string */
+  struct dfa_s *fwd;            /* finds where the earliest match ends */
+  struct dfa_s *rev;            /* and from there where it starts */
 } compiled_pattern_t;
 
 typedef struct search_item_s
@@ -101,7 +89,8 @@ typedef struct search_item_s
 
 typedef struct search_aid_s
 {
-  char *buf;
+  const char *buf;              /* in place in the file where possible */
+  char *copy;                   /* otherwise a copy, freed with the aid */
   int buf_size;
   off_t buf_start_addr;
   off_t display_addr;
@@ -109,6 +98,21 @@ typedef struct search_aid_s
   off_t hl_end;
 } search_aid_t;
 
+/* One thread's means of matching the current search over a file.
+   See scanner_init(). */
+typedef struct search_scanner_s
+{
+  compiled_pattern_t *cpat;
+  file_manager_t *f;
+  off_t file_size;
+  struct dfa_s *fwd;            /* finds where the first match ends */
+  struct dfa_s *tail;           /* past a chunk, takes no new starts */
+  struct dfa_s *rev;            /* back from the end to the start */
+  struct dfa_s *prefix;         /* back to where a match may be under way */
+  char *space;                  /* a chunk, where it is not in memory */
+  char *back;                   /* what is walked back over past a chunk */
+} search_scanner_t;
+
 extern search_item_t search_item[];
 extern int current_search;
 
@@ -118,7 +122,13 @@ void search_init(void);
 void search_cleanup(void);
 void fill_search_buf(off_t addr, int display_size, search_aid_t *search_aid, search_direction_t direction);
 void free_search_buf(search_aid_t *search_aid);
-
-inline int matches(unsigned char byte, match_criteria_t *criteria);
+off_t search_range(off_t from, off_t to, search_direction_t direction,
+                   off_t *current, int *abort);
+int search_serial_now(void);
+BOOL scanner_init(search_scanner_t *sc, file_manager_t *f, off_t file_size);
+void scanner_term(search_scanner_t *sc);
+void scanner_matches(search_scanner_t *sc, off_t start, off_t end,
+                     int (*each)(void *data, off_t addr), void *data);
+off_t scanner_reach(search_scanner_t *sc, off_t offset, off_t limit);
 
 #endif /* __SEARCH_H__ */
@@ -0,0 +1,435 @@
+/*************************************************************
+ *
+ * File:        search_dfa.c
+ * Author:      David Kelley
+ * Description: Search patterns compiled to an NFA over bytes and
+ *              matched with DFAs built from it as they are used
+ *
+ * Copyright (C) 2009 David Kelley
+ *
+ * This file is part of bviplus.
+ *
+ * Bviplus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bviplus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bviplus.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "search_dfa.h"
+
+static void set_add(nfa_set_t *set, int i)
+{
+  set->bits[i >> 6] |= (uint64_t)1 << (i & 63);
+}
+
+static int set_has(const nfa_set_t *set, int i)
+{
+  return (set->bits[i >> 6] >> (i & 63)) & 1;
+}
+
+static int set_empty(const nfa_set_t *set)
+{
+  int i;
+
+  for (i=0; i<NFA_SET_WORDS; i++)
+  {
+    if (set->bits[i])
+      return 0;
+  }
+
+  return 1;
+}
+
+/* Reverse and prefix DFAs take the bytes from last to first */
+static int backward(dfa_t *d)
+{
+  return d->kind == DFA_REVERSE || d->kind == DFA_PREFIX;
+}
+
+static int map_has(dfa_t *d, int i, unsigned char byte)
+{
+  return d->map[i][byte >> 3] & (1 << (byte & 7));
+}
+
+static void add_criterion(dfa_t *d, match_criteria_t *c, nfa_step_t step)
+{
+  memcpy(d->map[d->count], c->map, sizeof(c->map));
+  d->step[d->count] = step;
+  d->count++;
+}
+
+/* Follow the criteria that may match nothing */
+static void closure(dfa_t *d, nfa_set_t *set)
+{
+  int i;
+
+  if (backward(d))
+  {
+    for (i=d->count-1; i>=0; i--)
+    {
+      if (d->step[i] != NFA_ONE && set_has(set, i+1))
+        set_add(set, i);
+    }
+  }
+  else
+  {
+    for (i=0; i<d->count; i++)
+    {
+      if (d->step[i] != NFA_ONE && set_has(set, i))
+        set_add(set, i+1);
+    }
+  }
+}
+
+/* The NFA states after byte from those in the set */
+static void move(dfa_t *d, const nfa_set_t *from, unsigned char byte,
+                 nfa_set_t *to)
+{
+  uint64_t bits;
+  int w, i;
+
+  memset(to, 0, sizeof(*to));
+
+  for (w=0; w<NFA_SET_WORDS; w++)
+  {
+    for (bits = from->bits[w]; bits; bits &= bits - 1)
+    {
+      i = w * 64 + __builtin_ctzll(bits);
+
+      if (backward(d))
+      {
+        if (i < d->count && d->step[i] == NFA_REPEAT && map_has(d, i, byte))
+          set_add(to, i);
+        if (i > 0 && d->step[i-1] != NFA_REPEAT && map_has(d, i-1, byte))
+          set_add(to, i-1);
+      }
+      else if (i < d->count && map_has(d, i, byte))
+      {
+        set_add(to, d->step[i] == NFA_REPEAT ? i : i+1);
+      }
+    }
+  }
+
+  closure(d, to);
+
+  /* a match may start at any byte */
+  if (d->kind == DFA_FORWARD)
+  {
+    for (w=0; w<NFA_SET_WORDS; w++)
+      to->bits[w] |= d->start.bits[w];
+  }
+}
+
+static unsigned int set_hash(const nfa_set_t *set)
+{
+  const unsigned char *p = (const unsigned char *)set;
+  unsigned int hash = 2166136261U;
+  size_t i;
+
+  for (i=0; i<sizeof(*set); i++)
+    hash = (hash ^ p[i]) * 16777619U;
+
+  return hash;
+}
+
+/* The row of the DFA state for a set of NFA states, made if it is new.
+   Returns -1 when the cache is full. */
+static int find_state(dfa_t *d, const nfa_set_t *set)
+{
+  unsigned int h = set_hash(set) % DFA_HASH_SIZE;
+  int alloc, s;
+  void *tmp[5];
+
+  while (d->hash[h] != DFA_UNKNOWN)
+  {
+    if (memcmp(&d->sets[d->hash[h]], set, sizeof(*set)) == 0)
+      return d->hash[h] << 8;
+    h = (h + 1) % DFA_HASH_SIZE;
+  }
+
+  if (d->state_count == MAX_DFA_STATES)
+    return -1;
+
+  if (d->state_count == d->state_alloc)
+  {
+    alloc = d->state_alloc ? d->state_alloc * 2 : 16;
+    tmp[0] = realloc(d->sets, alloc * sizeof(nfa_set_t));
+    if (tmp[0] != NULL)
+      d->sets = tmp[0];
+    tmp[1] = realloc(d->accept, alloc);
+    if (tmp[1] != NULL)
+      d->accept = tmp[1];
+    tmp[2] = realloc(d->dead, alloc);
+    if (tmp[2] != NULL)
+      d->dead = tmp[2];
+    tmp[3] = realloc(d->next, alloc * 256 * sizeof(int));
+    if (tmp[3] != NULL)
+      d->next = tmp[3];
+    tmp[4] = realloc(d->halt, alloc);
+    if (tmp[4] != NULL)
+      d->halt = tmp[4];
+    if (!tmp[0] || !tmp[1] || !tmp[2] || !tmp[3] || !tmp[4])
+      return -1;
+    d->state_alloc = alloc;
+  }
+
+  s = d->state_count++;
+  d->sets[s] = *set;
+  d->accept[s] = set_has(set, backward(d) ? 0 : d->count);
+  d->dead[s] = set_empty(set);
+  d->halt[s] = d->accept[s] || d->dead[s];
+  memset(&d->next[s << 8], DFA_UNKNOWN, 256 * sizeof(int));
+
+  d->hash[h] = s;
+  return s << 8;
+}
+
+/* Start the cache over, holding only the start state */
+static void flush(dfa_t *d)
+{
+  memset(d->hash, DFA_UNKNOWN, sizeof(d->hash));
+  d->state_count = 0;
+  d->start_row = find_state(d, &d->start);
+}
+
+/* Take the transition from the state at row on byte, working it out
+   the first time. row is not valid after the call. */
+static int dfa_next(dfa_t *d, int row, unsigned char byte)
+{
+  nfa_set_t to;
+  int n;
+
+  move(d, &d->sets[row >> 8], byte, &to);
+  n = find_state(d, &to);
+  if (n < 0)
+  {
+    flush(d);
+    return find_state(d, &to);
+  }
+
+  d->next[row + byte] = n;
+  return n;
+}
+
+/* A match always ends on a byte of the last criterion, so the one it
+   ends on is all a trailing wildcard takes from a shortest match */
+dfa_t *dfa_create(compiled_pattern_t *cpat, dfa_kind_t kind)
+{
+  unsigned char first[256 / 8];
+  match_criteria_t *c;
+  dfa_t *d;
+  int i, j;
+
+  if (cpat->criteria_count < 1)
+    return NULL;
+
+  d = calloc(1, sizeof(dfa_t));
+  if (d == NULL)
+    return NULL;
+
+  d->kind = kind;
+
+  for (i=0; i<cpat->criteria_count; i++)
+  {
+    c = cpat->criteria[i];
+    if (i == cpat->criteria_count - 1)
+    {
+      add_criterion(d, c, NFA_ONE);
+      continue;
+    }
+
+    switch (c->wildcard)
+    {
+      case NONE_OR_ONE:
+        add_criterion(d, c, NFA_OPTIONAL);
+        break;
+      case NONE_OR_MORE:
+        add_criterion(d, c, NFA_REPEAT);
+        break;
+      case ONE_OR_MORE:
+        add_criterion(d, c, NFA_ONE);
+        add_criterion(d, c, NFA_REPEAT);
+        break;
+      default:
+        add_criterion(d, c, NFA_ONE);
+        break;
+    }
+  }
+
+  /* a prefix DFA starts with every state short of a match */
+  if (kind == DFA_PREFIX)
+  {
+    for (i=0; i<d->count; i++)
+      set_add(&d->start, i);
+  }
+  else
+    set_add(&d->start, kind == DFA_REVERSE ? d->count : 0);
+  closure(d, &d->start);
+
+  if (kind == DFA_FORWARD)
+  {
+    memset(first, 0, sizeof(first));
+    for (i=0; i<d->count; i++)
+    {
+      for (j=0; set_has(&d->start, i) && j<sizeof(first); j++)
+        first[j] |= d->map[i][j];
+    }
+    byte_set_build(&d->first, first);
+    d->scan_first = d->first.count <= DFA_SCAN_MAX;
+  }
+
+  flush(d);
+  if (d->start_row < 0)
+  {
+    dfa_free(d);
+    return NULL;
+  }
+
+  return d;
+}
+
+void dfa_free(dfa_t *d)
+{
+  if (d == NULL)
+    return;
+
+  free(d->sets);
+  free(d->accept);
+  free(d->dead);
+  free(d->next);
+  free(d->halt);
+  free(d);
+}
+
+/* Feed buf[pos] to buf[size-1] to a forward or anchored DFA from the
+   state at *row, which is left at the state reached.  Returns the
+   position of the byte it accepted or died on, or -1 if it took them
+   all and can go on with the next buffer.
+   While an unanchored DFA is in its start state any byte a match
+   cannot start with leaves it there, so those are skipped a vector at
+   a time. */
+static inline int feed(dfa_t *d, int *row, const char *buf, int pos, int size)
+{
+  const unsigned char *text = (const unsigned char *)buf;
+  int state = *row, n, from;
+  int scanning = d->scan_first, credit = DFA_SCAN_CREDIT;
+  int *next = d->next;
+
+  for (; pos<size; pos++)
+  {
+    /* nothing is under way, so go straight to where one can start */
+    if (scanning && state == d->start_row)
+    {
+      from = pos;
+      pos = scan_set(&d->first, buf, pos, size);
+      if (pos >= size)
+        break;
+
+      /* stop once candidates come too thick to be worth it */
+      if (pos - from < DFA_SCAN_MIN_SKIP)
+        scanning = --credit > 0;
+      else if (credit < DFA_SCAN_CREDIT)
+        credit++;
+    }
+
+    n = next[state + text[pos]];
+    if (n == DFA_UNKNOWN)
+    {
+      n = dfa_next(d, state, text[pos]);
+      next = d->next;
+    }
+    state = n;
+    if (d->halt[state >> 8])
+    {
+      *row = state;
+      return pos;
+    }
+  }
+
+  *row = state;
+  return -1;
+}
+
+/* Feed buf[pos] down to buf[stop] to a reverse DFA from the state at
+   *row, which is left at the state reached.  Returns the lowest
+   position it accepted at, where the leftmost match starts, or -1. */
+static inline int feed_back(dfa_t *d, int *row, const char *buf, int pos,
+                            int stop)
+{
+  const unsigned char *text = (const unsigned char *)buf;
+  int state = *row, n, first = -1;
+
+  for (; pos>=stop; pos--)
+  {
+    n = d->next[state + text[pos]];
+    state = n != DFA_UNKNOWN ? n : dfa_next(d, state, text[pos]);
+    if (d->dead[state >> 8])
+      break;
+    if (d->accept[state >> 8])
+      first = pos;
+  }
+
+  *row = state;
+  return first;
+}
+
+/* For a search streaming through the file, while dfa_find has the
+   loops inline where matches come thick */
+int dfa_feed(dfa_t *d, int *row, const char *buf, int pos, int size)
+{
+  return feed(d, row, buf, pos, size);
+}
+
+int dfa_feed_back(dfa_t *d, int *row, const char *buf, int pos, int stop)
+{
+  return feed_back(d, row, buf, pos, stop);
+}
+
+/* The row in to of the state at row in from, to go on from where from
+   got to under another kind of DFA for the same pattern */
+int dfa_carry(dfa_t *to, dfa_t *from, int row)
+{
+  int n;
+
+  n = find_state(to, &from->sets[row >> 8]);
+  if (n < 0)
+  {
+    flush(to);
+    n = find_state(to, &from->sets[row >> 8]);
+  }
+
+  return n;
+}
+
+/* The leftmost shortest match starting at or after start. The forward
+   DFA finds where the earliest match ends, then the reverse one walks
+   back from there to the leftmost start of a match ending there. */
+int dfa_find(dfa_t *fwd, dfa_t *rev, const char *buf, int size,
+             int start, int *match_start, int *match_end)
+{
+  int row, end, first;
+
+  row = fwd->start_row;
+  end = feed(fwd, &row, buf, start, size);
+  if (end < 0)
+    return 0;
+
+  *match_end = end + 1;
+
+  row = rev->start_row;
+  first = feed_back(rev, &row, buf, end, start);
+
+  *match_start = first;
+  return first >= 0;
+}
@@ -0,0 +1,102 @@
+/*************************************************************
+ *
+ * File:        search_dfa.h
+ * Author:      David Kelley
+ * Description: Defines, structures, and function prototypes
+ *              related to matching search patterns with a lazily
+ *              built DFA
+ *
+ * Copyright (C) 2009 David Kelley
+ *
+ * This file is part of bviplus.
+ *
+ * Bviplus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bviplus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bviplus.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *************************************************************/
+
+#include <stdint.h>
+#include "search.h"
+#include "search_scan.h"
+
+#ifndef __SEARCH_DFA_H__
+#define __SEARCH_DFA_H__
+
+/* A '+' becomes a criterion and a '*' of it, so up to twice as many */
+#define MAX_NFA_STATES (2 * MAX_SEARCH_PAT_LEN)
+#define NFA_SET_WORDS ((MAX_NFA_STATES + 1 + 63) / 64)
+#define MAX_DFA_STATES 1024 /* the cache is flushed when full */
+#define DFA_HASH_SIZE (2 * MAX_DFA_STATES)
+#define DFA_UNKNOWN -1
+#define DFA_SCAN_MAX 64 /* bigger first byte sets are not worth scanning for */
+#define DFA_SCAN_MIN_SKIP 4 /* nor are candidates closer together than this */
+#define DFA_SCAN_CREDIT 8
+
+typedef enum
+{
+  DFA_FORWARD,                  /* a match may start at any byte */
+  DFA_ANCHORED,                 /* only those already under way go on */
+  DFA_REVERSE,
+  DFA_PREFIX                    /* back to where what follows may go on */
+} dfa_kind_t;
+
+typedef enum
+{
+  NFA_ONE,
+  NFA_OPTIONAL,
+  NFA_REPEAT
+} nfa_step_t;
+
+typedef struct nfa_set_s
+{
+  uint64_t bits[NFA_SET_WORDS];
+} nfa_set_t;
+
+/* Criteria are NFA states 0 to count-1, count is the accepting state.
+   The forward DFA is unanchored and accepts where the earliest match
+   ends, the reverse one runs back from there to the leftmost start.
+   An anchored one carries on from a forward state with no new starts.
+   A prefix one runs back from a point to the starts of the matches
+   which may still be under way there.
+   DFA states are known by their row in next, state * 256, so taking a
+   transition is a single load. */
+typedef struct dfa_s
+{
+  dfa_kind_t kind;
+  int count;
+  unsigned char map[MAX_NFA_STATES][256 / 8];
+  nfa_step_t step[MAX_NFA_STATES];
+  nfa_set_t start;
+  nfa_set_t *sets;              /* the NFA states each DFA state stands for */
+  unsigned char *accept;
+  unsigned char *dead;
+  unsigned char *halt;          /* accept or dead, a forward feed stops */
+  int *next;                    /* 256 per state, the row of the state a byte
+                                   leads to or DFA_UNKNOWN until first taken */
+  int state_count;
+  int state_alloc;
+  int hash[DFA_HASH_SIZE];
+  int start_row;
+  byte_set_t first;             /* bytes that can start a match */
+  int scan_first;               /* skip to them while in the start state */
+} dfa_t;
+
+dfa_t *dfa_create(compiled_pattern_t *cpat, dfa_kind_t kind);
+void   dfa_free(dfa_t *d);
+int    dfa_feed(dfa_t *d, int *row, const char *buf, int pos, int size);
+int    dfa_feed_back(dfa_t *d, int *row, const char *buf, int pos, int stop);
+int    dfa_carry(dfa_t *to, dfa_t *from, int row);
+int    dfa_find(dfa_t *fwd, dfa_t *rev, const char *buf, int size,
+                int start, int *match_start, int *match_end);
+
+#endif /* __SEARCH_DFA_H__ */
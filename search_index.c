@@ -0,0 +1,449 @@
+/*************************************************************
+ *
+ * File:        search_index.c
+ * Author:      David Kelley
+ * Description: Counts where the current search matches in the
+ *              current file while waiting for keys, and keeps the
+ *              count up to date as the file is edited
+ *
+ * Copyright (C) 2009 David Kelley
+ *
+ * This file is part of bviplus.
+ *
+ * Bviplus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bviplus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bviplus.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "search.h"
+#include "search_index.h"
+#include "app_state.h"
+
+typedef struct index_span_s
+{
+  off_t start;
+  off_t end;
+} index_span_t;
+
+typedef struct hit_list_s
+{
+  off_t *hits;
+  long count;
+  long alloc;
+} hit_list_t;
+
+/* The worker only counts between search_index_resume() and
+   search_index_pause(), while the main thread waits for a key, so
+   everything else here is the main thread's whenever it is running */
+static struct
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  BOOL started;
+  BOOL run;                     /* the worker may count */
+  BOOL busy;                    /* and is counting a slice */
+  BOOL quit;
+  index_state_t state;
+  file_manager_t *f;            /* the file counted, NULL for none */
+  int serial;                   /* and the search it was counted for */
+  off_t file_size;
+  search_scanner_t sc;
+  hit_list_t found;             /* where matches start, in order */
+  index_span_t todo[INDEX_MAX_TODO + 1]; /* not counted yet, in order */
+  int todo_count;
+  off_t todo_left;              /* bytes in todo */
+} idx;
+
+/* The first k with hits[k] >= addr */
+static long lower_bound(off_t addr)
+{
+  long lo = 0, hi = idx.found.count, mid;
+
+  while (lo < hi)
+  {
+    mid = lo + (hi - lo) / 2;
+    if (idx.found.hits[mid] < addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+static int add_hit(void *data, off_t addr)
+{
+  hit_list_t *list = data;
+  off_t *tmp;
+
+  if (list->count == list->alloc)
+  {
+    tmp = realloc(list->hits, (list->alloc * 2 + 1024) * sizeof(off_t));
+    if (tmp == NULL)
+      return 1;
+    list->hits = tmp;
+    list->alloc = list->alloc * 2 + 1024;
+  }
+
+  list->hits[list->count++] = addr;
+  return 0;
+}
+
+/* Forget any hits in [start, end) */
+static void drop_hits(off_t start, off_t end)
+{
+  long first, last;
+
+  first = lower_bound(start);
+  last = lower_bound(end);
+  memmove(&idx.found.hits[first], &idx.found.hits[last],
+          (idx.found.count - last) * sizeof(off_t));
+  idx.found.count -= last - first;
+}
+
+static void stop_counting(void)
+{
+  if (idx.f != NULL)
+  {
+    vf_set_edit_hook(idx.f, NULL);
+    scanner_term(&idx.sc);
+  }
+
+  free(idx.found.hits);
+  memset(&idx.found, 0, sizeof(idx.found));
+  idx.f = NULL;
+  idx.todo_count = 0;
+  idx.todo_left = 0;
+  idx.state = INDEX_NONE;
+}
+
+/* Slices are counted into the index in order, so it stays sorted */
+static void add_slice(off_t start, off_t end, hit_list_t *list)
+{
+  long k;
+  off_t *tmp;
+
+  if (idx.found.count + list->count > INDEX_MAX_HITS)
+  {
+    free(idx.found.hits);
+    memset(&idx.found, 0, sizeof(idx.found));
+    idx.todo_count = 0;
+    idx.todo_left = 0;
+    idx.state = INDEX_TOO_MANY;
+    return;
+  }
+
+  if (idx.found.count + list->count > idx.found.alloc)
+  {
+    tmp = realloc(idx.found.hits,
+                  (idx.found.count + list->count) * 2 * sizeof(off_t));
+    if (tmp == NULL)
+    {
+      stop_counting();
+      return;
+    }
+    idx.found.hits = tmp;
+    idx.found.alloc = (idx.found.count + list->count) * 2;
+  }
+
+  k = lower_bound(start);
+  memmove(&idx.found.hits[k + list->count], &idx.found.hits[k],
+          (idx.found.count - k) * sizeof(off_t));
+  memcpy(&idx.found.hits[k], list->hits, list->count * sizeof(off_t));
+  idx.found.count += list->count;
+
+  idx.todo[0].start = end;
+  if (idx.todo[0].start == idx.todo[0].end)
+  {
+    idx.todo_count--;
+    memmove(&idx.todo[0], &idx.todo[1], idx.todo_count * sizeof(index_span_t));
+  }
+  idx.todo_left -= end - start;
+
+  if (idx.todo_count == 0)
+    idx.state = INDEX_READY;
+}
+
+static void *index_worker(void *data)
+{
+  hit_list_t list;
+  off_t start, end;
+
+  memset(&list, 0, sizeof(list));
+
+  pthread_mutex_lock(&idx.lock);
+  while (idx.quit == FALSE)
+  {
+    if (idx.run == FALSE || idx.state != INDEX_COUNTING)
+    {
+      pthread_cond_wait(&idx.cond, &idx.lock);
+      continue;
+    }
+
+    start = idx.todo[0].start;
+    end = idx.todo[0].end;
+    if (end - start > INDEX_SLICE)
+      end = start + INDEX_SLICE;
+    idx.busy = TRUE;
+    pthread_mutex_unlock(&idx.lock);
+
+    list.count = 0;
+    scanner_matches(&idx.sc, start, end, add_hit, &list);
+
+    pthread_mutex_lock(&idx.lock);
+    add_slice(start, end, &list);
+    idx.busy = FALSE;
+    pthread_cond_broadcast(&idx.cond);
+  }
+  pthread_mutex_unlock(&idx.lock);
+
+  free(list.hits);
+  return NULL;
+}
+
+/* Merge the two spans left to count with the least between them,
+   which then has to be counted again */
+static void merge_closest(void)
+{
+  int i, best = 0;
+
+  for (i=1; i<idx.todo_count-1; i++)
+  {
+    if (idx.todo[i+1].start - idx.todo[i].end <
+        idx.todo[best+1].start - idx.todo[best].end)
+      best = i;
+  }
+
+  drop_hits(idx.todo[best].end, idx.todo[best+1].start);
+  idx.todo[best].end = idx.todo[best+1].end;
+  idx.todo_count--;
+  memmove(&idx.todo[best+1], &idx.todo[best+2],
+          (idx.todo_count - best - 1) * sizeof(index_span_t));
+}
+
+/* Where offset, from before len bytes there became new_len, is now */
+static off_t moved(off_t addr, off_t offset, off_t len, off_t new_len)
+{
+  if (addr <= offset)
+    return addr;
+  if (addr >= offset + len)
+    return addr + new_len - len;
+  return offset + new_len;
+}
+
+/* Told by the file after each edit.  A match can only change if it
+   starts in what was replaced or runs into it from before, so those
+   are dropped and counted again, and the rest move with the bytes. */
+static void edit_hook(file_manager_t *f, off_t offset, off_t len,
+                      off_t new_len)
+{
+  off_t reach;
+  long k;
+  int i, j;
+
+  if (f != idx.f)
+    return;
+
+  /* the file is going, or a macro set a new search and edited on */
+  if (offset == -1 || idx.serial != search_serial_now())
+  {
+    stop_counting();
+    return;
+  }
+
+  idx.file_size += new_len - len;
+  idx.sc.file_size = idx.file_size;
+
+  /* an edit is not going to bring it back under INDEX_MAX_HITS, so
+     keep saying so rather than count the whole file again */
+  if (idx.state == INDEX_TOO_MANY)
+    return;
+
+  reach = scanner_reach(&idx.sc, offset, INDEX_REACH_LIMIT);
+  if (reach == -1)
+    reach = 0;
+
+  drop_hits(reach, offset + len);
+  for (k=lower_bound(offset + len); k<idx.found.count; k++)
+    idx.found.hits[k] += new_len - len;
+
+  /* move what was left to count, then add what has to be counted again */
+  for (i=0, j=0; i<idx.todo_count; i++)
+  {
+    idx.todo[j].start = moved(idx.todo[i].start, offset, len, new_len);
+    idx.todo[j].end = moved(idx.todo[i].end, offset, len, new_len);
+    if (idx.todo[j].start < idx.todo[j].end)
+      j++;
+  }
+  idx.todo_count = j;
+
+  if (reach < offset + new_len)
+  {
+    for (i=0; i<idx.todo_count && idx.todo[i].start < reach; i++)
+      ;
+    memmove(&idx.todo[i+1], &idx.todo[i],
+            (idx.todo_count - i) * sizeof(index_span_t));
+    idx.todo[i].start = reach;
+    idx.todo[i].end = offset + new_len;
+    idx.todo_count++;
+  }
+
+  /* join spans that now touch */
+  for (i=0, j=0; i<idx.todo_count; i++)
+  {
+    if (j > 0 && idx.todo[i].start <= idx.todo[j-1].end)
+    {
+      if (idx.todo[i].end > idx.todo[j-1].end)
+        idx.todo[j-1].end = idx.todo[i].end;
+    }
+    else
+      idx.todo[j++] = idx.todo[i];
+  }
+  idx.todo_count = j;
+
+  while (idx.todo_count > INDEX_MAX_TODO)
+    merge_closest();
+
+  idx.todo_left = 0;
+  for (i=0; i<idx.todo_count; i++)
+    idx.todo_left += idx.todo[i].end - idx.todo[i].start;
+
+  idx.state = idx.todo_count ? INDEX_COUNTING : INDEX_READY;
+}
+
+static void start_counting(file_manager_t *f, int serial)
+{
+  vf_stat_t st;
+
+  stop_counting();
+
+  vf_stat(f, &st);
+  if (!scanner_init(&idx.sc, f, st.file_size))
+    return;
+
+  idx.f = f;
+  idx.serial = serial;
+  idx.file_size = st.file_size;
+  idx.todo[0].start = 0;
+  idx.todo[0].end = st.file_size;
+  idx.todo_count = st.file_size > 0;
+  idx.todo_left = st.file_size;
+  idx.state = idx.todo_count ? INDEX_COUNTING : INDEX_READY;
+
+  vf_set_edit_hook(f, edit_hook);
+}
+
+void search_index_init(void)
+{
+  memset(&idx, 0, sizeof(idx));
+  pthread_mutex_init(&idx.lock, NULL);
+  pthread_cond_init(&idx.cond, NULL);
+  idx.started = pthread_create(&idx.thread, NULL, index_worker, NULL) == 0;
+}
+
+void search_index_cleanup(void)
+{
+  search_index_pause();
+  stop_counting();
+
+  if (idx.started)
+  {
+    pthread_mutex_lock(&idx.lock);
+    idx.quit = TRUE;
+    pthread_cond_broadcast(&idx.cond);
+    pthread_mutex_unlock(&idx.lock);
+    pthread_join(idx.thread, NULL);
+  }
+
+  pthread_cond_destroy(&idx.cond);
+  pthread_mutex_destroy(&idx.lock);
+}
+
+/* Start counting again if the search or the file has changed.
+   Returns TRUE while there is counting left to do. */
+BOOL search_index_poll(void)
+{
+  int serial;
+
+  if (current_file == NULL || search_item[current_search].used == FALSE ||
+      idx.started == FALSE)
+  {
+    stop_counting();
+    return FALSE;
+  }
+
+  serial = search_serial_now();
+  if (idx.f != current_file || idx.serial != serial)
+    start_counting(current_file, serial);
+
+  return idx.state == INDEX_COUNTING;
+}
+
+/* Let the worker count while the main thread waits */
+void search_index_resume(void)
+{
+  pthread_mutex_lock(&idx.lock);
+  idx.run = TRUE;
+  pthread_cond_broadcast(&idx.cond);
+  pthread_mutex_unlock(&idx.lock);
+}
+
+/* Stop it, waiting for the slice it is on */
+void search_index_pause(void)
+{
+  pthread_mutex_lock(&idx.lock);
+  idx.run = FALSE;
+  while (idx.busy)
+    pthread_cond_wait(&idx.cond, &idx.lock);
+  pthread_mutex_unlock(&idx.lock);
+}
+
+/* How far the count has got for the current search and file.  at is
+   which match starts at addr counting from 1, or 0 if none does. */
+index_state_t search_index_status(off_t addr, long *at, long *count,
+                                  int *percent)
+{
+  long k;
+
+  if (idx.f != current_file || idx.f == NULL ||
+      idx.serial != search_serial_now())
+    return INDEX_NONE;
+
+  k = lower_bound(addr);
+  *at = k < idx.found.count && idx.found.hits[k] == addr ? k + 1 : 0;
+  *count = idx.found.count;
+  *percent = idx.file_size ? 100 - idx.todo_left * 100 / idx.file_size : 100;
+  if (idx.state == INDEX_COUNTING && *percent == 100)
+    *percent = 99;
+
+  return idx.state;
+}
+
+/* How many matches start before addr, once the index is ready */
+long search_index_find(off_t addr)
+{
+  return lower_bound(addr);
+}
+
+/* Where match k starts, counting from 0 */
+off_t search_index_get(long k)
+{
+  if (k < 0 || k >= idx.found.count)
+    return -1;
+
+  return idx.found.hits[k];
+}
@@ -0,0 +1,56 @@
+/*************************************************************
+ *
+ * File:        search_index.h
+ * Author:      David Kelley
+ * Description: Defines and function prototypes related to the
+ *              index of where the current search matches, which
+ *              is built in the background
+ *
+ * Copyright (C) 2009 David Kelley
+ *
+ * This file is part of bviplus.
+ *
+ * Bviplus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bviplus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bviplus.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *************************************************************/
+
+#include "virt_file.h"
+
+#ifndef __SEARCH_INDEX_H__
+#define __SEARCH_INDEX_H__
+
+#define INDEX_SLICE (1024*1024) /* counted between looks at the keyboard */
+#define INDEX_MAX_HITS (8*1024*1024) /* past this matches are not indexed */
+#define INDEX_MAX_TODO 64 /* spans left to count, more are merged */
+#define INDEX_REACH_LIMIT (8*1024*1024) /* edits look back no further */
+
+typedef enum
+{
+  INDEX_NONE,                   /* no search to count */
+  INDEX_TOO_MANY,               /* more than INDEX_MAX_HITS */
+  INDEX_COUNTING,
+  INDEX_READY
+} index_state_t;
+
+void search_index_init(void);
+void search_index_cleanup(void);
+BOOL search_index_poll(void);
+void search_index_resume(void);
+void search_index_pause(void);
+index_state_t search_index_status(off_t addr, long *at, long *count,
+                                  int *percent);
+long search_index_find(off_t addr);
+off_t search_index_get(long k);
+
+#endif /* __SEARCH_INDEX_H__ */
@@ -0,0 +1,203 @@
+/*************************************************************
+ *
+ * File:        search_scan.c
+ * Author:      David Kelley
+ * Description: Find the next byte of a set, a vector at a time
+ *              where the CPU allows
+ *
+ * Copyright (C) 2009 David Kelley
+ *
+ * This file is part of bviplus.
+ *
+ * Bviplus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bviplus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bviplus.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *************************************************************/
+
+#include <string.h>
+#include "search_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SCAN
+#include <immintrin.h>
+#endif
+
+static int scan_level = -1;
+
+static int in_set(const byte_set_t *set, unsigned char byte)
+{
+  return set->map[byte >> 3] & (1 << (byte & 7));
+}
+
+void byte_set_build(byte_set_t *set, const unsigned char *map)
+{
+  int i;
+
+  memcpy(set->map, map, sizeof(set->map));
+  memset(set->low, 0, sizeof(set->low));
+  memset(set->high, 0, sizeof(set->high));
+  set->count = 0;
+
+  for (i=0; i<256; i++)
+  {
+    if (!in_set(set, i))
+      continue;
+
+    if (set->count < SCAN_FEW_BYTES)
+      set->few[set->count] = i;
+    set->count++;
+
+    if (i < 128)
+      set->low[i & 15] |= 1 << (i >> 4);
+    else
+      set->high[i & 15] |= 1 << ((i >> 4) - 8);
+  }
+
+  /* repeat a byte so the direct compares need not care how many */
+  for (i=set->count; i>0 && i<SCAN_FEW_BYTES; i++)
+    set->few[i] = set->few[0];
+}
+
+static int scan_scalar(const byte_set_t *set, const unsigned char *text,
+                       int pos, int size)
+{
+  while (pos < size && !in_set(set, text[pos]))
+    pos++;
+
+  return pos;
+}
+
+#ifdef HAVE_X86_SCAN
+__attribute__((target("sse2")))
+static int scan_sse2(const byte_set_t *set, const unsigned char *text,
+                     int pos, int size)
+{
+  __m128i a, b, c, v, m;
+  int bits;
+
+  /* no byte shuffle before SSSE3, so only the direct compares */
+  if (set->count > SCAN_FEW_BYTES)
+    return scan_scalar(set, text, pos, size);
+
+  a = _mm_set1_epi8(set->few[0]);
+  b = _mm_set1_epi8(set->few[1]);
+  c = _mm_set1_epi8(set->few[2]);
+
+  for (; pos + 16 <= size; pos += 16)
+  {
+    v = _mm_loadu_si128((const __m128i *)(text + pos));
+    m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, b)),
+                     _mm_cmpeq_epi8(v, c));
+    bits = _mm_movemask_epi8(m);
+    if (bits)
+      return pos + __builtin_ctz(bits);
+  }
+
+  return scan_scalar(set, text, pos, size);
+}
+
+/* Each byte is split into nibbles. The low nibble picks a mask of the
+   high nibbles in the set, from low[] or high[], and the high nibble
+   picks the bit to test in it. */
+__attribute__((target("avx2")))
+static int scan_avx2(const byte_set_t *set, const unsigned char *text,
+                     int pos, int size)
+{
+  __m256i a, b, c, v, m, low, high, bit, nib, lo, hi;
+  unsigned int bits;
+
+  if (set->count <= SCAN_FEW_BYTES)
+  {
+    a = _mm256_set1_epi8(set->few[0]);
+    b = _mm256_set1_epi8(set->few[1]);
+    c = _mm256_set1_epi8(set->few[2]);
+
+    for (; pos + 32 <= size; pos += 32)
+    {
+      v = _mm256_loadu_si256((const __m256i *)(text + pos));
+      m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, a),
+                                          _mm256_cmpeq_epi8(v, b)),
+                          _mm256_cmpeq_epi8(v, c));
+      bits = _mm256_movemask_epi8(m);
+      if (bits)
+        return pos + __builtin_ctz(bits);
+    }
+
+    return scan_scalar(set, text, pos, size);
+  }
+
+  low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->low));
+  high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->high));
+  bit = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+                         1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+  nib = _mm256_set1_epi8(0x0f);
+
+  for (; pos + 32 <= size; pos += 32)
+  {
+    v = _mm256_loadu_si256((const __m256i *)(text + pos));
+    lo = _mm256_and_si256(v, nib);
+    hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nib);
+    m = _mm256_blendv_epi8(_mm256_shuffle_epi8(low, lo),
+                           _mm256_shuffle_epi8(high, lo),
+                           _mm256_cmpgt_epi8(hi, _mm256_set1_epi8(7)));
+    m = _mm256_and_si256(m, _mm256_shuffle_epi8(bit, hi));
+    bits = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(m, _mm256_setzero_si256()));
+    if (bits)
+      return pos + __builtin_ctz(bits);
+  }
+
+  return scan_scalar(set, text, pos, size);
+}
+#endif
+
+scan_level_t scan_best_level(void)
+{
+  if (scan_level >= 0)
+    return scan_level;
+
+  scan_level = SCAN_SCALAR;
+#ifdef HAVE_X86_SCAN
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    scan_level = SCAN_AVX2;
+  else if (__builtin_cpu_supports("sse2"))
+    scan_level = SCAN_SSE2;
+#endif
+
+  return scan_level;
+}
+
+/* The first position from pos on holding a byte of the set, or size */
+int scan_set_at(const byte_set_t *set, const char *buf, int pos, int size,
+                scan_level_t level)
+{
+  const unsigned char *text = (const unsigned char *)buf;
+
+  /* nothing to find, and few[] was never filled in */
+  if (set->count == 0)
+    return pos < size ? size : pos;
+
+#ifdef HAVE_X86_SCAN
+  if (level == SCAN_AVX2)
+    return scan_avx2(set, text, pos, size);
+  if (level == SCAN_SSE2)
+    return scan_sse2(set, text, pos, size);
+#endif
+
+  return scan_scalar(set, text, pos, size);
+}
+
+int scan_set(const byte_set_t *set, const char *buf, int pos, int size)
+{
+  return scan_set_at(set, buf, pos, size, scan_best_level());
+}
@@ -0,0 +1,56 @@
+/*************************************************************
+ *
+ * File:        search_scan.h
+ * Author:      David Kelley
+ * Description: Defines, structures, and function prototypes
+ *              related to scanning for the bytes a match can
+ *              start with
+ *
+ * Copyright (C) 2009 David Kelley
+ *
+ * This file is part of bviplus.
+ *
+ * Bviplus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bviplus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bviplus.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *************************************************************/
+
+#ifndef __SEARCH_SCAN_H__
+#define __SEARCH_SCAN_H__
+
+#define SCAN_FEW_BYTES 3 /* compared directly, more go through the nibble tables */
+
+typedef enum
+{
+  SCAN_SCALAR,
+  SCAN_SSE2,
+  SCAN_AVX2
+} scan_level_t;
+
+/* A set of bytes, kept every way one of the scanners wants it */
+typedef struct byte_set_s
+{
+  unsigned char map[256 / 8];
+  int count;
+  unsigned char few[SCAN_FEW_BYTES]; /* the bytes, when there are this few */
+  unsigned char low[16];        /* by low nibble, bit n for high nibble n */
+  unsigned char high[16];       /* and bit n for high nibble n + 8 */
+} byte_set_t;
+
+void         byte_set_build(byte_set_t *set, const unsigned char *map);
+scan_level_t scan_best_level(void);
+int          scan_set_at(const byte_set_t *set, const char *buf, int pos,
+                         int size, scan_level_t level);
+int          scan_set(const byte_set_t *set, const char *buf, int pos, int size);
+
+#endif /* __SEARCH_SCAN_H__ */
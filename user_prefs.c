@@ -42,6 +42,9 @@ user_pref_t user_prefs[] = {
   { "search_immediate",     "si",               1,         1,     0,     0,       P_BOOL },
   { "ignorecase",           "ic",               0,         0,     0,     0,       P_BOOL },
   { "max_match",            "mm",              64,        64,     0,     0,       P_INT },
+  { "block_cache",          "bc",           16384,     16384,     0,     0,       P_INT },
+  { "undo_levels",          "ul",               0,         0,     0,     0,       P_INT },
+  { "undo_memory",          "um",          262144,    262144,     0,     0,       P_INT },
   { "",                     "",                 0,         0,     0,     0,       P_NONE },
 };
 
@@ -130,6 +133,10 @@ action_code_t set_pref(const char *option, const char *value)
         msg_box("Warning, little endian display mode is experimental!!");
 /*****************************************************************/
 
+  vf_set_cache_size((size_t)user_prefs[BLOCK_CACHE].value * 1024);
+  vf_set_undo_limit(user_prefs[UNDO_LEVELS].value,
+                    (off_t)user_prefs[UNDO_MEMORY].value * 1024);
+
   action_do_resize();
 
   return E_SUCCESS;
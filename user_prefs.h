@@ -61,7 +61,10 @@ typedef enum
   SEARCH_HL,
   SEARCH_IMMEDIATE,
   IGNORECASE,
-  MAX_MATCH
+  MAX_MATCH,
+  BLOCK_CACHE,
+  UNDO_LEVELS,
+  UNDO_MEMORY
 } user_pref_e;
 
 extern user_pref_t user_prefs[];
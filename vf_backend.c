@@ -29,224 +29,806 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 #include "virt_file.h"
 #include "vf_backend.h"
 
 
+/****************
+    GLOBALS
+ ***************/
+static long undo_max_changes = 0;   /* 0 is no limit */
+static off_t undo_max_bytes = UNDO_DEFAULT_BYTES;
+
+
 /****************
    PROTOTYPES
  ***************/
-static off_t get_internal_shift(vbuf_t * vb);
-void mod_start_offset(vbuf_t * vb, off_t shift, BOOL increase);
-void mod_parent_size(vbuf_t * vb, off_t shift, BOOL increase);
-void prune(vbuf_undo_list_t * undo_list);
-static void _cleanup_vbuf(vbuf_t * vb);
-static void _cleanup_undo_vb(vbuf_list_t * vb_list);
-static void _cleanup_undo(vbuf_undo_list_t * undo_list);
+static unsigned int next_priority(file_manager_t * f);
+static off_t vb_size(vbuf_t * vb);
+static void vb_update(vbuf_t * vb);
+static vbuf_t *vb_find(vbuf_t * vb, off_t offset, off_t * piece_start);
+static vbuf_t *vb_merge(vbuf_t * left, vbuf_t * right);
+static void vb_split(file_manager_t * f, vbuf_t * vb, off_t offset,
+                     vbuf_t ** left, vbuf_t ** right);
+static void join_pieces(file_manager_t * f, off_t offset);
+static size_t read_piece(file_manager_t * f, vbuf_t * vb, char *dest,
+                         off_t offset, size_t len);
+static size_t vb_read(file_manager_t * f, vbuf_t * vb, off_t base,
+                      char *dest, off_t offset, off_t len);
+static void swap_range(file_manager_t * f, off_t offset, off_t len, vbuf_t ** vb);
+static BOOL merge_change(file_manager_t * f, buf_type_e buf_type, char *buf,
+                         off_t offset, off_t len);
+static size_t record_change(file_manager_t * f, buf_type_e buf_type, char *buf,
+                            off_t offset, off_t old_size, off_t new_size);
+void slab_init(slab_t * slab, size_t item_size);
+void *slab_alloc(slab_t * slab);
+void slab_free(slab_t * slab, void *item);
+void slab_free_all(slab_t * slab);
+void add_init(add_buf_t * add);
+static BOOL add_spill(add_buf_t * add, off_t alloc);
+off_t add_alloc(add_buf_t * add, off_t len);
+void add_free(add_buf_t * add);
+void prune(file_manager_t * f);
+void set_undo_limit(long changes, off_t bytes);
+static off_t vb_payload(vbuf_t * vb, long *nodes);
+static void vb_relocate(file_manager_t * f, vbuf_t * vb, add_buf_t * to);
+static void compact_add(file_manager_t * f);
+static void fold_change(file_manager_t * f);
+static void trim_history(file_manager_t * f);
+static void _cleanup_vbuf(file_manager_t * f, vbuf_t * vb);
+static void account_change(file_manager_t * f, vbuf_undo_list_t * change);
+static void _free_change(file_manager_t * f, vbuf_undo_list_t * change);
 void cleanup(file_manager_t * f);
+void attach_file(file_manager_t * f);
+void detach_file(file_manager_t * f);
 inline void compute_percent_complete(off_t offset, off_t size, int *complete);
-static void insert_new_vbuf(vbuf_t **new, vbuf_t *current, vbuf_t *parent, off_t offset,
-                     size_t len, buf_type_e buf_type, char *src_buf);
 
 
 /****************
     FUNCTIONS
  ***************/
+/*---------------------------
+  xorshift, only needs to be
+  cheap and well spread
+  ---------------------------*/
+static unsigned int next_priority(file_manager_t * f)
+{
+  unsigned int x = f->seed;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  f->seed = x;
+
+  return x;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+static off_t vb_size(vbuf_t * vb)
+{
+  if(NULL == vb)
+    return 0;
+
+  return vb->subtree_size;
+}
+
+
 /*---------------------------
 
   ---------------------------*/
-static off_t get_internal_shift(vbuf_t * vb)
+static void vb_update(vbuf_t * vb)
 {
-  off_t shift = 0;
-  vbuf_t *tmp = vb->first_child;
+  vb->subtree_size = vb_size(vb->left) + vb->size + vb_size(vb->right);
+}
 
-  while(NULL != tmp)
+
+/*---------------------------
+  Find the piece holding offset,
+  piece_start is set to the
+  logical offset of that piece
+  ---------------------------*/
+static vbuf_t *vb_find(vbuf_t * vb, off_t offset, off_t * piece_start)
+{
+  off_t base = 0, left_size;
+
+  while(NULL != vb)
   {
-    switch (tmp->buf_type)
+    left_size = vb_size(vb->left);
+
+    if(offset < left_size)
     {
-      case TYPE_INSERT:
-        shift -= tmp->size;
-        break;
-      case TYPE_REPLACE:
-        shift += get_internal_shift(tmp);
-        break;
-      case TYPE_DELETE:
-        shift += tmp->size;
-        break;
-      default:
-        break;
+      vb = vb->left;
+    }
+    else if(offset < left_size + vb->size)
+    {
+      *piece_start = base + left_size;
+      return vb;
+    }
+    else
+    {
+      offset -= left_size + vb->size;
+      base += left_size + vb->size;
+      vb = vb->right;
     }
-    tmp = tmp->next;
   }
-  return shift;
+
+  return NULL;
 }
 
 
 /*---------------------------
+  Every piece in left comes
+  before every piece in right
+  ---------------------------*/
+static vbuf_t *vb_merge(vbuf_t * left, vbuf_t * right)
+{
+  if(NULL == left)
+    return right;
+  if(NULL == right)
+    return left;
 
+  if(left->priority > right->priority)
+  {
+    left->right = vb_merge(left->right, right);
+    vb_update(left);
+    return left;
+  }
+
+  right->left = vb_merge(left, right->left);
+  vb_update(right);
+  return right;
+}
+
+
+/*---------------------------
+  left gets the first offset
+  bytes, right the rest. A
+  piece straddling offset is
+  cut in two.
   ---------------------------*/
-void mod_start_offset(vbuf_t * vb, off_t shift, BOOL increase)
+static void vb_split(file_manager_t * f, vbuf_t * vb, off_t offset,
+                     vbuf_t ** left, vbuf_t ** right)
 {
-  vbuf_t *tmp = vb;
+  off_t left_size;
+  vbuf_t *tail;
 
-  while(NULL != tmp)
+  if(NULL == vb)
   {
-    if(TRUE == increase)
-      tmp->start += shift;
-    else
-      tmp->start -= shift;
+    *left = NULL;
+    *right = NULL;
+    return;
+  }
 
-    mod_start_offset(tmp->first_child, shift, increase);
+  left_size = vb_size(vb->left);
 
-    tmp = tmp->next;
+  if(offset <= left_size)
+  {
+    vb_split(f, vb->left, offset, left, &vb->left);
+    vb_update(vb);
+    *right = vb;
+  }
+  else if(offset >= left_size + vb->size)
+  {
+    vb_split(f, vb->right, offset - left_size - vb->size, &vb->right, right);
+    vb_update(vb);
+    *left = vb;
+  }
+  else
+  {
+    offset -= left_size;
+    tail = new_vbuf(f, vb->buf_type, vb->start + offset, vb->size - offset);
+    vb->size = offset;
+    *right = vb_merge(tail, vb->right);
+    vb->right = NULL;
+    vb_update(vb);
+    *left = vb;
   }
 }
 
 
 /*---------------------------
+  If the pieces either side of
+  offset are contiguous in the
+  same source make them one. All
+  edits share the add buffer, so
+  an insert can join a replace.
+  ---------------------------*/
+static void join_pieces(file_manager_t * f, off_t offset)
+{
+  vbuf_t *a, *b, *left, *middle, *right;
+  off_t a_start = 0, b_start = 0;
+
+  if(offset <= 0 || offset >= vb_size(f->root))
+    return;
+
+  a = vb_find(f->root, offset - 1, &a_start);
+  b = vb_find(f->root, offset, &b_start);
+
+  if(a == b)
+    return;
+
+  if((TYPE_FILE == a->buf_type) != (TYPE_FILE == b->buf_type) ||
+     a->start + a->size != b->start)
+    return;
+
+  /* the split lands on piece boundaries, so middle is exactly a and b */
+  vb_split(f, f->root, a_start, &left, &right);
+  vb_split(f, right, a->size + b->size, &middle, &right);
 
+  a->size += b->size;
+  a->left = NULL;
+  a->right = NULL;
+  vb_update(a);
+  slab_free(&f->vb_slab, b);
+
+  f->root = vb_merge(vb_merge(left, a), right);
+}
+
+
+/*---------------------------
+  Replace len logical bytes at
+  offset with the pieces in vb,
+  the displaced pieces are
+  handed back through vb
   ---------------------------*/
-void mod_parent_size(vbuf_t * vb, off_t shift, BOOL increase)
+static void swap_range(file_manager_t * f, off_t offset, off_t len, vbuf_t ** vb)
 {
-  vbuf_t *tmp = vb;
+  vbuf_t *left, *middle, *right;
+  off_t new_len = vb_size(*vb);
 
-  while(NULL != tmp)
-  {
-    if(TRUE == increase)
-      tmp->size += shift;
-    else
-      tmp->size -= shift;
+  vb_split(f, f->root, offset, &left, &right);
+  vb_split(f, right, len, &middle, &right);
 
-    mod_start_offset(tmp->next, shift, increase);
-    tmp = tmp->parent;
+  f->root = vb_merge(vb_merge(left, *vb), right);
+  *vb = middle;
+
+  join_pieces(f, offset + new_len);
+  join_pieces(f, offset);
+}
+
+
+/*---------------------------
+  Items are at least a pointer
+  so a free item can hold the
+  free list link
+  ---------------------------*/
+void slab_init(slab_t * slab, size_t item_size)
+{
+  if(item_size < sizeof(void *))
+    item_size = sizeof(void *);
+
+  slab->free_list = NULL;
+  slab->chunks = NULL;
+  slab->item_size = item_size;
+  slab->carved = SLAB_ITEMS;
+  slab->count = 0;
+}
+
+
+/*---------------------------
+  Reuse a freed item, else carve
+  the next one from the newest
+  chunk. The first item of every
+  chunk links the chunk list.
+  ---------------------------*/
+void *slab_alloc(slab_t * slab)
+{
+  char *item;
+
+  if(NULL != slab->free_list)
+  {
+    item = slab->free_list;
+    slab->free_list = *(void **)item;
   }
+  else
+  {
+    if(SLAB_ITEMS == slab->carved)
+    {
+      item = (char *)malloc(slab->item_size * SLAB_ITEMS);
+      if(NULL == item)
+        return NULL;
+      *(void **)item = slab->chunks;
+      slab->chunks = item;
+      slab->carved = 1;
+    }
+    item = (char *)slab->chunks + slab->item_size * slab->carved++;
+  }
+
+  slab->count++;
+  return item;
 }
 
 
 /*---------------------------
 
   ---------------------------*/
-void prune(vbuf_undo_list_t * undo_list)
+void slab_free(slab_t * slab, void *item)
 {
-  vbuf_undo_list_t *tmp_undo_list = undo_list->last;
-  vbuf_list_t *tmp_list = NULL;
-  vbuf_t *tmp = NULL;
+  *(void **)item = slab->free_list;
+  slab->free_list = item;
+  slab->count--;
+}
 
-  if(NULL == tmp_undo_list)
-    return;
 
-  while(NULL != tmp_undo_list)
+/*---------------------------
+  Make sure the next count
+  allocs can not fail, by taking
+  them and handing them straight
+  back to the free list
+  ---------------------------*/
+BOOL slab_reserve(slab_t * slab, int count)
+{
+  void *taken = NULL, *item;
+  BOOL result = TRUE;
+
+  while(count-- > 0)
   {
-    if(TRUE == tmp_undo_list->applied)
+    item = slab_alloc(slab);
+    if(NULL == item)
+    {
+      result = FALSE;
       break;
+    }
+    *(void **)item = taken;
+    taken = item;
+  }
 
-    tmp_list = tmp_undo_list->vb_list;
+  while(NULL != taken)
+  {
+    item = *(void **)taken;
+    slab_free(slab, taken);
+    taken = item;
+  }
 
-    while(NULL != tmp_list)
-    {
-      tmp = tmp_list->vb;
+  return result;
+}
+
+
+/*---------------------------
+  Every item goes at once, one
+  free per chunk
+  ---------------------------*/
+void slab_free_all(slab_t * slab)
+{
+  void *chunk;
+
+  while(NULL != slab->chunks)
+  {
+    chunk = slab->chunks;
+    slab->chunks = *(void **)chunk;
+    free(chunk);
+  }
+
+  slab_init(slab, slab->item_size);
+}
 
-      /* no children left and we're not active either, delete self */
-      if(NULL == tmp->first_child && FALSE == tmp->active)
-      {
-        if(NULL == tmp->next)
-          tmp->parent->first_child->prev = tmp->prev;
-        else
-          tmp->next->prev = tmp->prev;
 
-        if(tmp->parent->first_child == tmp)
-          tmp->parent->first_child = tmp->next;
+/*---------------------------
 
-        if(NULL != tmp->prev)
-        {
-          if(NULL != tmp->prev->next)
-            tmp->prev->next = tmp->next;
-        }
+  ---------------------------*/
+void add_init(add_buf_t * add)
+{
+  add->data = NULL;
+  add->size = 0;
+  add->alloc = 0;
+  add->dead = 0;
+  add->fd = -1;
+}
 
-        if(NULL != tmp->buf)
-          free(tmp->buf);
-        free(tmp);
-      }
 
-      tmp_list = tmp_list->next;
-      free(tmp_undo_list->vb_list);
-      tmp_undo_list->vb_list = tmp_list;
+/*---------------------------
+  Move the add buffer into an
+  unlinked temp file, or grow
+  the one it is already in
+  ---------------------------*/
+static BOOL add_spill(add_buf_t * add, off_t alloc)
+{
+  char name[] = "/tmp/bviplus_add_XXXXXX";
+  int fd = add->fd;
+  void *map;
 
-    }                           /* while (NULL != temp_list) */
-    undo_list->last = tmp_undo_list->last;
-    free(tmp_undo_list);
-    tmp_undo_list = undo_list->last;
+  if(fd < 0)
+  {
+    fd = mkstemp(name);
+    if(fd < 0)
+      return FALSE;
+    unlink(name);
+  }
+
+  if(ftruncate(fd, alloc))
+    map = MAP_FAILED;
+  else
+    map = mmap(NULL, alloc, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
-  }                             /* while (NULL != temp_undo_list) */
+  if(MAP_FAILED == map)
+  {
+    if(fd != add->fd)
+      close(fd);
+    return FALSE;
+  }
 
+  if(add->fd < 0)
+  {
+    memcpy(map, add->data, add->size);
+    free(add->data);
+  }
+  else
+  {
+    munmap(add->data, add->alloc);
+  }
+
+  add->data = (char *)map;
+  add->alloc = alloc;
+  add->fd = fd;
+
+  return TRUE;
+}
+
+
+/*---------------------------
+  Room for len more bytes at the
+  end, returns where they go or
+  -1. data may move, offsets
+  into it never do.
+  ---------------------------*/
+off_t add_alloc(add_buf_t * add, off_t len)
+{
+  off_t alloc = add->alloc, start;
+  char *tmp;
+
+  if(add->size + len > alloc)
+  {
+    if(alloc < ADD_BUF_MIN)
+      alloc = ADD_BUF_MIN;
+    while(add->size + len > alloc)
+      alloc *= 2;
+
+    if(alloc > ADD_SPILL || add->fd >= 0)
+    {
+      if(FALSE == add_spill(add, alloc))
+        return -1;
+    }
+    else
+    {
+      tmp = (char *)realloc(add->data, alloc);
+      if(NULL == tmp)
+        return -1;
+      add->data = tmp;
+      add->alloc = alloc;
+    }
+  }
+
+  start = add->size;
+  add->size += len;
+
+  return start;
 }
 
 
 /*---------------------------
 
   ---------------------------*/
-static void _cleanup_vbuf(vbuf_t * vb)
+void add_free(add_buf_t * add)
 {
-  if(NULL == vb)
-    return;
+  if(add->fd >= 0)
+  {
+    munmap(add->data, add->alloc);
+    close(add->fd);
+  }
+  else
+  {
+    free(add->data);
+  }
 
-  if(NULL != vb->first_child)
-    _cleanup_vbuf(vb->first_child);
+  add_init(add);
+}
 
-  if(NULL != vb->next)
-    _cleanup_vbuf(vb->next);
 
-  if(NULL != vb->buf)
+/*---------------------------
+  Free the undone changes after
+  current, an edit made after an
+  undo never extends the change
+  under it
+  ---------------------------*/
+void prune(file_manager_t * f)
+{
+  vbuf_undo_list_t *tmp_undo_list;
+
+  if(f->hist.newest == f->hist.current)
+    return;
+
+  while(f->hist.newest != f->hist.current)
   {
-    free(vb->buf);
-    vb->buf = NULL;            /* just in case */
+    tmp_undo_list = f->hist.newest;
+    f->hist.newest = tmp_undo_list->last;
+
+    if(f->hist.saved == tmp_undo_list)
+      f->hist.saved_lost = TRUE;
+    if(f->hist.saving == tmp_undo_list)
+      f->hist.saving_lost = TRUE;
+    f->hist.count--;
+    f->hist.bytes -= tmp_undo_list->held;
+    _free_change(f, tmp_undo_list);
+  }
+
+  if(NULL == f->hist.newest)
+  {
+    f->hist.oldest = NULL;
+  }
+  else
+  {
+    f->hist.newest->next = NULL;
+    f->hist.newest->open = FALSE;
   }
-  free(vb);
 }
 
 
 /*---------------------------
 
   ---------------------------*/
-static void _cleanup_undo_vb(vbuf_list_t * vb_list)
+void set_undo_limit(long changes, off_t bytes)
+{
+  undo_max_changes = changes;
+  undo_max_bytes = bytes;
+}
+
+
+/*---------------------------
+  Bytes of the add buffer the
+  pieces in vb refer to, nodes
+  is bumped for each piece
+  ---------------------------*/
+static off_t vb_payload(vbuf_t * vb, long *nodes)
 {
-  if(NULL != vb_list->next)
-    _cleanup_undo_vb(vb_list->next);
+  off_t bytes = 0;
 
-  free(vb_list);
+  while(NULL != vb)
+  {
+    (*nodes)++;
+    if(TYPE_FILE != vb->buf_type)
+      bytes += vb->size;
+    bytes += vb_payload(vb->left, nodes);
+    vb = vb->right;
+  }
+
+  return bytes;
 }
 
 
 /*---------------------------
 
   ---------------------------*/
-static void _cleanup_undo(vbuf_undo_list_t * undo_list)
+static void vb_relocate(file_manager_t * f, vbuf_t * vb, add_buf_t * to)
+{
+  while(NULL != vb)
+  {
+    vb_relocate(f, vb->left, to);
+    if(TYPE_FILE != vb->buf_type)
+    {
+      memcpy(to->data + to->size, f->add.data + vb->start, vb->size);
+      vb->start = to->size;
+      to->size += vb->size;
+    }
+    vb = vb->right;
+  }
+}
+
+
+/*---------------------------
+  Copy only the bytes something
+  still refers to into a fresh
+  add buffer, tree first so the
+  file reads back in order
+  ---------------------------*/
+static void compact_add(file_manager_t * f)
 {
-  if(NULL == undo_list)
+  vbuf_undo_list_t *change;
+  add_buf_t fresh;
+  off_t live;
+  long nodes = 0;
+
+  live = vb_payload(f->root, &nodes);
+  for(change = f->hist.oldest; NULL != change; change = change->next)
+    live += vb_payload(change->vb, &nodes);
+
+  add_init(&fresh);
+  if(0 != live && add_alloc(&fresh, live) < 0)
     return;
+  fresh.size = 0;
+
+  vb_relocate(f, f->root, &fresh);
+  for(change = f->hist.oldest; NULL != change; change = change->next)
+    vb_relocate(f, change->vb, &fresh);
+
+  add_free(&f->add);
+  f->add = fresh;
+
+  /* add_start is stale now, so nothing may be appended to the payload */
+  if(NULL != f->hist.current)
+    f->hist.current->open = FALSE;
+}
+
+
+/*---------------------------
+  Make the oldest change part of
+  the base file: it can not be
+  undone any more and what it
+  displaced is freed
+  ---------------------------*/
+static void fold_change(file_manager_t * f)
+{
+  vbuf_undo_list_t *change = f->hist.oldest;
+
+  f->hist.oldest = change->next;
+  if(NULL == f->hist.oldest)
+    f->hist.newest = NULL;
+  else
+    f->hist.oldest->last = NULL;
+
+  if(f->hist.current == change)
+    f->hist.current = NULL;
+
+  /* the state before it is gone, the state after it is the base now */
+  if(NULL == f->hist.saved)
+    f->hist.saved_lost = TRUE;
+  else if(f->hist.saved == change)
+    f->hist.saved = NULL;
+  if(NULL == f->hist.saving)
+    f->hist.saving_lost = TRUE;
+  else if(f->hist.saving == change)
+    f->hist.saving = NULL;
+
+  f->hist.count--;
+  f->hist.bytes -= change->held;
+  _free_change(f, change);
+}
+
+
+/*---------------------------
+  Make every change part of the
+  base file, nothing can be
+  undone or redone after
+  ---------------------------*/
+void fold_history(file_manager_t * f)
+{
+  prune(f);
+
+  while(NULL != f->hist.oldest)
+    fold_change(f);
+}
+
+
+/*---------------------------
+  Fold applied changes until the
+  history fits the undo budget,
+  then drop the add buffer bytes
+  nothing uses once they are
+  half of it
+  ---------------------------*/
+static void trim_history(file_manager_t * f)
+{
+  while(NULL != f->hist.current &&
+        ((undo_max_changes && f->hist.count > undo_max_changes) ||
+         (undo_max_bytes && f->hist.bytes > undo_max_bytes)))
+    fold_change(f);
 
-  if(NULL != undo_list->last)
-    _cleanup_undo(undo_list->last);
+  if(f->add.dead >= ADD_COMPACT && f->add.dead > f->add.size / 2)
+    compact_add(f);
+}
 
-  _cleanup_undo_vb(undo_list->vb_list);
 
-  free(undo_list);
+/*---------------------------
+  Rotate left children up until
+  there are none, then the node
+  can go and its right child is
+  next. No stack, however deep
+  the tree.
+  ---------------------------*/
+static void _cleanup_vbuf(file_manager_t * f, vbuf_t * vb)
+{
+  vbuf_t *tmp;
+
+  while(NULL != vb)
+  {
+    if(NULL != vb->left)
+    {
+      tmp = vb->left;
+      vb->left = tmp->right;
+      tmp->right = vb;
+      vb = tmp;
+    }
+    else
+    {
+      tmp = vb->right;
+      if(TYPE_FILE != vb->buf_type)
+        f->add.dead += vb->size;
+      slab_free(&f->vb_slab, vb);
+      vb = tmp;
+    }
+  }
 }
 
 
 /*---------------------------
 
+  ---------------------------*/
+static void _free_change(file_manager_t * f, vbuf_undo_list_t * change)
+{
+  _cleanup_vbuf(f, change->vb);
+  slab_free(&f->ul_slab, change);
+}
+
+
+/*---------------------------
+  The nodes go back with the
+  slabs and the payloads with
+  the add buffer
   ---------------------------*/
 void cleanup(file_manager_t * f)
 {
   if (NULL == f)
     return;
 
-  _cleanup_vbuf(f->fm.first_child);
-  f->fm.first_child = NULL;
-  _cleanup_undo(f->ul.last);
-  f->ul.last = NULL;
+  f->root = NULL;
+  f->hist.oldest = NULL;
+  f->hist.newest = NULL;
+  f->hist.current = NULL;
+  f->hist.saved = NULL;
+  f->hist.saved_lost = FALSE;
+  f->hist.saving = NULL;
+  f->hist.saving_lost = FALSE;
+  f->hist.saving_crossed = FALSE;
+  f->hist.count = 0;
+  f->hist.bytes = 0;
+  slab_free_all(&f->vb_slab);
+  slab_free_all(&f->ul_slab);
+  add_free(&f->add);
+}
+
+
+/*---------------------------
+  Map the original file so reads
+  of unedited data are a memcpy.
+  Files that can't be mapped (no
+  address space left, special
+  files) are read with pread
+  through the block cache.
+  ---------------------------*/
+void attach_file(file_manager_t * f)
+{
+  void *map;
+
+  f->map = NULL;
+  f->cache = NULL;
+
+  if(NULL == f->fp || 0 == f->file_size)
+    return;
+
+  map = mmap(NULL, f->file_size, PROT_READ, MAP_SHARED, fileno(f->fp), 0);
+  if(MAP_FAILED == map)
+    f->cache = cache_create(fileno(f->fp));
+  else
+    f->map = (char *)map;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+void detach_file(file_manager_t * f)
+{
+  if(NULL != f->map)
+    munmap(f->map, f->file_size);
+  f->map = NULL;
+
+  cache_destroy(f->cache);
+  f->cache = NULL;
 }
 
 
@@ -269,645 +851,471 @@ inline void compute_percent_complete(off_t offset, off_t size, int *complete)
 
 
 /*---------------------------
+  NULL when the slab can not
+  grow
+  ---------------------------*/
+vbuf_t *new_vbuf(file_manager_t * f, buf_type_e buf_type, off_t start,
+                 off_t size)
+{
+  vbuf_t *vb;
+
+  vb = (vbuf_t *) slab_alloc(&f->vb_slab);
+  if(NULL == vb)
+    return NULL;
+  vb->left = NULL;
+  vb->right = NULL;
+  vb->start = start;
+  vb->size = size;
+  vb->subtree_size = size;
+  vb->priority = next_priority(f);
+  vb->buf_type = buf_type;
+
+  return vb;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+vbuf_t *get_piece(file_manager_t * f, off_t offset, off_t * piece_start)
+{
+  return vb_find(f->root, offset, piece_start);
+}
+
 
+/*---------------------------
+  What a change keeps is the
+  pieces in its vb and the add
+  buffer bytes they refer to
   ---------------------------*/
-/* make this not void, and handle mem alloc errors? */
-static void insert_new_vbuf(vbuf_t **new, vbuf_t *current, vbuf_t *parent, off_t offset,
-                     size_t len, buf_type_e buf_type, char *src_buf)
+static void account_change(file_manager_t * f, vbuf_undo_list_t * change)
 {
-  *new = (vbuf_t *) malloc(sizeof(vbuf_t));
-  (*new)->first_child = NULL;
-  (*new)->start = offset;
-  (*new)->buf_type = buf_type;
-  (*new)->fp = NULL;
-  (*new)->active = TRUE;
-  (*new)->next = current;
+  long nodes = 0;
+
+  f->hist.bytes -= change->held;
+  change->held = vb_payload(change->vb, &nodes);
+  change->held += nodes * sizeof(vbuf_t) + sizeof(vbuf_undo_list_t);
+  f->hist.bytes += change->held;
+}
+
 
-  if (NULL != current) /* inserting into the middle of a list */
+/*---------------------------
+  FALSE, with nothing changed,
+  when there is no room for the
+  pieces the splits may cut
+  ---------------------------*/
+BOOL apply_change(file_manager_t * f, vbuf_undo_list_t * change)
+{
+  if(FALSE == slab_reserve(&f->vb_slab, SWAP_PIECES))
+    return FALSE;
+
+  swap_range(f, change->offset, change->old_size, &change->vb);
+  account_change(f, change);
+  return TRUE;
+}
+
+
+/*---------------------------
+  FALSE, with nothing changed,
+  when there is no room for the
+  pieces the splits may cut
+  ---------------------------*/
+BOOL revert_change(file_manager_t * f, vbuf_undo_list_t * change)
+{
+  if(FALSE == slab_reserve(&f->vb_slab, SWAP_PIECES))
+    return FALSE;
+
+  swap_range(f, change->offset, change->new_size, &change->vb);
+  account_change(f, change);
+  return TRUE;
+}
+
+
+/*---------------------------
+  Grow the newest change when
+  this edit runs on from it: an
+  insert at either end of the
+  last insert, a replace just
+  before or after the last
+  replace. The change is taken
+  out, its payload and range
+  widened, and put back, so its
+  undo still restores all of it.
+  ---------------------------*/
+static BOOL merge_change(file_manager_t * f, buf_type_e buf_type, char *buf,
+                         off_t offset, off_t len)
+{
+  vbuf_undo_list_t *change = f->hist.current;
+  off_t size, start;
+  BOOL prepend;
+
+  if(NULL == change || FALSE == change->open || f->hist.newest != change ||
+     f->hist.saved == change || 0 == change->new_size)
+    return FALSE;
+
+  if(TYPE_INSERT == buf_type)
   {
-    (*new)->prev = current->prev;
-    if(NULL != (*new)->prev->next)
-      (*new)->prev->next = *new;
-    current->prev = *new;
-    if(parent->first_child == current)
-      parent->first_child = *new;
+    if(0 != change->old_size)
+      return FALSE;
+    if(offset == change->offset + change->new_size)
+      prepend = FALSE;
+    else if(offset == change->offset)
+      prepend = TRUE;
+    else
+      return FALSE;
   }
-  else /* appending to the end of a list, including the case of first member */
+  else
   {
-    if(NULL == parent->first_child)
-    {
-      parent->first_child = *new;
-      (*new)->prev = *new;
-    }
+    if(change->old_size != change->new_size)
+      return FALSE;
+    if(offset == change->offset + change->new_size)
+      prepend = FALSE;
+    else if(offset + len == change->offset)
+      prepend = TRUE;
     else
-    {
-      (*new)->prev = parent->first_child->prev;
-      parent->first_child->prev->next = *new;
-      parent->first_child->prev = *new;
-    }
+      return FALSE;
   }
 
-  (*new)->parent = parent;
+  size = change->new_size + len;
+  if(size > MERGE_LIMIT)
+    return FALSE;
 
-  (*new)->size = len;
-  if (NULL != src_buf)
+  /* the revert, the new piece and the apply, so none of them fails */
+  if(FALSE == slab_reserve(&f->vb_slab, 2 * SWAP_PIECES + 1))
+    return FALSE;
+
+  /* appending to the newest payload needs no copy of it */
+  if(FALSE == prepend && change->add_start + change->new_size == f->add.size)
   {
-    (*new)->buf = (char *)malloc((*new)->size);
-    memcpy((*new)->buf, src_buf, (*new)->size);
+    start = add_alloc(&f->add, len);
+    if(start < 0)
+      return FALSE;
+    memcpy(f->add.data + start, buf, len);
+    start = change->add_start;
   }
   else
   {
-    (*new)->buf = NULL;
+    start = add_alloc(&f->add, size);
+    if(start < 0)
+      return FALSE;
+    if(prepend)
+    {
+      memcpy(f->add.data + start, buf, len);
+      memcpy(f->add.data + start + len, f->add.data + change->add_start,
+             change->new_size);
+    }
+    else
+    {
+      memcpy(f->add.data + start, f->add.data + change->add_start,
+             change->new_size);
+      memcpy(f->add.data + start + change->new_size, buf, len);
+    }
   }
+
+  revert_change(f, change);
+  _cleanup_vbuf(f, change->vb);
+  if(start == change->add_start)
+    f->add.dead -= change->new_size;  /* still in use, just longer */
+
+  if(prepend)
+    change->offset = offset;
+  change->add_start = start;
+  change->vb = new_vbuf(f, buf_type, start, size);
+  change->new_size = size;
+  if(TYPE_REPLACE == buf_type)
+    change->old_size = size;
+
+  apply_change(f, change);
+  trim_history(f);
+
+  return TRUE;
 }
 
 
 /*---------------------------
 
   ---------------------------*/
-size_t _insert_before(vbuf_t * vb, char *buf, off_t offset, size_t len,
-                      vbuf_undo_list_t ** undo_list)
+static size_t record_change(file_manager_t * f, buf_type_e buf_type, char *buf,
+                            off_t offset, off_t old_size, off_t new_size)
 {
-  vbuf_t *tmp = NULL,
-    *new = NULL;
-  vbuf_undo_list_t *new_list = NULL;
+  vbuf_undo_list_t *change;
+  off_t start = 0;
 
-  /* make sure we're still in the buf */
-  if(offset > vb->start + vb->size)
+  /* the new piece and the apply, so neither fails once under way */
+  if(FALSE == slab_reserve(&f->vb_slab, SWAP_PIECES + 1))
     return 0;
 
-  tmp = vb->first_child;
+  change = (vbuf_undo_list_t *) slab_alloc(&f->ul_slab);
+  if(NULL == change)
+    return 0;
 
-  while(NULL != tmp)
+  if(0 != new_size)
   {
-    switch (tmp->buf_type)
+    start = add_alloc(&f->add, new_size);
+    if(start < 0)
     {
-      case TYPE_INSERT:
-      case TYPE_REPLACE:
-        if(offset < tmp->start)
-        {
-          insert_new_vbuf(&new, tmp, vb, offset, len, TYPE_INSERT, buf);
-          mod_parent_size(new->parent, new->size, TRUE);
-          mod_start_offset(new->next, new->size, TRUE);
-          new_list = (vbuf_undo_list_t *) malloc(sizeof(vbuf_undo_list_t));
-          new_list->applied = TRUE;
-          new_list->saved = FALSE;
-          new_list->last = *undo_list;
-          *undo_list = new_list;
-          new_list->vb_list = (vbuf_list_t *) malloc(sizeof(vbuf_list_t));
-          new_list->vb_list->next = NULL;
-          new_list->vb_list->vb = new;
-          return len;
-        }
-        else if(offset < tmp->start + tmp->size)
-        {
-          return _insert_before(tmp, buf, offset, len, undo_list);
-        }
-        break;
-      case TYPE_DELETE:
-        if(offset < tmp->start)
-        {
-          insert_new_vbuf(&new, tmp, vb, offset, len, TYPE_INSERT, buf);
-          mod_parent_size(new->parent, new->size, TRUE);
-          mod_start_offset(new->next, new->size, TRUE);
-          new_list = (vbuf_undo_list_t *) malloc(sizeof(vbuf_undo_list_t));
-          new_list->applied = TRUE;
-          new_list->saved = FALSE;
-          new_list->last = *undo_list;
-          *undo_list = new_list;
-          new_list->vb_list = (vbuf_list_t *) malloc(sizeof(vbuf_list_t));
-          new_list->vb_list->next = NULL;
-          new_list->vb_list->vb = new;
-          return len;
-        }
-        break;
-      default:
-        break;
-
+      slab_free(&f->ul_slab, change);
+      return 0;
     }
-    tmp = tmp->next;
+    memcpy(f->add.data + start, buf, new_size);
   }
 
-  insert_new_vbuf(&new, NULL, vb, offset, len, TYPE_INSERT, buf);
-  mod_parent_size(new->parent, new->size, TRUE);
-  mod_start_offset(new->next, new->size, TRUE);
+  change->offset = offset;
+  change->old_size = old_size;
+  change->new_size = new_size;
+  change->add_start = start;
+  change->vb = NULL;
+  change->held = 0;
+  change->open = TRUE;
+
+  if(0 != new_size)
+    change->vb = new_vbuf(f, buf_type, start, new_size);
+
+  /* prune has already dropped anything after current */
+  change->last = f->hist.newest;
+  change->next = NULL;
+  if(NULL == f->hist.newest)
+    f->hist.oldest = change;
+  else
+    f->hist.newest->next = change;
+  f->hist.newest = change;
+  f->hist.current = change;
+  f->hist.count++;
 
-  new_list = (vbuf_undo_list_t *) malloc(sizeof(vbuf_undo_list_t));
-  new_list->applied = TRUE;
-  new_list->saved = FALSE;
-  new_list->last = *undo_list;
-  *undo_list = new_list;
-  new_list->vb_list = (vbuf_list_t *) malloc(sizeof(vbuf_list_t));
-  new_list->vb_list->next = NULL;
-  new_list->vb_list->vb = new;
+  apply_change(f, change);
+  trim_history(f);
 
-  return len;
+  return old_size > new_size ? old_size : new_size;
 }
 
 
 /*---------------------------
 
   ---------------------------*/
-size_t _replace(vbuf_t * vb, char *buf, off_t offset, size_t len,
-                vbuf_list_t ** vb_list)
+size_t _insert_before(file_manager_t * f, char *buf, off_t offset, size_t len)
 {
-  vbuf_t *tmp = NULL,
-    *new = NULL;
-  vbuf_list_t *tmp_vb_list = NULL;
-  off_t tmp_offset = 0;
-  size_t tmp_len = 0,
-    result = 0;
-
-  /* make sure we're still in the buf */
-  if(offset + len > vb->start + vb->size)
+  /* make sure we're still in the file */
+  if(offset > vb_size(f->root) || 0 == len)
     return 0;
 
-  tmp = vb->first_child;
-  tmp_offset = offset;
-  tmp_len = len;
+  if(merge_change(f, TYPE_INSERT, buf, offset, len))
+    return len;
 
-  while(NULL != tmp && 0 != tmp_len)
-  {
-    switch (tmp->buf_type)
-    {
-      case TYPE_REPLACE:       /* no break */
-      case TYPE_INSERT:
-        if(tmp_offset < tmp->start)
-        {
-          if(tmp_offset + tmp_len < tmp->start)
-            insert_new_vbuf(&new, tmp, vb, tmp_offset, tmp_len,
-                            TYPE_REPLACE, buf + tmp_offset - offset);
-          else
-            insert_new_vbuf(&new, tmp, vb, tmp_offset, tmp->start - tmp_offset,
-                            TYPE_REPLACE, buf + tmp_offset - offset);
-
-          tmp_len -= new->size;
-          tmp_offset += new->size;
-          if(NULL == *vb_list)
-          {
-            *vb_list = (vbuf_list_t *) malloc(sizeof(vbuf_list_t));
-            tmp_vb_list = *vb_list;
-          }
-          else
-          {
-            tmp_vb_list = *vb_list;
-            while(NULL != tmp_vb_list->next)
-              tmp_vb_list = tmp_vb_list->next;
-            tmp_vb_list->next = (vbuf_list_t *) malloc(sizeof(vbuf_list_t));
-            tmp_vb_list = tmp_vb_list->next;
-          }
-          tmp_vb_list->vb = new;
-          tmp_vb_list->next = NULL;
-        }
-        else if(tmp_offset < tmp->start + tmp->size)
-        {
-          if(tmp_offset + tmp_len < tmp->start + tmp->size)
-          {
-            if(NULL == tmp_vb_list)
-              result =
-                _replace(tmp, buf + tmp_offset - offset, tmp_offset, tmp_len,
-                         vb_list);
-            else
-              result =
-                _replace(tmp, buf + tmp_offset - offset, tmp_offset, tmp_len,
-                         &tmp_vb_list->next);
-          }
-          else
-          {
-            if(NULL == tmp_vb_list)
-              result =
-                _replace(tmp, buf + tmp_offset - offset, tmp_offset,
-                         tmp->start + tmp->size - tmp_offset, vb_list);
-            else
-              result =
-                _replace(tmp, buf + tmp_offset - offset, tmp_offset,
-                         tmp->start + tmp->size - tmp_offset,
-                         &tmp_vb_list->next);
-          }
-          tmp_len -= result;
-          tmp_offset += result;
-        }
-        break;
-      case TYPE_DELETE:
-        if(tmp_offset < tmp->start)
-        {
-          if(tmp_offset + tmp_len < tmp->start)
-            insert_new_vbuf(&new, tmp, vb, tmp_offset, tmp_len,
-                            TYPE_REPLACE, buf + tmp_offset - offset);
-          else
-            insert_new_vbuf(&new, tmp, vb, tmp_offset, tmp->start - tmp_offset,
-                            TYPE_REPLACE, buf + tmp_offset - offset);
-
-          tmp_len -= new->size;
-          tmp_offset += new->size;
-          if(NULL == *vb_list)
-          {
-            *vb_list = (vbuf_list_t *) malloc(sizeof(vbuf_list_t));
-            tmp_vb_list = *vb_list;
-          }
-          else
-          {
-            tmp_vb_list = *vb_list;
-            while(NULL != tmp_vb_list->next)
-              tmp_vb_list = tmp_vb_list->next;
-            tmp_vb_list->next = (vbuf_list_t *) malloc(sizeof(vbuf_list_t));
-            tmp_vb_list = tmp_vb_list->next;
-          }
-          tmp_vb_list->vb = new;
-          tmp_vb_list->next = NULL;
-        }
-        break;
-      default:
-        break;
-    }
-    tmp = tmp->next;
-  }
+  return record_change(f, TYPE_INSERT, buf, offset, 0, len);
+}
 
-  if(0 != tmp_len)
-  {
-    if(tmp_offset < vb->start + vb->size)
-    {
 
-      if(tmp_offset + tmp_len < vb->start + vb->size)
-        insert_new_vbuf(&new, NULL, vb, tmp_offset, tmp_len,
-                        TYPE_REPLACE, buf + tmp_offset - offset);
-      else                      /* copy as much as we can, but basically we fail */
-        insert_new_vbuf(&new, NULL, vb, tmp_offset, vb->start + vb->size - tmp_offset,
-                        TYPE_REPLACE, buf + tmp_offset - offset);
-
-      tmp_len -= new->size;
-      if(NULL == *vb_list)
-      {
-        *vb_list = (vbuf_list_t *) malloc(sizeof(vbuf_list_t));
-        tmp_vb_list = *vb_list;
-      }
-      else
-      {
-        tmp_vb_list = *vb_list;
-        while(NULL != tmp_vb_list->next)
-          tmp_vb_list = tmp_vb_list->next;
-        tmp_vb_list->next = (vbuf_list_t *) malloc(sizeof(vbuf_list_t));
-        tmp_vb_list = tmp_vb_list->next;
-      }
-      tmp_vb_list->vb = new;
-      tmp_vb_list->next = NULL;
-    }
-  }
+/*---------------------------
 
-  return len - tmp_len;
+  ---------------------------*/
+size_t _replace(file_manager_t * f, char *buf, off_t offset, size_t len)
+{
+  /* make sure we're still in the file */
+  if(offset + len > vb_size(f->root) || 0 == len)
+    return 0;
+
+  if(merge_change(f, TYPE_REPLACE, buf, offset, len))
+    return len;
+
+  return record_change(f, TYPE_REPLACE, buf, offset, len, len);
 }
 
 
 /*---------------------------
 
   ---------------------------*/
-size_t _delete(vbuf_t * vb, off_t offset, size_t len,
-                 vbuf_list_t ** vb_list)
+size_t _delete(file_manager_t * f, off_t offset, size_t len)
 {
-  vbuf_t *tmp = NULL,
-    *new = NULL;
-  vbuf_list_t *tmp_vb_list = NULL;
-  off_t tmp_offset = 0;
-  size_t tmp_len = 0,
-    result = 0;
-
-  /* make sure we're still in the buf */
-  if(offset + len > vb->start + vb->size)
+  /* make sure we're still in the file */
+  if(offset + len > vb_size(f->root) || 0 == len)
     return 0;
 
-  tmp = vb->first_child;
-  tmp_offset = offset;
-  tmp_len = len;
+  return record_change(f, TYPE_DELETE, NULL, offset, len, 0);
+}
+
 
-  while(NULL != tmp && 0 != tmp_len)
+/*---------------------------
+  Copy len bytes starting offset
+  bytes into the piece
+  ---------------------------*/
+static size_t read_piece(file_manager_t * f, vbuf_t * vb, char *dest,
+                         off_t offset, size_t len)
+{
+  ssize_t result;
+
+  if(TYPE_FILE == vb->buf_type)
   {
-    switch (tmp->buf_type)
+    if(NULL != f->map)
     {
-      case TYPE_REPLACE:       /* no break */
-      case TYPE_INSERT:
-        if(tmp_offset < tmp->start)
-        {
-          if(tmp_offset + tmp_len < tmp->start)
-            insert_new_vbuf(&new, tmp, vb, tmp_offset, tmp_len,
-                            TYPE_DELETE, NULL);
-          else
-            insert_new_vbuf(&new, tmp, vb, tmp_offset, tmp->start - tmp_offset,
-                            TYPE_DELETE, NULL);
-
-          tmp_len -= new->size;
-          mod_parent_size(new->parent, new->size, FALSE);
-          mod_start_offset(new->next, new->size, FALSE);
-          if(NULL == *vb_list)
-          {
-            *vb_list = (vbuf_list_t *) malloc(sizeof(vbuf_list_t));
-            tmp_vb_list = *vb_list;
-          }
-          else
-          {
-            tmp_vb_list = *vb_list;
-            while(NULL != tmp_vb_list->next)
-              tmp_vb_list = tmp_vb_list->next;
-            tmp_vb_list->next = (vbuf_list_t *) malloc(sizeof(vbuf_list_t));
-            tmp_vb_list = tmp_vb_list->next;
-          }
-          tmp_vb_list->vb = new;
-          tmp_vb_list->next = NULL;
-        }
-        else if(tmp_offset < tmp->start + tmp->size)
-        {
-          if(tmp_offset + tmp_len < tmp->start + tmp->size)
-          {
-            if(NULL == tmp_vb_list)
-              result = _delete(tmp, tmp_offset, tmp_len, vb_list);
-            else
-              result = _delete(tmp, tmp_offset, tmp_len, &tmp_vb_list->next);
-          }
-          else
-          {
-            if(NULL == tmp_vb_list)
-              result =
-                _delete(tmp, tmp_offset, tmp->start + tmp->size - tmp_offset,
-                          vb_list);
-            else
-              result =
-                _delete(tmp, tmp_offset, tmp->start + tmp->size - tmp_offset,
-                          &tmp_vb_list->next);
-          }
-          tmp_len -= result;
-        }
-        break;
-      case TYPE_DELETE:
-        if(tmp_offset < tmp->start)
-        {
-          if(tmp_offset + tmp_len < tmp->start)
-            insert_new_vbuf(&new, tmp, vb, tmp_offset, tmp_len, TYPE_DELETE, NULL);
-          else
-            insert_new_vbuf(&new, tmp, vb, tmp_offset, tmp->start - tmp_offset,
-                            TYPE_DELETE, NULL);
-
-          tmp_len -= new->size;
-          mod_parent_size(new->parent, new->size, FALSE);
-          mod_start_offset(new->next, new->size, FALSE);
-          if(NULL == *vb_list)
-          {
-            *vb_list = (vbuf_list_t *) malloc(sizeof(vbuf_list_t));
-            tmp_vb_list = *vb_list;
-          }
-          else
-          {
-            tmp_vb_list = *vb_list;
-            while(NULL != tmp_vb_list->next)
-              tmp_vb_list = tmp_vb_list->next;
-            tmp_vb_list->next = (vbuf_list_t *) malloc(sizeof(vbuf_list_t));
-            tmp_vb_list = tmp_vb_list->next;
-          }
-          tmp_vb_list->vb = new;
-          tmp_vb_list->next = NULL;
-        }
-        break;
-      default:
-        break;
+      memcpy(dest, f->map + vb->start + offset, len);
+      return len;
     }
-    tmp = tmp->next;
+
+    if(NULL != f->cache)
+      return cache_read(f->cache, dest, vb->start + offset, len);
+
+    result = pread(fileno(f->fp), dest, len, vb->start + offset);
+    return result < 0 ? 0 : result;
   }
 
-  if(0 != tmp_len)
-  {
-    if(tmp_offset < vb->start + vb->size)
-    {
+  memcpy(dest, f->add.data + vb->start + offset, len);
+  return len;
+}
 
-      if(tmp_offset + tmp_len < vb->start + vb->size)
-        insert_new_vbuf(&new, NULL, vb, tmp_offset, tmp_len, TYPE_DELETE, NULL);
-      else                      /* copy as much as we can, but basically we fail */
-        insert_new_vbuf(&new, NULL, vb, tmp_offset,
-                        vb->start + vb->size - tmp_offset, TYPE_DELETE, NULL);
-
-      tmp_len -= new->size;
-      mod_parent_size(new->parent, new->size, FALSE);
-      mod_start_offset(new->next, new->size, FALSE);
-      if(NULL == *vb_list)
-      {
-        *vb_list = (vbuf_list_t *) malloc(sizeof(vbuf_list_t));
-        tmp_vb_list = *vb_list;
-      }
-      else
-      {
-        tmp_vb_list = *vb_list;
-        while(NULL != tmp_vb_list->next)
-          tmp_vb_list = tmp_vb_list->next;
-        tmp_vb_list->next = (vbuf_list_t *) malloc(sizeof(vbuf_list_t));
-        tmp_vb_list = tmp_vb_list->next;
-      }
-      tmp_vb_list->vb = new;
-      tmp_vb_list->next = NULL;
 
-    }
-  }
+/*---------------------------
+  In order walk of only the part
+  of the subtree overlapping the
+  range, base is the logical
+  offset of the subtree
+  ---------------------------*/
+static size_t vb_read(file_manager_t * f, vbuf_t * vb, off_t base,
+                      char *dest, off_t offset, off_t len)
+{
+  off_t piece_start, start, end;
+  size_t result = 0;
+
+  if(NULL == vb)
+    return 0;
 
-  return len - tmp_len;
+  piece_start = base + vb_size(vb->left);
+
+  if(offset < piece_start)
+    result += vb_read(f, vb->left, base, dest, offset, len);
+
+  start = offset > piece_start ? offset : piece_start;
+  end = offset + len < piece_start + vb->size ? offset + len : piece_start + vb->size;
+  if(start < end)
+    result += read_piece(f, vb, dest + start - offset, start - piece_start,
+                         end - start);
+
+  if(offset + len > piece_start + vb->size)
+    result += vb_read(f, vb->right, piece_start + vb->size, dest, offset, len);
+
+  return result;
 }
 
 
 /*---------------------------
 
   ---------------------------*/
-/* must keep a running offset cause but[offset] is not right if there are inserts/dels */
-char _get_char(vbuf_t * vb, char *result, off_t offset)
+char _get_char(file_manager_t * f, char *result, off_t offset)
 {
-  off_t shift = 0;
-  vbuf_t *tmp = vb->first_child;
+  vbuf_t *vb;
+  off_t piece_start;
   char value;
 
-  /* Offset is not in this set! */
-  if(offset >= vb->start + vb->size)
+  vb = vb_find(f->root, offset, &piece_start);
+
+  /* Offset is not in the file! */
+  if(NULL == vb)
   {
     *result = 0;
     return 0;
   }
 
-  /* Look for offset, is a sub vb or what? */
-  while(NULL != tmp)
-  {
+  read_piece(f, vb, &value, offset - piece_start, 1);
 
-    if(FALSE == tmp->active)
-    {
-      tmp = tmp->next;
-      continue;
-    }
+  *result = 1;
+  return value;
+}
 
-    if(offset < tmp->start)
-      break;
 
-    switch (tmp->buf_type)
-    {
-      case TYPE_INSERT:
-        if(offset < tmp->start + tmp->size)
-          return _get_char(tmp, result, offset);
-
-        shift -= tmp->size;
-        break;
-      case TYPE_REPLACE:
-        if(offset < tmp->start + tmp->size)
-          return _get_char(tmp, result, offset);
-
-        shift += get_internal_shift(tmp);
-        break;
-      case TYPE_DELETE:
-        shift += tmp->size;
-        break;
-      default:
-        break;
-    }
+/*---------------------------
+  One walk down to the start of
+  the range and along it, no
+  matter how many edits it holds
+  ---------------------------*/
+size_t _get_buf(file_manager_t * f, char *dest, off_t offset, size_t len)
+{
+  off_t size = vb_size(f->root);
 
-    tmp = tmp->next;
-  }
+  /* make sure we're still in the file */
+  if(offset >= size)
+    return 0;
+  if(offset + len > size)
+    len = size - offset;
 
-  /* It is definitely in this set and we didn't find it in the sub vbs, so it must be this one */
-  if(TYPE_FILE == vb->buf_type)
+  return vb_read(f, f->root, 0, dest, offset, len);
+}
+
+
+/*---------------------------
+  Up to len bytes at offset from
+  a single piece, in place when
+  the piece is in memory or else
+  read into bounce, which holds
+  VF_ITER_BOUNCE bytes
+  ---------------------------*/
+size_t _get_span(file_manager_t * f, const char **span, char *bounce,
+                 off_t offset, size_t len)
+{
+  vbuf_t *vb;
+  off_t piece_start;
+
+  vb = vb_find(f->root, offset, &piece_start);
+  if(NULL == vb || 0 == len)
+    return 0;
+
+  if(len > vb->size - (offset - piece_start))
+    len = vb->size - (offset - piece_start);
+
+  if(TYPE_FILE != vb->buf_type)
   {
-    fseeko(vb->fp, offset + shift, SEEK_SET);
-    fread(&value, 1, 1, vb->fp);
+    *span = f->add.data + vb->start + offset - piece_start;
+    return len;
   }
-  else
+
+  if(NULL != f->map)
   {
-    value = vb->buf[offset - vb->start + shift];
+    *span = f->map + vb->start + offset - piece_start;
+    return len;
   }
 
-  *result = 1;
-  return value;
+  if(NULL == bounce)
+    return 0;
+  if(len > VF_ITER_BOUNCE)
+    len = VF_ITER_BOUNCE;
+  *span = bounce;
+  return read_piece(f, vb, bounce, offset - piece_start, len);
 }
 
 
 /*---------------------------
-
+  Ask the kernel to start reading
+  the file pieces of the range
+  so they are in memory by the
+  time they are wanted
   ---------------------------*/
-size_t _get_buf(vbuf_t * vb, char *dest, off_t offset, size_t len)
+void _prefetch(file_manager_t * f, off_t offset, size_t len)
 {
-  vbuf_t *tmp = NULL;
-  off_t tmp_offset = 0, shift = 0;
-  size_t tmp_len = 0, read_len = 0, result = 0;
+  vbuf_t *vb;
+  off_t piece_start, start, page;
+  size_t n;
 
-  /* make sure we're still in the buf */
-  if(offset + len > vb->start + vb->size)
-    len = vb->start + vb->size - offset;
-  if (len < 1)
-    return 0;
+  page = sysconf(_SC_PAGESIZE);
 
-  tmp = vb->first_child;
-  tmp_offset = offset;
-  tmp_len = len;
-
-  while(NULL != tmp && 0 != tmp_len)
+  while(len > 0)
   {
-    if (tmp->active == 0)
-    {
-      tmp = tmp->next;
-      continue;
-    }
+    vb = vb_find(f->root, offset, &piece_start);
+    if(NULL == vb)
+      return;
 
-    if(tmp_offset < tmp->start)
-    {
-      if(tmp_offset + tmp_len < tmp->start)
-        read_len = tmp_len;
-      else
-        read_len = tmp->start - tmp_offset;
-
-      /* switch current type and copy all data */
-      switch(vb->buf_type)
-      {
-        case TYPE_FILE:
-          fseeko(vb->fp, tmp_offset + shift, SEEK_SET);
-          result = fread(dest + len - tmp_len, 1, read_len, vb->fp);
-          break;
-        case TYPE_INSERT: /* no break */
-        case TYPE_REPLACE:
-          memcpy(dest + len - tmp_len, vb->buf + tmp_offset + shift - vb->start, read_len);
-          result = read_len;
-          break;
-        case TYPE_DELETE: /* no break -- this should not occur */
-        default:
-          return len - tmp_len; /* error */
-      }
-
-      tmp_len -= result;
-      tmp_offset += result;
-    }
-    else if(tmp_offset < tmp->start + tmp->size)
-    {
-      switch (tmp->buf_type)
-      {
-        case TYPE_REPLACE:       /* no break */
-        case TYPE_INSERT:
-
-          if (tmp->buf_type == TYPE_INSERT)
-            shift -= tmp->size;
-          else /* TYPE_REPLACE */
-            shift += get_internal_shift(tmp);
-
-          if(tmp_offset + tmp_len < tmp->start + tmp->size)
-            read_len = tmp_len;
-          else
-            read_len = tmp->start + tmp->size - tmp_offset;
-
-          result = _get_buf(tmp, dest + len - tmp_len, tmp_offset, read_len);
-
-          tmp_len -= result;
-          tmp_offset += result;
-          break;
-        case TYPE_DELETE:
-          shift += tmp->size;
-          break;
-        default:
-          break;
-      }
-      tmp = tmp->next;
-    }
-    else
-    {
-      if (tmp->buf_type == TYPE_INSERT)
-        shift -= tmp->size;
-      else if (tmp->buf_type == TYPE_REPLACE)
-        shift += get_internal_shift(tmp);
-      else if (tmp->buf_type == TYPE_DELETE)
-        shift += tmp->size;
-
-      tmp = tmp->next;
-    }
-  }
+    n = vb->size - (offset - piece_start);
+    if(n > len)
+      n = len;
 
-  if(0 != tmp_len)
-  {
-    if(tmp_offset < vb->start + vb->size)
+    if(TYPE_FILE == vb->buf_type)
     {
-
-      if(tmp_offset + tmp_len < vb->start + vb->size)
-        read_len = tmp_len;
+      start = vb->start + offset - piece_start;
+      if(NULL != f->map)
+        madvise(f->map + start - start % page, n + start % page,
+                MADV_WILLNEED);
       else
-        read_len = vb->start + vb->size - tmp_offset;
-
-      /* switch current type and copy all data */
-      switch(vb->buf_type)
-      {
-        case TYPE_FILE:
-          fseeko(vb->fp, tmp_offset + shift, SEEK_SET);
-          result = fread(dest + len - tmp_len, 1, read_len, vb->fp);
-          break;
-        case TYPE_INSERT: /* no break */
-        case TYPE_REPLACE:
-          memcpy(dest + len - tmp_len, vb->buf + tmp_offset + shift - vb->start, read_len);
-          result = read_len;
-          break;
-        case TYPE_DELETE: /* no break -- this should not occur */
-        default:
-          return len - tmp_len; /* error */
-      }
-
-      tmp_len -= result;
-      tmp_offset += result;
+        posix_fadvise(fileno(f->fp), start, n, POSIX_FADV_WILLNEED);
     }
-  }
 
-  return len - tmp_len;
+    offset += n;
+    len -= n;
+  }
 }
-
-
@@ -36,19 +36,34 @@
 /****************
    PROTOTYPES
  ***************/
+void slab_init(slab_t * slab, size_t item_size);
+void *slab_alloc(slab_t * slab);
+void slab_free(slab_t * slab, void *item);
+void slab_free_all(slab_t * slab);
+BOOL slab_reserve(slab_t * slab, int count);
+void add_init(add_buf_t * add);
+off_t add_alloc(add_buf_t * add, off_t len);
+void add_free(add_buf_t * add);
 void cleanup(file_manager_t * f);
+void attach_file(file_manager_t * f);
+void detach_file(file_manager_t * f);
 extern inline void compute_percent_complete(off_t offset, off_t size, int *complete);
-void mod_start_offset(vbuf_t * vb, off_t shift, BOOL increase);
-void mod_parent_size(vbuf_t * vb, off_t shift, BOOL increase);
-void prune(vbuf_undo_list_t * undo_list);
-size_t _insert_before(vbuf_t * vb, char *buf, off_t offset, size_t len,
-                      vbuf_undo_list_t ** undo_list);
-size_t _replace(vbuf_t * vb, char *buf, off_t offset, size_t len,
-                vbuf_list_t ** vb_list);
-size_t _delete(vbuf_t * vb, off_t offset, size_t len,
-                 vbuf_list_t ** vb_list);
-char _get_char(vbuf_t * vb, char *result, off_t offset);
-size_t _get_buf(vbuf_t * vb, char *dest, off_t offset, size_t len);
+void prune(file_manager_t * f);
+void fold_history(file_manager_t * f);
+void set_undo_limit(long changes, off_t bytes);
+vbuf_t *new_vbuf(file_manager_t * f, buf_type_e buf_type, off_t start,
+                 off_t size);
+vbuf_t *get_piece(file_manager_t * f, off_t offset, off_t * piece_start);
+BOOL apply_change(file_manager_t * f, vbuf_undo_list_t * change);
+BOOL revert_change(file_manager_t * f, vbuf_undo_list_t * change);
+size_t _insert_before(file_manager_t * f, char *buf, off_t offset, size_t len);
+size_t _replace(file_manager_t * f, char *buf, off_t offset, size_t len);
+size_t _delete(file_manager_t * f, off_t offset, size_t len);
+char _get_char(file_manager_t * f, char *result, off_t offset);
+size_t _get_buf(file_manager_t * f, char *dest, off_t offset, size_t len);
+size_t _get_span(file_manager_t * f, const char **span, char *bounce,
+                 off_t offset, size_t len);
+void _prefetch(file_manager_t * f, off_t offset, size_t len);
 
 #endif /* __VIRT_FILE_H__ */
 
@@ -0,0 +1,286 @@
+/******************************************************
+ *
+ * Project: Virtual File
+ * Author:  David Kelley
+ * Description: LRU cache of file blocks filled with pread,
+ *              for files that can not be mapped
+ *
+ * Copyright (C) 2009 David Kelley
+ *
+ * This file is part of bviplus.
+ *
+ * Bviplus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bviplus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bviplus.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************/
+
+/****************
+    INCLUDES
+ ***************/
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vf_cache.h"
+
+
+/****************
+   PROTOTYPES
+ ***************/
+static int  cache_max_blocks(void);
+static void lru_unlink(cache_block_t * b);
+static void lru_push(block_cache_t * c, cache_block_t * b);
+static void hash_unlink(block_cache_t * c, cache_block_t * b);
+static void evict(block_cache_t * c);
+static cache_block_t *get_block(block_cache_t * c, off_t offset);
+static size_t read_direct(block_cache_t * c, char *dest, off_t offset,
+                          size_t len);
+
+
+/****************
+    GLOBALS
+ ***************/
+/* budget in bytes for each file's cache */
+static size_t cache_size = CACHE_DEFAULT_SIZE;
+
+
+/****************
+    FUNCTIONS
+ ***************/
+/*---------------------------
+
+  ---------------------------*/
+void cache_set_size(size_t size)
+{
+  cache_size = size;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+static int cache_max_blocks(void)
+{
+  return cache_size / CACHE_BLOCK_SIZE;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+static void lru_unlink(cache_block_t * b)
+{
+  b->lru_prev->lru_next = b->lru_next;
+  b->lru_next->lru_prev = b->lru_prev;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+static void lru_push(block_cache_t * c, cache_block_t * b)
+{
+  b->lru_next = c->lru.lru_next;
+  b->lru_prev = &c->lru;
+  c->lru.lru_next->lru_prev = b;
+  c->lru.lru_next = b;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+static void hash_unlink(block_cache_t * c, cache_block_t * b)
+{
+  cache_block_t **tmp;
+
+  tmp = &c->hash[(b->offset / CACHE_BLOCK_SIZE) & (CACHE_HASH_SIZE - 1)];
+  while (*tmp != b)
+    tmp = &(*tmp)->hash_next;
+  *tmp = b->hash_next;
+}
+
+
+/*---------------------------
+  Drop the least recently used
+  block
+  ---------------------------*/
+static void evict(block_cache_t * c)
+{
+  cache_block_t *b = c->lru.lru_prev;
+
+  if (b == &c->lru)
+    return;
+
+  lru_unlink(b);
+  hash_unlink(c, b);
+  free(b);
+  c->count--;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+void cache_destroy(block_cache_t * c)
+{
+  if (NULL == c)
+    return;
+
+  while (0 != c->count)
+    evict(c);
+
+  pthread_mutex_destroy(&c->lock);
+  free(c);
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+block_cache_t *cache_create(int fd)
+{
+  block_cache_t *c;
+
+  c = (block_cache_t *)calloc(1, sizeof(block_cache_t));
+  if (NULL == c)
+    return NULL;
+
+  c->fd = fd;
+  c->lru.lru_next = &c->lru;
+  c->lru.lru_prev = &c->lru;
+  pthread_mutex_init(&c->lock, NULL);
+
+  return c;
+}
+
+
+/*---------------------------
+  Find the block holding offset,
+  reading it in if needed
+  ---------------------------*/
+static cache_block_t *get_block(block_cache_t * c, off_t offset)
+{
+  cache_block_t *b, **bucket;
+  ssize_t result;
+
+  offset -= offset % CACHE_BLOCK_SIZE;
+  bucket = &c->hash[(offset / CACHE_BLOCK_SIZE) & (CACHE_HASH_SIZE - 1)];
+
+  for (b = *bucket; NULL != b; b = b->hash_next)
+  {
+    if (b->offset == offset)
+    {
+      c->hits++;
+      lru_unlink(b);
+      lru_push(c, b);
+      return b;
+    }
+  }
+
+  c->misses++;
+
+  while (c->count >= cache_max_blocks() && 0 != c->count)
+    evict(c);
+
+  b = (cache_block_t *)malloc(sizeof(cache_block_t));
+  if (NULL == b)
+    return NULL;
+
+  result = pread(c->fd, b->data, CACHE_BLOCK_SIZE, offset);
+  if (result <= 0)
+  {
+    free(b);
+    return NULL;
+  }
+
+  b->offset = offset;
+  b->len = result;
+  b->hash_next = *bucket;
+  *bucket = b;
+  lru_push(c, b);
+  c->count++;
+
+  return b;
+}
+
+
+/*---------------------------
+  Read straight from the file,
+  without the lock
+  ---------------------------*/
+static size_t read_direct(block_cache_t * c, char *dest, off_t offset,
+                          size_t len)
+{
+  size_t done = 0;
+  ssize_t result;
+
+  while (done < len)
+  {
+    result = pread(c->fd, dest + done, len - done, offset + done);
+    if (result <= 0)
+      break;
+    done += result;
+  }
+
+  return done;
+}
+
+
+/*---------------------------
+  Reads of a block or more go
+  around the cache, so search
+  workers do not queue on the
+  lock behind each other's pread
+  ---------------------------*/
+size_t cache_read(block_cache_t * c, char *dest, off_t offset, size_t len)
+{
+  cache_block_t *b;
+  size_t done = 0, block_offset, read_len;
+
+  if (len >= CACHE_BLOCK_SIZE)
+    return read_direct(c, dest, offset, len);
+
+  pthread_mutex_lock(&c->lock);
+
+  /* caching turned off */
+  if (0 == cache_max_blocks())
+  {
+    while (0 != c->count)
+      evict(c);
+    pthread_mutex_unlock(&c->lock);
+    return read_direct(c, dest, offset, len);
+  }
+
+  while (done < len)
+  {
+    b = get_block(c, offset + done);
+    if (NULL == b)
+      break;
+
+    block_offset = offset + done - b->offset;
+    if (block_offset >= b->len)
+      break;
+
+    read_len = b->len - block_offset;
+    if (read_len > len - done)
+      read_len = len - done;
+
+    memcpy(dest + done, b->data + block_offset, read_len);
+    done += read_len;
+  }
+
+  pthread_mutex_unlock(&c->lock);
+
+  return done;
+}
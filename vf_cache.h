@@ -0,0 +1,81 @@
+/*************************************************************************
+ *
+ * File:        vf_cache.h
+ * Author:      David Kelley
+ * Description: Defines, structures, and function prototypes
+ *              related to the block cache used for reading files
+ *              which can not be mapped
+ *
+ * Copyright (C) 2009 David Kelley
+ *
+ * This file is part of bviplus.
+ *
+ * Bviplus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bviplus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bviplus.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ************************************************************************/
+
+#ifndef __VF_CACHE_H__
+#define __VF_CACHE_H__
+
+/****************
+    INCLUDES
+ ***************/
+#include <sys/types.h>
+#include <pthread.h>
+
+
+/****************
+  MACROS/DEFINES
+ ***************/
+#define CACHE_BLOCK_SIZE (64 * 1024)
+#define CACHE_HASH_SIZE  1024 /* power of two */
+#define CACHE_DEFAULT_SIZE (16 * 1024 * 1024)
+
+
+/****************
+     TYPES
+ ***************/
+typedef struct cache_block_s cache_block_t;
+struct cache_block_s
+{
+  cache_block_t *hash_next;
+  cache_block_t *lru_next;      /* towards the least recently used */
+  cache_block_t *lru_prev;
+  off_t offset;                 /* block aligned offset in the file */
+  size_t len;                   /* bytes valid, short at end of file */
+  char data[CACHE_BLOCK_SIZE];
+};
+
+typedef struct block_cache_s block_cache_t;
+struct block_cache_s
+{
+  int fd;
+  cache_block_t *hash[CACHE_HASH_SIZE];
+  cache_block_t lru;            /* list head, lru.lru_next is most recent */
+  int count;
+  pthread_mutex_t lock;         /* searches read from several threads */
+  unsigned long hits;
+  unsigned long misses;
+};
+
+
+/****************
+   PROTOTYPES
+ ***************/
+void           cache_set_size(size_t size);
+block_cache_t *cache_create(int fd);
+void           cache_destroy(block_cache_t * c);
+size_t         cache_read(block_cache_t * c, char *dest, off_t offset, size_t len);
+
+#endif /* __VF_CACHE_H__ */
@@ -0,0 +1,514 @@
+/******************************************************
+ *
+ * Project: Virtual File
+ * Author:  David Kelley
+ * Description: Append only journal of the edits made to a
+ *              file, written next to it and replayed onto
+ *              the unchanged original after a crash
+ *
+ * Copyright (C) 2009 David Kelley
+ *
+ * This file is part of bviplus.
+ *
+ * Bviplus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bviplus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bviplus.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************/
+
+/****************
+    INCLUDES
+ ***************/
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "vf_journal.h"
+
+
+/****************
+   PROTOTYPES
+ ***************/
+static long long now_ms(void);
+static uint32_t checksum(journal_rec_t * rec, const char *payload);
+static int  has_payload(uint32_t op);
+static int  fill_head(journal_head_t * head, int file_fd);
+static int  append(vf_journal_t * j, const void *data, size_t len);
+static int  flush(vf_journal_t * j);
+static int  create(vf_journal_t * j, int file_fd);
+
+
+/****************
+    FUNCTIONS
+ ***************/
+/*---------------------------
+
+  ---------------------------*/
+static long long now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+
+/*---------------------------
+  FNV-1a over the record, with
+  sum zeroed, and its payload
+  ---------------------------*/
+static uint32_t checksum(journal_rec_t * rec, const char *payload)
+{
+  journal_rec_t tmp = *rec;
+  const unsigned char *p = (const unsigned char *)&tmp;
+  uint32_t sum = 2166136261U;
+  size_t i;
+
+  tmp.sum = 0;
+  for (i = 0; i < sizeof(tmp); i++)
+    sum = (sum ^ p[i]) * 16777619U;
+
+  p = (const unsigned char *)payload;
+  for (i = 0; has_payload(rec->op) && i < (size_t)rec->len; i++)
+    sum = (sum ^ p[i]) * 16777619U;
+
+  return sum;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+static int has_payload(uint32_t op)
+{
+  return op == JOURNAL_INSERT || op == JOURNAL_REPLACE;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+static int fill_head(journal_head_t * head, int file_fd)
+{
+  struct stat st;
+
+  memset(head, 0, sizeof(*head));
+  if (fstat(file_fd, &st))
+    return 0;
+
+  memcpy(head->magic, JOURNAL_MAGIC, sizeof(head->magic));
+  head->dev = st.st_dev;
+  head->ino = st.st_ino;
+  head->size = st.st_size;
+  head->mtime_sec = st.st_mtim.tv_sec;
+  head->mtime_nsec = st.st_mtim.tv_nsec;
+
+  return 1;
+}
+
+
+/*---------------------------
+  ".name.bvj" in the directory
+  of the file, no journal for
+  a file with no name yet
+  ---------------------------*/
+void journal_init(vf_journal_t * j, const char *fname)
+{
+  const char *base;
+
+  memset(j, 0, sizeof(*j));
+  j->fd = -1;
+
+  if (NULL == fname || 0 == fname[0])
+    return;
+
+  base = strrchr(fname, '/');
+  if (NULL == base)
+    snprintf(j->name, sizeof(j->name), ".%s.bvj", fname);
+  else
+    snprintf(j->name, sizeof(j->name), "%.*s/.%s.bvj",
+             (int)(base - fname), fname, base + 1);
+}
+
+
+/*---------------------------
+  Is there a journal of edits
+  to exactly this file
+  ---------------------------*/
+int journal_matches(vf_journal_t * j, int file_fd)
+{
+  journal_head_t head, want;
+  int fd, result;
+
+  if (0 == j->name[0] || file_fd < 0)
+    return 0;
+
+  fd = open(j->name, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  result = pread(fd, &head, sizeof(head), 0) == sizeof(head) &&
+           fill_head(&want, file_fd) &&
+           0 == memcmp(&head, &want, sizeof(head));
+  close(fd);
+
+  return result;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+static int append(vf_journal_t * j, const void *data, size_t len)
+{
+  size_t alloc = j->alloc;
+  char *tmp;
+
+  if (j->len + len > alloc)
+  {
+    if (alloc < JOURNAL_BATCH)
+      alloc = JOURNAL_BATCH;
+    while (j->len + len > alloc)
+      alloc *= 2;
+    tmp = (char *)realloc(j->buf, alloc);
+    if (NULL == tmp)
+      return 0;
+    j->buf = tmp;
+    j->alloc = alloc;
+  }
+
+  memcpy(j->buf + j->len, data, len);
+  j->len += len;
+
+  return 1;
+}
+
+
+/*---------------------------
+  Write out what is buffered,
+  it is not durable until the
+  next fsync
+  ---------------------------*/
+static int flush(vf_journal_t * j)
+{
+  ssize_t result;
+  size_t done = 0;
+
+  while (done < j->len)
+  {
+    result = pwrite(j->fd, j->buf + done, j->len - done, j->size);
+    if (result <= 0)
+      return 0;
+    done += result;
+    j->size += result;
+  }
+  j->len = 0;
+
+  return 1;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+static int create(vf_journal_t * j, int file_fd)
+{
+  journal_head_t head;
+
+  if (0 == fill_head(&head, file_fd))
+    return 0;
+
+  j->fd = open(j->name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (j->fd < 0)
+    return 0;
+
+  if (pwrite(j->fd, &head, sizeof(head), 0) != sizeof(head))
+  {
+    close(j->fd);
+    unlink(j->name);
+    j->fd = -1;
+    return 0;
+  }
+
+  j->size = sizeof(head);
+  j->synced_ms = now_ms();
+
+  return 1;
+}
+
+
+/*---------------------------
+  Buffer one edit, the journal
+  is made on the first one.
+  file_fd is the file the edits
+  apply to.
+  ---------------------------*/
+void journal_record(vf_journal_t * j, int file_fd, journal_op_e op,
+                    off_t offset, const char *buf, off_t len)
+{
+  journal_rec_t rec;
+
+  if (0 == j->name[0] || j->failed || j->paused)
+    return;
+
+  if (j->fd < 0 && 0 == create(j, file_fd))
+  {
+    j->failed = 1;
+    return;
+  }
+
+  rec.op = op;
+  rec.offset = offset;
+  rec.len = len;
+  rec.sum = checksum(&rec, buf);
+
+  if (0 == append(j, &rec, sizeof(rec)) ||
+      (has_payload(op) && 0 == append(j, buf, len)))
+  {
+    j->failed = 1;
+    return;
+  }
+  j->unsynced++;
+
+  if (j->len >= JOURNAL_BATCH)
+    flush(j);
+}
+
+
+/*---------------------------
+  Write and fsync what has been
+  recorded, once JOURNAL_SYNC_MS
+  have passed since the last
+  time or when forced. Returns
+  non zero while edits are still
+  waiting for it.
+  ---------------------------*/
+int journal_sync(vf_journal_t * j, int force)
+{
+  long long now;
+
+  if (j->fd < 0 || 0 == j->unsynced)
+    return 0;
+
+  now = now_ms();
+  if (!force && now - j->synced_ms < JOURNAL_SYNC_MS)
+    return 1;
+
+  flush(j);
+  fdatasync(j->fd);
+  j->synced_ms = now;
+  j->unsynced = 0;
+
+  return 0;
+}
+
+
+/*---------------------------
+  A save is starting, the edits
+  made from here on are the ones
+  to keep if it succeeds while
+  editing carries on
+  ---------------------------*/
+void journal_mark(vf_journal_t * j)
+{
+  if (j->fd < 0)
+    j->mark = sizeof(journal_head_t);
+  else
+    j->mark = j->size + j->len;
+}
+
+
+/*---------------------------
+  The save since the mark has
+  replaced the file, so keep the
+  records after the mark under a
+  header for the new file
+  ---------------------------*/
+void journal_rebase(vf_journal_t * j, int file_fd)
+{
+  char tmp_name[PATH_MAX + 8], *copy;
+  journal_head_t head;
+  off_t offset;
+  ssize_t result;
+  int fd, failed = 0;
+
+  if (j->fd < 0)
+    return;
+
+  flush(j);
+  if (j->size <= j->mark)
+  {
+    journal_remove(j);
+    return;
+  }
+
+  snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", j->name);
+  fd = open(tmp_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  copy = (char *)malloc(JOURNAL_BATCH);
+  if (fd < 0 || NULL == copy || 0 == fill_head(&head, file_fd) ||
+      pwrite(fd, &head, sizeof(head), 0) != sizeof(head))
+    failed = 1;
+
+  for (offset = j->mark; offset < j->size && !failed; offset += result)
+  {
+    result = pread(j->fd, copy, JOURNAL_BATCH, offset);
+    if (result <= 0 ||
+        pwrite(fd, copy, result, offset - j->mark + sizeof(head)) != result)
+      failed = 1;
+  }
+
+  if (!failed && (fdatasync(fd) || rename(tmp_name, j->name)))
+    failed = 1;
+
+  free(copy);
+
+  if (failed)
+  {
+    /* better no journal than one that replays onto the wrong file */
+    if (fd >= 0)
+    {
+      close(fd);
+      unlink(tmp_name);
+    }
+    journal_remove(j);
+    j->failed = 1;
+    return;
+  }
+
+  close(j->fd);
+  j->fd = fd;
+  j->size = j->size - j->mark + sizeof(head);
+  j->mark = 0;
+  j->unsynced = 0;
+  j->synced_ms = now_ms();
+}
+
+
+/*---------------------------
+  The edits are saved or thrown
+  away, so is the journal. One
+  this session did not make is
+  left alone.
+  ---------------------------*/
+void journal_remove(vf_journal_t * j)
+{
+  if (j->fd >= 0)
+  {
+    close(j->fd);
+    unlink(j->name);
+  }
+
+  free(j->buf);
+  j->buf = NULL;
+  j->alloc = 0;
+  j->fd = -1;
+  j->len = 0;
+  j->size = 0;
+  j->mark = 0;
+  j->unsynced = 0;
+  j->failed = 0;
+}
+
+
+/*---------------------------
+  Throw away a journal left by
+  an earlier session
+  ---------------------------*/
+void journal_discard(vf_journal_t * j)
+{
+  if (j->fd < 0 && 0 != j->name[0])
+    unlink(j->name);
+}
+
+
+/*---------------------------
+  Open the journal found by
+  journal_matches for reading
+  records back
+  ---------------------------*/
+int journal_replay_start(vf_journal_t * j)
+{
+  if (j->fd >= 0 || 0 == j->name[0])
+    return 0;
+
+  j->fd = open(j->name, O_RDWR);
+  if (j->fd < 0)
+    return 0;
+
+  j->size = sizeof(journal_head_t);
+  j->paused = 1;
+
+  return 1;
+}
+
+
+/*---------------------------
+  The next whole record, 0 at
+  the end or at the first torn
+  or garbled one. payload stays
+  valid until the next call.
+  ---------------------------*/
+int journal_read(vf_journal_t * j, journal_rec_t * rec, char **payload)
+{
+  size_t len = 0;
+  char *tmp;
+
+  if (pread(j->fd, rec, sizeof(*rec), j->size) != sizeof(*rec))
+    return 0;
+  if (rec->op >= MAX_JOURNAL_OPS || rec->len < 0)
+    return 0;
+
+  if (has_payload(rec->op))
+  {
+    len = rec->len;
+    if (len > j->payload_alloc)
+    {
+      tmp = (char *)realloc(j->payload, len);
+      if (NULL == tmp)
+        return 0;
+      j->payload = tmp;
+      j->payload_alloc = len;
+    }
+    if (pread(j->fd, j->payload, len, j->size + sizeof(*rec)) != (ssize_t)len)
+      return 0;
+  }
+
+  if (checksum(rec, j->payload) != rec->sum)
+    return 0;
+
+  *payload = j->payload;
+  j->size += sizeof(*rec) + len;
+
+  return 1;
+}
+
+
+/*---------------------------
+  New edits go after the last
+  good record, anything torn
+  after it is cut off
+  ---------------------------*/
+void journal_replay_end(vf_journal_t * j)
+{
+  if (j->fd >= 0 && ftruncate(j->fd, j->size))
+    j->failed = 1;
+
+  free(j->payload);
+  j->payload = NULL;
+  j->payload_alloc = 0;
+  j->paused = 0;
+  j->synced_ms = now_ms();
+}
@@ -0,0 +1,120 @@
+/*************************************************************************
+ *
+ * File:        vf_journal.h
+ * Author:      David Kelley
+ * Description: Defines, structures, and function prototypes
+ *              related to the edit journal kept next to each file
+ *              so a session can be recovered after a crash
+ *
+ * Copyright (C) 2009 David Kelley
+ *
+ * This file is part of bviplus.
+ *
+ * Bviplus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bviplus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bviplus.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ************************************************************************/
+
+#ifndef __VF_JOURNAL_H__
+#define __VF_JOURNAL_H__
+
+/****************
+    INCLUDES
+ ***************/
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/****************
+  MACROS/DEFINES
+ ***************/
+#define JOURNAL_MAGIC   "BVIPJNL1"
+#define JOURNAL_BATCH   (64 * 1024) /* buffered before a write */
+#define JOURNAL_SYNC_MS 1000        /* longest an edit waits for fsync */
+
+
+/****************
+     TYPES
+ ***************/
+typedef enum
+{
+  JOURNAL_INSERT,
+  JOURNAL_REPLACE,
+  JOURNAL_DELETE,
+  JOURNAL_UNDO,                 /* len is the count */
+  JOURNAL_REDO,
+  JOURNAL_CLOSE,                /* the newest change stops growing */
+  MAX_JOURNAL_OPS
+} journal_op_e;
+
+/* Identifies the file the edits apply to, they are only replayed onto
+   the very same file */
+typedef struct journal_head_s journal_head_t;
+struct journal_head_s
+{
+  char magic[8];
+  uint64_t dev;
+  uint64_t ino;
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+/* Followed by len bytes for inserts and replaces. sum covers the
+   record and its payload, so a torn write at the end is seen. */
+typedef struct journal_rec_s journal_rec_t;
+struct journal_rec_s
+{
+  uint32_t op;
+  uint32_t sum;
+  int64_t offset;
+  int64_t len;
+};
+
+typedef struct vf_journal_s vf_journal_t;
+struct vf_journal_s
+{
+  char name[PATH_MAX];
+  int fd;                       /* -1 until the first edit */
+  char *buf;                    /* records not written yet */
+  size_t len;
+  size_t alloc;
+  off_t size;                   /* bytes written to fd */
+  off_t mark;                   /* end of the journal when a save began */
+  long long synced_ms;          /* when fd was last fsynced */
+  int unsynced;                 /* records since then */
+  int failed;                   /* could not be created, stop trying */
+  int paused;                   /* replaying, edits are already in it */
+  char *payload;                /* read buffer while replaying */
+  size_t payload_alloc;
+};
+
+
+/****************
+   PROTOTYPES
+ ***************/
+void journal_init(vf_journal_t * j, const char *fname);
+int  journal_matches(vf_journal_t * j, int file_fd);
+void journal_record(vf_journal_t * j, int file_fd, journal_op_e op,
+                    off_t offset, const char *buf, off_t len);
+int  journal_sync(vf_journal_t * j, int force);
+void journal_mark(vf_journal_t * j);
+void journal_rebase(vf_journal_t * j, int file_fd);
+void journal_remove(vf_journal_t * j);
+void journal_discard(vf_journal_t * j);
+int  journal_replay_start(vf_journal_t * j);
+int  journal_read(vf_journal_t * j, journal_rec_t * rec, char **payload);
+void journal_replay_end(vf_journal_t * j);
+
+#endif /* __VF_JOURNAL_H__ */
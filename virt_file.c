@@ -26,10 +26,16 @@
 /****************
     INCLUDES
  ***************/
+#define _GNU_SOURCE /* copy_file_range, fallocate */
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "virt_file.h"
 #include "vf_backend.h"
@@ -37,8 +43,28 @@
 /****************
   MACROS/DEFINES
  ***************/
-#define BUF_TOGGLE(x) (x ^ 1)
-#define MAX_SAVE_SHIFT (4 * 1024 * 1024) /* two megs (change save so that we can grow this dynamically if we need more? */
+#define SAVE_BUF_SIZE (4 * 1024 * 1024) /* four megs */
+#define SAVE_IOV      64                /* edit pieces per pwritev */
+
+#if defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+# define HAVE_COPY_FILE_RANGE
+#endif
+
+#ifdef FALLOC_FL_INSERT_RANGE
+# define HAVE_RANGE_SHIFT
+#endif
+
+/****************
+   PROTOTYPES
+ ***************/
+static off_t reload(file_manager_t * f, off_t size);
+static vf_save_job_t *save_prepare(file_manager_t * f, const char *dest,
+                                   struct stat *st, int *complete);
+static void *save_run(void *data);
+static void save_free(vf_save_job_t * job);
+static void note(file_manager_t * f, journal_op_e op, off_t offset,
+                 const char *buf, off_t len);
 
 /****************
     FUNCTIONS
@@ -266,6 +292,29 @@ BOOL vf_init(file_manager_t * f, const char *file_name)
     return FALSE;
 
   f->private_data = NULL;
+  f->map = NULL;
+  f->cache = NULL;
+  f->root = NULL;
+  f->seed = 2463534242U;
+  slab_init(&f->vb_slab, sizeof(vbuf_t));
+  slab_init(&f->ul_slab, sizeof(vbuf_undo_list_t));
+  add_init(&f->add);
+  f->hist.oldest = NULL;
+  f->hist.newest = NULL;
+  f->hist.current = NULL;
+  f->hist.saved = NULL;
+  f->hist.saved_lost = FALSE;
+  f->hist.saving = NULL;
+  f->hist.saving_lost = FALSE;
+  f->hist.saving_crossed = FALSE;
+  f->hist.count = 0;
+  f->hist.bytes = 0;
+  f->job = NULL;
+  f->stale = FALSE;
+  f->partial = FALSE;
+  f->recoverable = FALSE;
+  f->edit_hook = NULL;
+  journal_init(&f->journal, NULL);
   /* If given a file name fill in some info.
      If not the user must open the stream and set the size.
      Filename is still required for saving at this point.
@@ -275,9 +324,10 @@ BOOL vf_init(file_manager_t * f, const char *file_name)
     if (FALSE == vf_parse_path(f->fname, file_name))
       return FALSE;
 
-    f->fm.fp = fopen(f->fname, "a");
-    if(NULL != f->fm.fp)
-      fclose(f->fm.fp);
+    f->fp = fopen(f->fname, "a");
+    if(NULL != f->fp)
+      fclose(f->fp);
+    f->fp = NULL;
 
     if (stat(f->fname, &stat_buf))
     {
@@ -288,35 +338,41 @@ BOOL vf_init(file_manager_t * f, const char *file_name)
     {
       if (S_ISDIR(stat_buf.st_mode))
         return FALSE;
-      f->fm.size = stat_buf.st_size;
+      f->file_size = stat_buf.st_size;
     }
 
-    f->fm.fp = fopen(f->fname, "r");
-    if(NULL == f->fm.fp)
+    f->fp = fopen(f->fname, "r");
+    if(NULL == f->fp)
     {
       vf_term(f);
       return FALSE;
     }
+
+    /* block devices report no size through stat */
+    if (S_ISBLK(stat_buf.st_mode))
+      f->file_size = lseek(fileno(f->fp), 0, SEEK_END);
+
+    attach_file(f);
+
+    journal_init(&f->journal, f->fname);
+    f->recoverable = journal_matches(&f->journal, fileno(f->fp));
   }
   else
   {
     f->fname[0] = 0;
-    f->fm.fp = NULL;
-    f->fm.size = 0;
-  }
-
-  f->fm.parent = NULL;
-  f->fm.first_child = NULL;
-  f->fm.next = NULL;
-  f->fm.prev = NULL;
-  f->fm.buf = NULL;
-  f->fm.start = 0;
-  f->fm.buf_type = TYPE_FILE;
-  f->fm.active = TRUE;
-  f->ul.last = NULL;
-  f->ul.vb_list = NULL;
-  f->ul.applied = FALSE;
-  f->ul.saved = FALSE;
+    f->fp = NULL;
+    f->file_size = 0;
+  }
+
+  if (0 != f->file_size)
+  {
+    f->root = new_vbuf(f, TYPE_FILE, 0, f->file_size);
+    if (NULL == f->root)
+    {
+      vf_term(f);
+      return FALSE;
+    }
+  }
 
   return TRUE;
 }
@@ -330,11 +386,17 @@ void vf_term(file_manager_t * f)
   if (NULL == f)
     return;
 
+  vf_save_wait(f);
+  if (NULL != f->edit_hook)
+    f->edit_hook(f, -1, 0, 0);
+  f->edit_hook = NULL;
+  journal_remove(&f->journal);
   cleanup(f);
-  if (NULL != f->fm.fp)
+  detach_file(f);
+  if (NULL != f->fp)
   {
-    fclose(f->fm.fp);
-    f->fm.fp = NULL;
+    fclose(f->fp);
+    f->fp = NULL;
   }
 }
 
@@ -345,11 +407,50 @@ void vf_stat(file_manager_t * f, vf_stat_t * s)
     return;
 
   s->file_size = 0;
+  s->disk_size = 0;
+  s->undo_changes = 0;
+  s->undo_bytes = 0;
+  s->add_size = 0;
+  s->add_dead = 0;
+  s->cache_hits = 0;
+  s->cache_misses = 0;
 
   if (f == NULL)
     return;
 
-  s->file_size = f->fm.size;
+  if (f->root != NULL)
+    s->file_size = f->root->subtree_size;
+
+  s->disk_size = f->file_size;
+  s->undo_changes = f->hist.count;
+  s->undo_bytes = f->hist.bytes;
+  s->add_size = f->add.size;
+  s->add_dead = f->add.dead;
+
+  if (f->cache != NULL)
+  {
+    s->cache_hits = f->cache->hits;
+    s->cache_misses = f->cache->misses;
+  }
+}
+
+/*---------------------------
+  Budget in bytes for the block
+  cache of each unmapped file
+  ---------------------------*/
+void vf_set_cache_size(size_t size)
+{
+  cache_set_size(size);
+}
+
+/*---------------------------
+  Most changes, and bytes they
+  may hold, kept for undo in
+  each file (0 = no limit)
+  ---------------------------*/
+void vf_set_undo_limit(long changes, off_t bytes)
+{
+  set_undo_limit(changes, bytes);
 }
 
 /*---------------------------
@@ -393,31 +494,39 @@ BOOL vf_create_file(file_manager_t * f, const char *file_name)
   if (FALSE == vf_parse_path(f->fname, file_name))
     return FALSE;
 
-  f->fm.fp = fopen(f->fname, "r");
-  if(NULL != f->fm.fp) /* file already exists */
+  f->fp = fopen(f->fname, "r");
+  if(NULL != f->fp) /* file already exists */
     return FALSE;
 
-  f->fm.fp = fopen(f->fname, "w+");
-  if(NULL == f->fm.fp) /* couldn't create file */
+  f->fp = fopen(f->fname, "w+");
+  if(NULL == f->fp) /* couldn't create file */
     return FALSE;
 
-  fclose(f->fm.fp);
-  f->fm.fp = fopen(f->fname, "r");
-  if(NULL == f->fm.fp) /* couldn't open the file just created */
+  fclose(f->fp);
+  f->fp = fopen(f->fname, "r");
+  if(NULL == f->fp) /* couldn't open the file just created */
     return FALSE;
 
   return TRUE;
 }
 
 /*---------------------------
-Call this before saving when you want to save an existing file to a
-new file.
+Writes the file as edited to a new
+name in one pass, through a temp
+file renamed over it. keep_newname
+makes the new file the one being
+edited, as a save would.
   ---------------------------*/
-BOOL vf_copy_file(file_manager_t * f, const char *file_name, BOOL keep_newname)
+BOOL vf_copy_file(file_manager_t * f, const char *file_name, BOOL keep_newname,
+                  int *complete)
 {
-  FILE *out;
-  char c;
   char expanded_path[MAX_PATH_LEN+1];
+  struct stat st, dest_st;
+  vf_save_job_t *job;
+  vf_stat_t s;
+  FILE *fp;
+  off_t size;
+  BOOL failed;
 
   if (f == NULL)
     return FALSE;
@@ -425,580 +534,1565 @@ BOOL vf_copy_file(file_manager_t * f, const char *file_name, BOOL keep_newname)
   if (NULL == file_name)
     return FALSE;
 
-  if (f->fm.fp == NULL)
+  if (f->fp == NULL)
     return FALSE;
 
   if (FALSE == vf_parse_path(expanded_path, file_name))
     return FALSE;
 
-  out = fopen(expanded_path, "w+");
-  if (out == NULL)
-    return FALSE;
+  vf_save_wait(f);
+
+  *complete = 0;
 
-  fseeko(f->fm.fp, 0, SEEK_SET);
-  fread(&c, 1, 1, f->fm.fp);
-  while (!feof(f->fm.fp))
+  /* writing the file over itself is a save, renaming a copy over it
+     would leave the pieces reading a file that is no longer there */
+  if (0 == stat(expanded_path, &dest_st) && 0 == stat(f->fname, &st) &&
+      dest_st.st_dev == st.st_dev && dest_st.st_ino == st.st_ino)
   {
-    fwrite(&c, 1, 1, out);
-    fread(&c, 1, 1, f->fm.fp);
+    vf_stat(f, &s);
+    return vf_save(f, complete) == s.file_size;
   }
-  fclose(out);
+
+  if (fstat(fileno(f->fp), &st))
+    return FALSE;
+
+  job = save_prepare(f, expanded_path, &st, complete);
+  if (NULL == job)
+    return FALSE;
+
+  save_run(job);
+  failed = job->failed;
+  size = job->size;
+  save_free(job);
+
+  *complete = 100;
+
+  if (failed)
+    return FALSE;
 
   if (keep_newname) {
-    fclose(f->fm.fp);
+    /* opened first so a failure leaves f on the old file */
+    fp = fopen(expanded_path, "r");
+    if(NULL == fp) /* couldn't open the file just saved */
+      return FALSE;
+    detach_file(f);
+    fclose(f->fp);
     strcpy(f->fname, expanded_path);
-    f->fm.fp = fopen(f->fname, "r");
+    f->fp = fp;
+    f->stale = FALSE;
+    if (reload(f, size) < 0)
+      return FALSE;
   }
 
   return TRUE;
 }
 
 /*---------------------------
-
+  Move len bytes within the file,
+  working from the end the data is
+  moving towards so nothing is
+  overwritten before it is read
   ---------------------------*/
-/* This may will take forever for large files.
-   Also there is not nearly enough error
-   checking! Also the total insert changes is
-   limited to MAX_SAVE_SHIFT. Consider increasing
-   this size dynamically when needed? */
-off_t vf_save(file_manager_t * f, int *complete)
+static off_t move_data(FILE *fp, char *buf, off_t to, off_t from, off_t len)
 {
-  static char move_buf[2][MAX_SAVE_SHIFT];  /* 2 x 2 megs from heap */
-  int buf_select = 0;
-  char *tmp_buf;
-  off_t write_offset = 0;
-  off_t shift = 0;
-  vbuf_t *tmp;
-
-  if (f == NULL)
-    return 0; /* save as? */
+  off_t moved = 0, chunk, offset;
 
-  tmp = f->fm.first_child;
+  while (moved < len)
+  {
+    chunk = len - moved;
+    if (chunk > SAVE_BUF_SIZE)
+      chunk = SAVE_BUF_SIZE;
 
-  *complete = 0;
+    if (to < from)
+      offset = moved;
+    else
+      offset = len - moved - chunk;
 
-  prune(&f->ul);
+    fseeko(fp, from + offset, SEEK_SET);
+    if (fread(buf, 1, chunk, fp) != chunk)
+      break;
+    fseeko(fp, to + offset, SEEK_SET);
+    if (fwrite(buf, 1, chunk, fp) != chunk)
+      break;
 
-  if (f->fm.fp == NULL)
-    return 0;
+    moved += chunk;
+  }
 
-  fclose(f->fm.fp);
-  f->fm.fp = fopen(f->fname, "r+");
+  return moved;
+}
 
-  if (f->fm.fp == NULL) /* can't open for writing, permissions? */
+/*---------------------------
+  The file on disk is now the
+  logical file, start over from
+  it with no history. -1 when
+  there is no memory left even
+  for the one piece.
+  ---------------------------*/
+static off_t reload(file_manager_t * f, off_t size)
+{
+  journal_remove(&f->journal);
+  journal_init(&f->journal, f->fname);
+  cleanup(f);
+  f->file_size = size;
+  f->partial = FALSE;
+  if (0 != f->file_size)
   {
-    f->fm.fp = fopen(f->fname, "r");
-    return 0;
+    f->root = new_vbuf(f, TYPE_FILE, 0, f->file_size);
+    if (NULL == f->root)
+      return -1;
   }
+  attach_file(f);
+
+  return f->file_size;
+}
 
-  while(NULL != tmp)
+
+/*---------------------------
+  Copy len bytes of the original
+  file at from to the temp file
+  at to. The kernel copies them
+  itself if it can, otherwise
+  they come from the mapping or
+  through buf.
+  ---------------------------*/
+static BOOL copy_extent(vf_save_job_t * job, char *buf, off_t from, off_t to,
+                        off_t len)
+{
+  ssize_t result;
+  off_t chunk, done = 0;
+  int percent;
+#ifdef HAVE_COPY_FILE_RANGE
+  loff_t in_off, out_off;
+#endif
+
+  while (done < len)
   {
-    if(FALSE == tmp->active || 0 == tmp->size)
+    chunk = len - done;
+    if (chunk > SAVE_BUF_SIZE)
+      chunk = SAVE_BUF_SIZE;
+
+#ifdef HAVE_COPY_FILE_RANGE
+    result = -1;
+    if (job->use_range)
     {
-      tmp = tmp->next;
-      continue;
+      in_off = from + done;
+      out_off = to + done;
+      result = copy_file_range(job->in, &in_off, job->out, &out_off, chunk, 0);
+      if (result < 0 && errno != ENOSYS && errno != EXDEV &&
+          errno != EINVAL && errno != EOPNOTSUPP)
+        return FALSE;
+      if (result < 0)
+        job->use_range = FALSE;
     }
-
-    if(0 != shift)
+    if (result <= 0)
+#endif
     {
-      if(shift > 0)             /* data has been inserted */
+      if (NULL != job->map)
       {
-        tmp_buf = (char *)malloc(shift);
-        buf_select = BUF_TOGGLE(buf_select);
-        memcpy(tmp_buf, move_buf[buf_select], shift);
-        fseeko(f->fm.fp, write_offset, SEEK_SET);
-        if (tmp->start - write_offset - shift > MAX_SAVE_SHIFT)
-          fread(move_buf[buf_select], 1, MAX_SAVE_SHIFT, f->fm.fp);
-        else
-          fread(move_buf[buf_select], 1, tmp->start - write_offset - shift, f->fm.fp);
-        fseeko(f->fm.fp, write_offset, SEEK_SET);
-        fwrite(tmp_buf, 1, shift, f->fm.fp);
-        free(tmp_buf);
-        write_offset += shift;
-        buf_select = BUF_TOGGLE(buf_select);
-
-        while(tmp->start - write_offset > MAX_SAVE_SHIFT)
-        {
-          fseeko(f->fm.fp, write_offset, SEEK_SET);
-          if (tmp->start - write_offset > 2*MAX_SAVE_SHIFT)
-            fread(move_buf[buf_select], 1, MAX_SAVE_SHIFT, f->fm.fp);
-          else
-            fread(move_buf[buf_select], 1, tmp->start - write_offset - MAX_SAVE_SHIFT, f->fm.fp);
-          buf_select = BUF_TOGGLE(buf_select);
-          fseeko(f->fm.fp, write_offset, SEEK_SET);
-          fwrite(move_buf[buf_select], 1, MAX_SAVE_SHIFT, f->fm.fp);
-          write_offset += MAX_SAVE_SHIFT;
-          compute_percent_complete(write_offset, f->fm.size, complete);
-        }
-
-        buf_select = BUF_TOGGLE(buf_select);
-        fseeko(f->fm.fp, write_offset, SEEK_SET);
-        fwrite(move_buf[buf_select], 1, tmp->start - write_offset, f->fm.fp);
-        write_offset += tmp->start - write_offset;
-        compute_percent_complete(write_offset, f->fm.size, complete);
+        result = pwrite(job->out, job->map + from + done, chunk, to + done);
       }
-      else                      /* data has been deleted */
+      else
       {
-        while(tmp->start - write_offset > MAX_SAVE_SHIFT)
-        {
-          fseeko(f->fm.fp, write_offset - shift, SEEK_SET);
-          fread(move_buf[buf_select], 1, MAX_SAVE_SHIFT, f->fm.fp);
-          fseeko(f->fm.fp, write_offset, SEEK_SET);
-          fwrite(move_buf[buf_select], 1, MAX_SAVE_SHIFT, f->fm.fp);
-          write_offset += MAX_SAVE_SHIFT;
-          compute_percent_complete(write_offset, f->fm.size, complete);
-        }
-
-        fseeko(f->fm.fp, write_offset - shift, SEEK_SET);
-        fread(move_buf[buf_select], 1, tmp->start - write_offset, f->fm.fp);
-        fseeko(f->fm.fp, write_offset, SEEK_SET);
-        fwrite(move_buf[buf_select], 1, tmp->start - write_offset, f->fm.fp);
-        write_offset += tmp->start - write_offset;
-        compute_percent_complete(write_offset, f->fm.size, complete);
+        result = pread(job->in, buf, chunk, from + done);
+        if (result > 0)
+          result = pwrite(job->out, buf, result, to + done);
       }
     }
 
-    write_offset = tmp->start;
-    compute_percent_complete(write_offset, f->fm.size, complete);
-
-    switch (tmp->buf_type)
-    {
-      case TYPE_INSERT:
-        tmp_buf = (char *)malloc(tmp->size);
-        if(shift < 0)           /* data has been deleted */
-        {
-          if(tmp->size + shift > 0)
-          {
-            fseeko(f->fm.fp, write_offset - shift, SEEK_SET);
-            /* if shift > MAX_SAVE_SHIFT we have a problem =( */
-            shift = fread(move_buf[buf_select], 1, tmp->size + shift, f->fm.fp);
-          }
-          else
-          {
-            shift += tmp->size;
-          }
-        }
-        else                    /* data has been inserted */
-        {
-          fseeko(f->fm.fp, write_offset, SEEK_SET);
-        /* if shift > MAX_SAVE_SHIFT we have a problem =( */
-          shift += fread(move_buf[buf_select] + shift, 1, tmp->size, f->fm.fp);
-        }
-        buf_select = BUF_TOGGLE(buf_select);
-        vf_get_buf(f, tmp_buf, write_offset, tmp->size);
-        fseeko(f->fm.fp, write_offset, SEEK_SET);
-        fwrite(tmp_buf, 1, tmp->size, f->fm.fp);
-        free(tmp_buf);
-        write_offset += tmp->size;
-        compute_percent_complete(write_offset, f->fm.size, complete);
-        break;
-      case TYPE_REPLACE:
-        tmp_buf = (char *)malloc(tmp->size);
-        if(shift != 0)
-        {
-          if(shift - tmp->size > 0)
-          {
-            memcpy(move_buf[buf_select], move_buf[buf_select] + tmp->size,
-                   shift - tmp->size);
-            fseeko(f->fm.fp, write_offset, SEEK_SET);
-            fread(move_buf[buf_select] + shift - tmp->size, 1, tmp->size,
-                  f->fm.fp);
-          }
-          else
-          {
-            fseeko(f->fm.fp, write_offset + tmp->size - shift, SEEK_SET);
-            fread(move_buf[buf_select], 1, shift, f->fm.fp);
-          }
-          buf_select = BUF_TOGGLE(buf_select);
-        }
-        vf_get_buf(f, tmp_buf, write_offset, tmp->size);
-        fseeko(f->fm.fp, write_offset, SEEK_SET);
-        fwrite(tmp_buf, 1, tmp->size, f->fm.fp);
-        free(tmp_buf);
-        write_offset += tmp->size;
-        compute_percent_complete(write_offset, f->fm.size, complete);
-        break;
-      case TYPE_DELETE:
-        if(shift - tmp->size > 0)
-          memcpy(move_buf[buf_select], move_buf[buf_select] + tmp->size,
-                 shift - tmp->size);
-        shift -= tmp->size;     /* if shift < -MAX_SAVE_SHIFT we have a problem =( */
-        break;
-      default:
-        break;
-    }
+    if (result <= 0)
+      return FALSE;
 
-    tmp = tmp->next;
+    done += result;
+    compute_percent_complete(to + done, job->size, &percent);
+    pthread_mutex_lock(&job->lock);
+    *job->complete = percent;
+    pthread_mutex_unlock(&job->lock);
   }
 
-  if(shift > 0)                 /* data has been inserted */
+  return TRUE;
+}
+
+
+/*---------------------------
+  pwritev that keeps going after
+  a short write
+  ---------------------------*/
+static BOOL write_iov(int fd, struct iovec *iov, int count, off_t offset)
+{
+  ssize_t result;
+
+  while (count > 0)
   {
-    if (f->fm.size > write_offset)
-    {
-      tmp_buf = (char *)malloc(shift);
-      buf_select = BUF_TOGGLE(buf_select);
-      memcpy(tmp_buf, move_buf[buf_select], shift);
-      fseeko(f->fm.fp, write_offset, SEEK_SET);
-      if (f->fm.size - write_offset - shift > MAX_SAVE_SHIFT)
-        fread(move_buf[buf_select], 1, MAX_SAVE_SHIFT, f->fm.fp);
-      else
-        fread(move_buf[buf_select], 1, f->fm.size - write_offset - shift, f->fm.fp);
-      fseeko(f->fm.fp, write_offset, SEEK_SET);
-      fwrite(tmp_buf, 1, shift, f->fm.fp);
-      free(tmp_buf);
-      write_offset += shift;
-      buf_select = BUF_TOGGLE(buf_select);
-
-      /* optimize this part to read larger chunks than 'shift'? */
-      while(f->fm.size - write_offset > MAX_SAVE_SHIFT)
-      {
-        fseeko(f->fm.fp, write_offset + (MAX_SAVE_SHIFT - shift), SEEK_SET);
-        if (f->fm.size - write_offset > 2*MAX_SAVE_SHIFT)
-          fread(move_buf[buf_select], 1, MAX_SAVE_SHIFT, f->fm.fp);
-        else
-          fread(move_buf[buf_select], 1, f->fm.size - write_offset - MAX_SAVE_SHIFT, f->fm.fp);
-        buf_select = BUF_TOGGLE(buf_select);
-        fseeko(f->fm.fp, write_offset, SEEK_SET);
-        fwrite(move_buf[buf_select], 1, MAX_SAVE_SHIFT, f->fm.fp);
-        write_offset += MAX_SAVE_SHIFT;
-        compute_percent_complete(write_offset, f->fm.size, complete);
-      }
+    result = pwritev(fd, iov, count, offset);
+    if (result <= 0)
+      return FALSE;
+    offset += result;
 
-      buf_select = BUF_TOGGLE(buf_select);
-      fseeko(f->fm.fp, write_offset, SEEK_SET);
-      fwrite(move_buf[buf_select], 1, f->fm.size - write_offset, f->fm.fp);
-      write_offset += f->fm.size - write_offset;
-      compute_percent_complete(write_offset, f->fm.size, complete);
+    while (count > 0 && (size_t)result >= iov->iov_len)
+    {
+      result -= iov->iov_len;
+      iov++;
+      count--;
     }
-  }
-  else if(shift < 0)            /* data has been deleted */
-  {
-    while(f->fm.size - write_offset > MAX_SAVE_SHIFT)
+    if (count > 0)
     {
-      fseeko(f->fm.fp, write_offset - shift, SEEK_SET);
-      fread(move_buf[buf_select], 1, MAX_SAVE_SHIFT, f->fm.fp);
-      fseeko(f->fm.fp, write_offset, SEEK_SET);
-      fwrite(move_buf[buf_select], 1, MAX_SAVE_SHIFT, f->fm.fp);
-      write_offset += MAX_SAVE_SHIFT;
-      compute_percent_complete(write_offset, f->fm.size, complete);
+      iov->iov_base = (char *)iov->iov_base + result;
+      iov->iov_len -= result;
     }
-
-    fseeko(f->fm.fp, write_offset - shift, SEEK_SET);
-    fread(move_buf[buf_select], 1, f->fm.size - write_offset, f->fm.fp);
-    fseeko(f->fm.fp, write_offset, SEEK_SET);
-    fwrite(move_buf[buf_select], 1, f->fm.size - write_offset, f->fm.fp);
-    write_offset += f->fm.size - write_offset;
-    compute_percent_complete(write_offset, f->fm.size, complete);
-    ftruncate(fileno(f->fm.fp), write_offset);
   }
 
-  fclose(f->fm.fp);
-  f->fm.fp = fopen(f->fname, "r");
-
-  cleanup(f);
-
-  *complete = 100;
-  return f->fm.size;
+  return TRUE;
 }
 
+
 /*---------------------------
 
   ---------------------------*/
-BOOL vf_need_create(file_manager_t * f)
+/* Saves in place. Pieces of the original file keep their order, so
+   the ones moving towards the start can be moved first to last and
+   the ones moving towards the end last to first without either
+   trampling data still to be read. Edited pieces are written last
+   since they may land on data that had to move out of the way. */
+static off_t save_in_place(file_manager_t * f, int *complete)
 {
-  if (f == NULL)
-    return FALSE;
+  char *move_buf;
+  vbuf_t *vb;
+  vf_stat_t s;
+  off_t offset, piece_start, total = 0, done = 0;
+  BOOL failed = FALSE;
 
-  if (f->fm.fp == NULL)
-    return TRUE;
+  detach_file(f);
+  fclose(f->fp);
+  f->fp = fopen(f->fname, "r+");
 
-  return FALSE;
-}
-/*---------------------------
+  if (f->fp == NULL) /* can't open for writing, permissions? */
+  {
+    f->fp = fopen(f->fname, "r");
+    attach_file(f);
+    return 0;
+  }
 
-  ---------------------------*/
-BOOL vf_need_save(file_manager_t * f)
-{
-  vbuf_undo_list_t *tmp;
+  move_buf = (char *)malloc(SAVE_BUF_SIZE);
+  vf_stat(f, &s);
 
-  if (f == NULL)
-    return FALSE;
+  for (offset = 0; offset < s.file_size; offset = piece_start + vb->size)
+  {
+    vb = get_piece(f, offset, &piece_start);
+    if (vb->buf_type != TYPE_FILE || vb->start != piece_start)
+      total += vb->size;
+  }
 
-  tmp = f->ul.last;
+  /* data moving towards the start of the file */
+  for (offset = 0; offset < s.file_size && !failed; offset = piece_start + vb->size)
+  {
+    vb = get_piece(f, offset, &piece_start);
+    if (vb->buf_type == TYPE_FILE && vb->start > piece_start)
+    {
+      if (move_data(f->fp, move_buf, piece_start, vb->start, vb->size) != vb->size)
+        failed = TRUE;
+      done += vb->size;
+      compute_percent_complete(done, total, complete);
+    }
+  }
 
-  while(NULL != tmp)
+  /* data moving towards the end of the file */
+  for (offset = s.file_size; offset > 0 && !failed; offset = piece_start)
   {
-    if(FALSE == tmp->saved && TRUE == tmp->applied)
-      return TRUE;
-    tmp = tmp->last;
+    vb = get_piece(f, offset - 1, &piece_start);
+    if (vb->buf_type == TYPE_FILE && vb->start < piece_start)
+    {
+      if (move_data(f->fp, move_buf, piece_start, vb->start, vb->size) != vb->size)
+        failed = TRUE;
+      done += vb->size;
+      compute_percent_complete(done, total, complete);
+    }
   }
 
-  return FALSE;
-}
+  /* the edits */
+  for (offset = 0; offset < s.file_size && !failed; offset = piece_start + vb->size)
+  {
+    vb = get_piece(f, offset, &piece_start);
+    if (vb->buf_type != TYPE_FILE)
+    {
+      fseeko(f->fp, piece_start, SEEK_SET);
+      if (fwrite(f->add.data + vb->start, 1, vb->size, f->fp) != vb->size)
+        failed = TRUE;
+      done += vb->size;
+      compute_percent_complete(done, total, complete);
+    }
+  }
 
+  fflush(f->fp);
+  if (!failed && s.file_size < f->file_size)
+    ftruncate(fileno(f->fp), s.file_size);
 
-/*---------------------------
+  free(move_buf);
 
-  ---------------------------*/
-/* returns number of changes undone */
-/* undo_addr is set to the start address of the last change undone */
-int vf_undo(file_manager_t * f, int count, off_t * undo_addr)
-{
-  vbuf_undo_list_t *tmp_undo_list = f->ul.last;
-  vbuf_list_t *tmp_list = NULL;
-  vbuf_t *tmp = NULL;
-  int undo_count;
+  fclose(f->fp);
+  f->fp = fopen(f->fname, "r");
 
-  if (f == NULL)
-    return 0;
+  *complete = 100;
 
-  /* look for the first change still applied */
-  while(NULL != tmp_undo_list)
+  if (failed)
   {
-    if(TRUE == tmp_undo_list->applied)
-      break;
-    tmp_undo_list = tmp_undo_list->last;
+    attach_file(f);
+    return 0;
   }
 
-  /* now start to undo */
-  for(undo_count = 0; undo_count < count; undo_count++)
-  {
-    if(NULL == tmp_undo_list)
-      return undo_count;
-
-    tmp_list = tmp_undo_list->vb_list;
+  return reload(f, s.file_size);
+}
 
-    while(NULL != tmp_list)
-    {
-      tmp = tmp_list->vb;
+/*---------------------------
+  Write every edited piece at
+  its logical offset. Adjacent
+  edits go out together through
+  pwritev. total is the bytes
+  of edits.
+  ---------------------------*/
+static BOOL write_edits(file_manager_t * f, int fd, off_t total, int *complete)
+{
+  struct iovec iov[SAVE_IOV];
+  vbuf_t *vb;
+  vf_stat_t s;
+  off_t offset, piece_start, iov_start = 0, iov_end = 0, done = 0;
+  int count = 0;
 
-      switch (tmp->buf_type)
-      {
-        case TYPE_INSERT:
-          mod_parent_size(tmp->parent, tmp->size, FALSE);
-          mod_start_offset(tmp->next, tmp->size, FALSE);
-          break;
-        case TYPE_DELETE:
-          mod_parent_size(tmp->parent, tmp->size, TRUE);
-          mod_start_offset(tmp->next, tmp->size, TRUE);
-          break;
-        case TYPE_REPLACE:     /* no break */
-        default:
-          break;
-      }
+  vf_stat(f, &s);
 
-      tmp->active = FALSE;
-      if(NULL != undo_addr)
-        *undo_addr = tmp->start;
+  for (offset = 0; offset < s.file_size; offset = piece_start + vb->size)
+  {
+    vb = get_piece(f, offset, &piece_start);
+    if (vb->buf_type == TYPE_FILE)
+      continue;
 
-      tmp_list = tmp_list->next;
+    /* a gap or a full vector ends the run */
+    if (count != 0 && (count == SAVE_IOV || piece_start != iov_end))
+    {
+      if (FALSE == write_iov(fd, iov, count, iov_start))
+        return FALSE;
+      done += iov_end - iov_start;
+      compute_percent_complete(done, total, complete);
+      count = 0;
     }
 
-    tmp_undo_list->applied = FALSE;
-
-    tmp_undo_list = tmp_undo_list->last;
+    if (0 == count)
+      iov_start = piece_start;
+    iov[count].iov_base = f->add.data + vb->start;
+    iov[count].iov_len = vb->size;
+    count++;
+    iov_end = piece_start + vb->size;
   }
 
-  return undo_count;
+  if (count != 0)
+    return write_iov(fd, iov, count, iov_start);
+
+  return TRUE;
 }
 
 
 /*---------------------------
 
   ---------------------------*/
-/* returns number of changes redone */
-/* redo_addr is set to the start address of the last change redone */
-int vf_redo(file_manager_t * f, int count, off_t * redo_addr)
+/* Starts writing the logical file to a temp file next to dest, which
+   it will replace. The edits are written now, from the add buffer as
+   it is, and the extents of the original that remain are listed for
+   save_run, which needs nothing else from f. Returns NULL if no temp
+   file could be made there. */
+static vf_save_job_t *save_prepare(file_manager_t * f, const char *dest,
+                                   struct stat *st, int *complete)
 {
-  vbuf_undo_list_t *tmp_undo_list = f->ul.last;
-  vbuf_list_t *tmp_list = NULL;
-  vbuf_t *tmp = NULL;
-  int redo_count;
+  vf_save_job_t *job;
+  vbuf_t *vb;
+  vf_stat_t s;
+  off_t offset, piece_start, edits = 0;
+  int dummy;
+
+  job = (vf_save_job_t *)calloc(1, sizeof(vf_save_job_t));
+  if (NULL == job)
+    return NULL;
 
-  if (f == NULL)
-    return 0;
+  /* write through symlinks rather than replace them */
+  if (NULL == realpath(dest, job->path))
+    snprintf(job->path, sizeof(job->path), "%s", dest);
+  snprintf(job->tmp_name, sizeof(job->tmp_name), "%s.XXXXXX", job->path);
 
-  if(NULL == tmp_undo_list)
-    return 0;
+  job->out = mkstemp(job->tmp_name);
+  if (job->out < 0)
+  {
+    free(job);
+    return NULL;
+  }
 
-  /* no changes have been undone */
-  if(TRUE == tmp_undo_list->applied)
-    return 0;
+  pthread_mutex_init(&job->lock, NULL);
+  job->in = fileno(f->fp);
+  job->map = f->map;
+  job->use_range = TRUE;
+  job->mode = st->st_mode;
+  job->uid = st->st_uid;
+  job->gid = st->st_gid;
+  job->complete = (NULL == complete) ? &job->percent : complete;
 
-  /* look for the last change undone */
-  while(NULL != tmp_undo_list)
+  vf_stat(f, &s);
+  job->size = s.file_size;
+
+  for (offset = 0; offset < s.file_size; offset = piece_start + vb->size)
   {
-    if(NULL == tmp_undo_list->last)
-      break;
-    if(tmp_undo_list->last->applied)
-      break;
-    tmp_undo_list = tmp_undo_list->last;
+    vb = get_piece(f, offset, &piece_start);
+    if (vb->buf_type == TYPE_FILE)
+      job->count++;
+    else
+      edits += vb->size;
   }
 
-  /* now start to redo */
-  for(redo_count = 0; redo_count < count; redo_count++)
+  if (0 != job->count)
+    job->extents = (save_extent_t *)malloc(job->count * sizeof(save_extent_t));
+  if (0 != job->count && NULL == job->extents)
+    job->failed = TRUE;
+
+  job->count = 0;
+  for (offset = 0; offset < s.file_size && !job->failed; offset = piece_start + vb->size)
   {
-    if(NULL == tmp_undo_list)
-      return redo_count;
+    vb = get_piece(f, offset, &piece_start);
+    if (vb->buf_type != TYPE_FILE)
+      continue;
+    job->extents[job->count].from = vb->start;
+    job->extents[job->count].to = piece_start;
+    job->extents[job->count].len = vb->size;
+    job->count++;
+  }
 
-    tmp_list = tmp_undo_list->vb_list;
+  if (!job->failed && FALSE == write_edits(f, job->out, edits, &dummy))
+    job->failed = TRUE;
 
-    while(NULL != tmp_list)
-    {
-      tmp = tmp_list->vb;
+  return job;
+}
 
-      switch (tmp->buf_type)
-      {
-        case TYPE_INSERT:
-          mod_parent_size(tmp->parent, tmp->size, TRUE);
-          mod_start_offset(tmp->next, tmp->size, TRUE);
-          break;
-        case TYPE_DELETE:
-          mod_parent_size(tmp->parent, tmp->size, FALSE);
-          mod_start_offset(tmp->next, tmp->size, FALSE);
-          break;
-        case TYPE_REPLACE:     /* no break */
-        default:
-          break;
-      }
 
-      tmp->active = TRUE;
-      if(NULL != redo_addr)
-        *redo_addr = tmp->start;
+/*---------------------------
 
-      tmp_list = tmp_list->next;
-    }
+  ---------------------------*/
+/* Copies the extents, makes the temp file durable and renames it over
+   the original, so a crash leaves one or the other intact. Safe to run
+   on its own thread while the file is edited. */
+static void *save_run(void *data)
+{
+  vf_save_job_t *job = data;
+  char dir_name[PATH_MAX], *move_buf = NULL;
+  long i;
+  int dir;
 
-    tmp_undo_list->applied = TRUE;
+  if (NULL == job->map)
+    move_buf = (char *)malloc(SAVE_BUF_SIZE);
 
-    tmp_undo_list = f->ul.last;
+  for (i = 0; i < job->count && !job->failed; i++)
+  {
+    if (FALSE == copy_extent(job, move_buf, job->extents[i].from,
+                             job->extents[i].to, job->extents[i].len))
+      job->failed = TRUE;
+  }
 
-    /* no changes have been undone */
-    if(TRUE == tmp_undo_list->applied)
-      return redo_count + 1;
+  free(move_buf);
+
+  if (!job->failed)
+  {
+    if (fsync(job->out))
+      job->failed = TRUE;
+    fchmod(job->out, job->mode & 07777);
+    /* not allowed to give it away is not worth failing over */
+    if (fchown(job->out, job->uid, job->gid))
+      errno = 0;
+  }
 
-    /* look for the last change undone */
-    while(NULL != tmp_undo_list)
+  if (close(job->out) || job->failed || rename(job->tmp_name, job->path))
+  {
+    unlink(job->tmp_name);
+    job->failed = TRUE;
+  }
+  else
+  {
+    /* make the rename itself durable */
+    snprintf(dir_name, sizeof(dir_name), "%s", job->path);
+    dir = open(dirname(dir_name), O_RDONLY);
+    if (dir >= 0)
     {
-      if(NULL == tmp_undo_list->last)
-        break;
-      if(tmp_undo_list->last->applied)
-        break;
-      tmp_undo_list = tmp_undo_list->last;
+      fsync(dir);
+      close(dir);
     }
   }
 
-  return redo_count;
+  pthread_mutex_lock(&job->lock);
+  job->finished = TRUE;
+  pthread_mutex_unlock(&job->lock);
+
+  return NULL;
 }
 
 
 /*---------------------------
 
   ---------------------------*/
-size_t vf_insert_before(file_manager_t * f, char *buf, off_t offset, size_t len)
+static void save_free(vf_save_job_t * job)
 {
-  if (f == NULL)
-    return 0;
-  prune(&f->ul);
-  return _insert_before(&f->fm, buf, offset, len, &f->ul.last);
+  pthread_mutex_destroy(&job->lock);
+  free(job->extents);
+  free(job);
 }
 
 
 /*---------------------------
 
   ---------------------------*/
-size_t vf_insert_after(file_manager_t * f, char *buf, off_t offset, size_t len)
+/* Once the temp file has replaced the original, nothing edited since
+   the save began means the file can start over from disk. Otherwise
+   the pieces still read the replaced file through fp, which stays
+   open, and the history marks where the disk now is. The next save
+   must then be a full rewrite, since fp is no longer what is on disk. */
+static off_t save_finish(file_manager_t * f, vf_save_job_t * job)
 {
-  if (f == NULL)
-    return 0;
-  prune(&f->ul);
-  return _insert_before(&f->fm, buf, offset + 1, len, &f->ul.last);
-}
+  vbuf_undo_list_t *saving = f->hist.saving;
+  BOOL saving_lost = f->hist.saving_lost;
+  BOOL saving_crossed = f->hist.saving_crossed;
+  off_t size = job->size;
+  BOOL failed = job->failed;
+  int fd;
 
+  *job->complete = 100;
+  save_free(job);
 
-/*---------------------------
-
-  ---------------------------*/
-size_t vf_replace(file_manager_t * f, char *buf, off_t offset, size_t len)
-{
-  size_t rep_size = 0;
-  vbuf_list_t *vb_list = NULL;
-  vbuf_undo_list_t *new_list;
+  f->hist.saving = NULL;
+  f->hist.saving_lost = FALSE;
+  f->hist.saving_crossed = FALSE;
 
-  if (f == NULL)
+  if (failed)
     return 0;
 
-  prune(&f->ul);
+  if (f->hist.current != saving || saving_lost)
+  {
+    f->hist.saved = saving;
+    f->hist.saved_lost = saving_lost;
+    f->stale = TRUE;
+
+    /* the edits since the save began now apply to the new file,
+       unless an undo went back past what it saved.  The records
+       would then undo changes the new file does not have, so there
+       is no journal until a save brings the file up to date. */
+    if (saving_lost || saving_crossed)
+    {
+      journal_remove(&f->journal);
+      f->journal.failed = 1;
+      return size;
+    }
 
-  rep_size = _replace(&f->fm, buf, offset, len, &vb_list);
+    fd = open(f->fname, O_RDONLY);
+    journal_rebase(&f->journal, fd);
+    if (fd >= 0)
+      close(fd);
 
-  if(NULL != vb_list)
-  {
-    new_list = (vbuf_undo_list_t *) malloc(sizeof(vbuf_undo_list_t));
-    new_list->applied = TRUE;
-    new_list->saved = FALSE;
-    new_list->last = f->ul.last;
-    f->ul.last = new_list;
-    new_list->vb_list = vb_list;
+    return size;
   }
 
-  return rep_size;
+  detach_file(f);
+  fclose(f->fp);
+  f->fp = fopen(f->fname, "r");
+  f->stale = FALSE;
+
+  return reload(f, size);
 }
 
 
 /*---------------------------
 
   ---------------------------*/
-size_t vf_delete(file_manager_t * f, off_t offset, size_t len)
+/* The whole rewrite on the calling thread. Returns -1 if no temp file
+   could be made next to the original. */
+static off_t save_to_temp(file_manager_t * f, struct stat *st, int *complete)
 {
-  size_t del_size = 0;
-  vbuf_list_t *vb_list = NULL;
-  vbuf_undo_list_t *new_list;
+  vf_save_job_t *job;
 
-  if (f == NULL)
-    return 0;
+  job = save_prepare(f, f->fname, st, complete);
+  if (NULL == job)
+    return -1;
 
-  prune(&f->ul);
+  f->hist.saving = f->hist.current;
+  f->hist.saving_lost = FALSE;
+  f->hist.saving_crossed = FALSE;
 
-  del_size = _delete(&f->fm, offset, len, &vb_list);
-
-  if(NULL != vb_list)
-  {
-    new_list = (vbuf_undo_list_t *) malloc(sizeof(vbuf_undo_list_t));
-    new_list->applied = TRUE;
-    new_list->saved = FALSE;
-    new_list->last = f->ul.last;
-    f->ul.last = new_list;
-    new_list->vb_list = vb_list;
-  }
+  save_run(job);
 
-  return del_size;
+  return save_finish(f, job);
 }
 
 
 /*---------------------------
 
   ---------------------------*/
-char vf_get_char(file_manager_t * f, char *result, off_t offset)
+/* When every piece of the original file is still at its own offset the
+   edits only overwrote bytes, so patching just those extents in place
+   is a save. Returns -1 if the file can't be written. */
+static off_t save_dirty_extents(file_manager_t * f, off_t total, int *complete)
 {
-  if (f == NULL)
-  {
-    *result = 0;
-    return 0;
-  }
+  vf_stat_t s;
+  int fd;
+  BOOL failed = FALSE;
 
-  return _get_char(&f->fm, result, offset);
-}
+  vf_stat(f, &s);
 
+  fd = open(f->fname, O_WRONLY);
+  if (fd < 0)
+    return -1;
 
-/*---------------------------
+  if (FALSE == write_edits(f, fd, total, complete))
+    failed = TRUE;
+
+  if (!failed && fdatasync(fd))
+    failed = TRUE;
+  if (close(fd))
+    failed = TRUE;
+
+  *complete = 100;
+
+  if (failed)
+    return 0;
+
+  detach_file(f);
+  return reload(f, s.file_size);
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+/* Pieces of the original keep their order, so walking them first to
+   last, each one only has to move by the difference between where it
+   is on disk now and where it belongs. The bytes on disk between it
+   and the piece before are ones it replaced or deleted, so a hole can
+   be opened or a range collapsed anywhere among them, and the edits
+   written over what is left. That only works if every move is whole
+   blocks and a block boundary falls in the gap. With fd < 0 the moves
+   are only checked, otherwise they are made. done counts them. */
+static BOOL shift_ranges(file_manager_t * f, int fd, off_t blk, long *done)
+{
+  vbuf_t *vb;
+  vf_stat_t s;
+  off_t offset, piece_start, gap_start = 0, delta = 0, at, shift, hole;
+
+  *done = 0;
+  vf_stat(f, &s);
+
+  for (offset = 0; offset < s.file_size; offset = piece_start + vb->size)
+  {
+    vb = get_piece(f, offset, &piece_start);
+    if (vb->buf_type != TYPE_FILE)
+      continue;
+
+    at = vb->start + delta;
+    shift = piece_start - at;
+    hole = (gap_start + blk - 1) / blk * blk;
+
+    if (0 != shift)
+    {
+      if (0 != shift % blk)
+        return FALSE;
+      if ((shift > 0 && hole > at) || (shift < 0 && hole - shift > at))
+        return FALSE;
+    }
+
+#ifdef HAVE_RANGE_SHIFT
+    if (fd >= 0 && shift > 0 &&
+        fallocate(fd, FALLOC_FL_INSERT_RANGE, hole, shift))
+      return FALSE;
+    if (fd >= 0 && shift < 0 &&
+        fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, hole, -shift))
+      return FALSE;
+#endif
+    if (0 != shift)
+      (*done)++;
+
+    delta += shift;
+    gap_start = piece_start + vb->size;
+  }
+
+  return TRUE;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+/* A save failed after shift_ranges made done of its moves, so the
+   file on disk is neither the original nor the edited one. Each piece
+   up to where it stopped is now at its logical offset and each one
+   after has moved by as much as the moves made. Point the pieces at
+   where they are, so the file reads as edited again and can be saved
+   some other way. The history still points at where the original was
+   and the journal at what it was, so both go. */
+static void settle_pieces(file_manager_t * f, long done)
+{
+  struct stat st;
+  vbuf_t *vb;
+  vf_stat_t s;
+  off_t offset, piece_start, delta = 0, at;
+
+  detach_file(f);
+  fold_history(f);
+  f->hist.saved_lost = TRUE;
+
+  vf_stat(f, &s);
+
+  for (offset = 0; offset < s.file_size; offset = piece_start + vb->size)
+  {
+    vb = get_piece(f, offset, &piece_start);
+    if (vb->buf_type != TYPE_FILE)
+      continue;
+
+    at = vb->start + delta;
+    if (at != piece_start && done > 0)
+    {
+      done--;
+      delta += piece_start - at;
+      at = piece_start;
+    }
+    vb->start = at;
+  }
+
+  if (0 == fstat(fileno(f->fp), &st))
+    f->file_size = st.st_size;
+
+  journal_remove(&f->journal);
+  f->journal.failed = 1;
+  f->partial = TRUE;
+
+  attach_file(f);
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+/* Block aligned inserts and deletes are made by the filesystem
+   opening or collapsing ranges of the file, which only touches its
+   extent map, then the edits are written as for a patch. The cost
+   does not depend on how much data sits after the edits. Returns -1
+   if the filesystem can't do it or fails part way, in which case the
+   pieces are settled on what is on disk for another plan to save. */
+static off_t save_ranges(file_manager_t * f, struct stat *st, off_t total,
+                         int *complete)
+{
+  vf_stat_t s;
+  long done;
+  int fd;
+  BOOL shifted, failed = FALSE;
+
+  vf_stat(f, &s);
+
+  fd = open(f->fname, O_RDWR);
+  if (fd < 0)
+    return -1;
+
+  shifted = shift_ranges(f, fd, st->st_blksize, &done);
+  if (FALSE == shifted)
+    failed = TRUE;
+
+  if (!failed && FALSE == write_edits(f, fd, total, complete))
+    failed = TRUE;
+
+  if (!failed && ftruncate(fd, s.file_size))
+    failed = TRUE;
+  if (!failed && fdatasync(fd))
+    failed = TRUE;
+  if (close(fd))
+    failed = TRUE;
+
+  if (failed)
+  {
+    /* untouched only if the first move was the one that failed */
+    if (shifted || 0 != done)
+      settle_pieces(f, done);
+    return -1;
+  }
+
+  *complete = 100;
+
+  detach_file(f);
+  return reload(f, s.file_size);
+}
+
+
+/*---------------------------
+  Only a regular file with one
+  name can be swapped for a new
+  one by rename
+  ---------------------------*/
+static BOOL can_rewrite(file_manager_t * f, struct stat *st)
+{
+  if (f->fp == NULL)
+    return FALSE;
+
+  /* fp may be the file a save has already replaced */
+  if (f->stale ? stat(f->fname, st) : fstat(fileno(f->fp), st))
+    return FALSE;
+
+  return S_ISREG(st->st_mode) && 1 == st->st_nlink;
+}
+
+
+/*---------------------------
+  Decide how to save from the
+  pieces alone, nothing is read
+  ---------------------------*/
+void vf_plan_save(file_manager_t * f, vf_save_plan_t * p)
+{
+  struct stat st;
+  vbuf_t *vb;
+  vf_stat_t s;
+  off_t offset, piece_start, rewrite_io;
+#ifdef HAVE_RANGE_SHIFT
+  long ops;
+#endif
+
+  p->plan = SAVE_REWRITE;
+  p->fallback = SAVE_REWRITE;
+  p->edit_bytes = 0;
+  p->move_bytes = 0;
+  p->io_bytes = 0;
 
-  ---------------------------*/
-size_t vf_get_buf(file_manager_t * f, char *dest, off_t offset, size_t len)
-{
   if (f == NULL)
+    return;
+
+  vf_stat(f, &s);
+
+  for (offset = 0; offset < s.file_size; offset = piece_start + vb->size)
+  {
+    vb = get_piece(f, offset, &piece_start);
+    if (vb->buf_type != TYPE_FILE)
+      p->edit_bytes += vb->size;
+    else if (vb->start != piece_start)
+      p->move_bytes += vb->size;
+  }
+
+  if (s.file_size == s.disk_size && 0 == p->move_bytes && !f->stale)
+  {
+    p->plan = SAVE_EXTENTS;
+    p->fallback = SAVE_EXTENTS;
+    p->io_bytes = p->edit_bytes;
+    return;
+  }
+
+  /* Moving data in place is not crash safe, so it has to save a lot
+     of I/O over the rewrite to be worth it. */
+  p->io_bytes = 2 * p->move_bytes + p->edit_bytes;
+  rewrite_io = 2 * (s.file_size - p->edit_bytes) + p->edit_bytes;
+
+  if (can_rewrite(f, &st) &&
+      (f->stale || p->io_bytes * SAVE_SHIFT_RATIO >= rewrite_io))
+  {
+    p->plan = SAVE_REWRITE;
+    p->io_bytes = rewrite_io;
+  }
+  else
+  {
+    p->plan = SAVE_IN_PLACE;
+  }
+  p->fallback = p->plan;
+
+#ifdef HAVE_RANGE_SHIFT
+  /* Shifting ranges is no more crash safe than moving the data, so it
+     too has to beat the rewrite. Whether the filesystem can do it is
+     only known by trying. */
+  if (NULL != f->fp && !f->stale && 0 == fstat(fileno(f->fp), &st) &&
+      S_ISREG(st.st_mode) &&
+      (SAVE_IN_PLACE == p->plan ||
+       p->edit_bytes * SAVE_SHIFT_RATIO < rewrite_io) &&
+      TRUE == shift_ranges(f, -1, st.st_blksize, &ops) && ops > 0)
+  {
+    p->plan = SAVE_RANGES;
+    p->io_bytes = p->edit_bytes;
+  }
+#endif
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+const char *vf_plan_name(save_plan_e plan)
+{
+  switch (plan)
+  {
+    case SAVE_EXTENTS:
+      return "patch edited bytes";
+    case SAVE_IN_PLACE:
+      return "shift in place";
+    case SAVE_REWRITE:
+      return "rewrite to temp file";
+    case SAVE_RANGES:
+      return "shift block ranges";
+    default:
+      return "unknown";
+  }
+}
+
+
+/*---------------------------
+  Carry out the plan. If the
+  file can't be patched or no
+  temp file can be made next to
+  it, fall back to saving in
+  place, unless a background
+  save has left fp behind.
+  ---------------------------*/
+off_t vf_save(file_manager_t * f, int *complete)
+{
+  struct stat st;
+  vf_save_plan_t p;
+  off_t size;
+
+  if (f == NULL)
+    return 0; /* save as? */
+
+  *complete = 0;
+
+  vf_save_wait(f);
+  prune(f);
+
+  if (f->fp == NULL)
+    return 0;
+
+  vf_plan_save(f, &p);
+
+  if (SAVE_EXTENTS == p.plan)
+  {
+    size = save_dirty_extents(f, p.edit_bytes, complete);
+    if (size >= 0)
+      return size;
+  }
+
+  if (SAVE_RANGES == p.plan && 0 == fstat(fileno(f->fp), &st))
+  {
+    size = save_ranges(f, &st, p.edit_bytes, complete);
+    if (size >= 0)
+      return size;
+  }
+
+  if (SAVE_IN_PLACE != p.fallback && can_rewrite(f, &st))
+  {
+    size = save_to_temp(f, &st, complete);
+    if (size >= 0)
+      return size;
+  }
+
+  if (f->stale)
+  {
+    *complete = 100;
     return 0;
+  }
+
+  return save_in_place(f, complete);
+}
+
+
+/*---------------------------
+  Save on a thread of its own
+  when the plan is a rewrite,
+  FALSE if it is not or can't
+  be started. Edits made while
+  it runs layer on top of what
+  is being saved.
+  ---------------------------*/
+BOOL vf_save_start(file_manager_t * f)
+{
+  struct stat st;
+  vf_save_plan_t p;
+  vf_save_job_t *job;
+
+  if (f == NULL || f->fp == NULL || NULL != f->job)
+    return FALSE;
+
+  vf_plan_save(f, &p);
+  if (SAVE_REWRITE != p.plan || FALSE == can_rewrite(f, &st))
+    return FALSE;
+
+  job = save_prepare(f, f->fname, &st, NULL);
+  if (NULL == job)
+    return FALSE;
+
+  /* the change being saved must not grow */
+  vf_close_change(f);
+  journal_mark(&f->journal);
+  f->hist.saving = f->hist.current;
+  f->hist.saving_lost = FALSE;
+  f->hist.saving_crossed = FALSE;
+  f->job = job;
+
+  if (0 == pthread_create(&job->thread, NULL, save_run, job))
+    job->threaded = TRUE;
+  else
+    save_run(job);
+
+  return TRUE;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+BOOL vf_save_pending(file_manager_t * f)
+{
+  if (f == NULL)
+    return FALSE;
+
+  return NULL != f->job;
+}
+
+
+/*---------------------------
+  The last save failed with the
+  file on disk part written, the
+  edits are still here to save
+  again
+  ---------------------------*/
+BOOL vf_save_partial(file_manager_t * f)
+{
+  if (f == NULL)
+    return FALSE;
+
+  return f->partial;
+}
+
+
+/*---------------------------
+  Percent done of the save in
+  the background, -1 if none
+  ---------------------------*/
+int vf_save_progress(file_manager_t * f)
+{
+  int percent;
+
+  if (f == NULL || NULL == f->job)
+    return -1;
+
+  pthread_mutex_lock(&f->job->lock);
+  percent = *f->job->complete;
+  pthread_mutex_unlock(&f->job->lock);
+
+  return percent;
+}
+
+
+/*---------------------------
+  If the save in the background
+  has finished, wrap it up and
+  return TRUE with what it
+  saved in size (0 on failure)
+  ---------------------------*/
+BOOL vf_save_poll(file_manager_t * f, off_t * size)
+{
+  vf_save_job_t *job;
+  BOOL finished;
+
+  if (f == NULL || NULL == f->job)
+    return FALSE;
+
+  job = f->job;
+  pthread_mutex_lock(&job->lock);
+  finished = job->finished;
+  pthread_mutex_unlock(&job->lock);
+
+  if (FALSE == finished)
+    return FALSE;
+
+  *size = vf_save_wait(f);
+  return TRUE;
+}
+
+
+/*---------------------------
+  Block until the save in the
+  background is done, returns
+  what it saved or -1 if there
+  was none
+  ---------------------------*/
+off_t vf_save_wait(file_manager_t * f)
+{
+  vf_save_job_t *job;
+
+  if (f == NULL || NULL == f->job)
+    return -1;
+
+  job = f->job;
+  if (job->threaded)
+    pthread_join(job->thread, NULL);
+  f->job = NULL;
+
+  return save_finish(f, job);
+}
+
+
+/*---------------------------
+  Journal an edit that was made
+  to the file
+  ---------------------------*/
+static void note(file_manager_t * f, journal_op_e op, off_t offset,
+                 const char *buf, off_t len)
+{
+  if (NULL == f->fp)
+    return;
+
+  journal_record(&f->journal, fileno(f->fp), op, offset, buf, len);
+}
+
+
+/*---------------------------
+  An earlier session left a
+  journal of edits to this
+  very file
+  ---------------------------*/
+BOOL vf_journal_found(file_manager_t * f)
+{
+  if (f == NULL)
+    return FALSE;
+
+  return f->recoverable;
+}
+
+
+/*---------------------------
+  Make the journaled edits
+  again, returns how many
+  records were replayed or -1.
+  Further edits are added to
+  the same journal.
+  ---------------------------*/
+long vf_journal_recover(file_manager_t * f)
+{
+  journal_rec_t rec;
+  char *payload;
+  long count = 0;
+
+  if (f == NULL || FALSE == f->recoverable)
+    return -1;
+
+  f->recoverable = FALSE;
+  if (FALSE == journal_replay_start(&f->journal))
+    return -1;
+
+  while (journal_read(&f->journal, &rec, &payload))
+  {
+    switch (rec.op)
+    {
+      case JOURNAL_INSERT:
+        vf_insert_before(f, payload, rec.offset, rec.len);
+        break;
+      case JOURNAL_REPLACE:
+        vf_replace(f, payload, rec.offset, rec.len);
+        break;
+      case JOURNAL_DELETE:
+        vf_delete(f, rec.offset, rec.len);
+        break;
+      case JOURNAL_UNDO:
+        vf_undo(f, rec.len, NULL);
+        break;
+      case JOURNAL_REDO:
+        vf_redo(f, rec.len, NULL);
+        break;
+      case JOURNAL_CLOSE:
+        vf_close_change(f);
+        break;
+    }
+    count++;
+  }
+
+  journal_replay_end(&f->journal);
 
-  return _get_buf(&f->fm, dest, offset, len);
+  return count;
 }
 
+
+/*---------------------------
+
+  ---------------------------*/
+void vf_journal_discard(file_manager_t * f)
+{
+  if (f == NULL || FALSE == f->recoverable)
+    return;
+
+  f->recoverable = FALSE;
+  journal_discard(&f->journal);
+}
+
+
+/*---------------------------
+  Called now and then, returns
+  TRUE while edits are waiting
+  to be made durable
+  ---------------------------*/
+BOOL vf_journal_sync(file_manager_t * f)
+{
+  if (f == NULL)
+    return FALSE;
+
+  return journal_sync(&f->journal, FALSE);
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+BOOL vf_need_create(file_manager_t * f)
+{
+  if (f == NULL)
+    return FALSE;
+
+  if (f->fp == NULL)
+    return TRUE;
+
+  return FALSE;
+}
+/*---------------------------
+  Dirty unless history is back
+  where it was at the last save
+  ---------------------------*/
+BOOL vf_need_save(file_manager_t * f)
+{
+  if (f == NULL)
+    return FALSE;
+
+  return f->hist.saved_lost || f->hist.current != f->hist.saved;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+/* returns number of changes undone */
+/* undo_addr is set to the start address of the last change undone */
+int vf_undo(file_manager_t * f, int count, off_t * undo_addr)
+{
+  vbuf_undo_list_t *change;
+  int undo_count;
+
+  if (f == NULL)
+    return 0;
+
+  for(undo_count = 0; undo_count < count; undo_count++)
+  {
+    change = f->hist.current;
+    if(NULL == change)
+      break;
+
+    if(FALSE == revert_change(f, change))
+      break;
+    if(NULL != f->job && change == f->hist.saving)
+      f->hist.saving_crossed = TRUE;
+    if(NULL != f->edit_hook)
+      f->edit_hook(f, change->offset, change->new_size, change->old_size);
+    if(NULL != undo_addr)
+      *undo_addr = change->offset;
+
+    f->hist.current = change->last;
+  }
+
+  if (0 != undo_count)
+    note(f, JOURNAL_UNDO, 0, NULL, undo_count);
+
+  return undo_count;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+/* returns number of changes redone */
+/* redo_addr is set to the start address of the last change redone */
+int vf_redo(file_manager_t * f, int count, off_t * redo_addr)
+{
+  vbuf_undo_list_t *change;
+  int redo_count;
+
+  if (f == NULL)
+    return 0;
+
+  for(redo_count = 0; redo_count < count; redo_count++)
+  {
+    if(NULL == f->hist.current)
+      change = f->hist.oldest;
+    else
+      change = f->hist.current->next;
+    if(NULL == change)
+      break;
+
+    if(FALSE == apply_change(f, change))
+      break;
+    change->open = FALSE;
+    if(NULL != f->edit_hook)
+      f->edit_hook(f, change->offset, change->old_size, change->new_size);
+    if(NULL != redo_addr)
+      *redo_addr = change->offset;
+
+    f->hist.current = change;
+  }
+
+  if (0 != redo_count)
+    note(f, JOURNAL_REDO, 0, NULL, redo_count);
+
+  return redo_count;
+}
+
+
+/*---------------------------
+  Edits after this are a new
+  undo step even if they run on
+  from the last one
+  ---------------------------*/
+void vf_close_change(file_manager_t * f)
+{
+  if (f == NULL || NULL == f->hist.current || FALSE == f->hist.current->open)
+    return;
+
+  f->hist.current->open = FALSE;
+  note(f, JOURNAL_CLOSE, 0, NULL, 0);
+}
+
+
+/*---------------------------
+  Have hook told of every change
+  to f from now until it is closed
+  or the hook is set again
+  ---------------------------*/
+void vf_set_edit_hook(file_manager_t * f, vf_edit_hook_t hook)
+{
+  if (f == NULL)
+    return;
+
+  f->edit_hook = hook;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+size_t vf_insert_before(file_manager_t * f, char *buf, off_t offset, size_t len)
+{
+  size_t result;
+
+  if (f == NULL)
+    return 0;
+  prune(f);
+  result = _insert_before(f, buf, offset, len);
+  if (0 != result)
+    note(f, JOURNAL_INSERT, offset, buf, len);
+  if (0 != result && NULL != f->edit_hook)
+    f->edit_hook(f, offset, 0, result);
+  return result;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+size_t vf_insert_after(file_manager_t * f, char *buf, off_t offset, size_t len)
+{
+  size_t result;
+
+  if (f == NULL)
+    return 0;
+  prune(f);
+  result = _insert_before(f, buf, offset + 1, len);
+  if (0 != result)
+    note(f, JOURNAL_INSERT, offset + 1, buf, len);
+  if (0 != result && NULL != f->edit_hook)
+    f->edit_hook(f, offset + 1, 0, result);
+  return result;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+size_t vf_replace(file_manager_t * f, char *buf, off_t offset, size_t len)
+{
+  size_t result;
+
+  if (f == NULL)
+    return 0;
+  prune(f);
+  result = _replace(f, buf, offset, len);
+  if (0 != result)
+    note(f, JOURNAL_REPLACE, offset, buf, len);
+  if (0 != result && NULL != f->edit_hook)
+    f->edit_hook(f, offset, result, result);
+  return result;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+size_t vf_delete(file_manager_t * f, off_t offset, size_t len)
+{
+  size_t result;
+
+  if (f == NULL)
+    return 0;
+  prune(f);
+  result = _delete(f, offset, len);
+  if (0 != result)
+    note(f, JOURNAL_DELETE, offset, NULL, len);
+  if (0 != result && NULL != f->edit_hook)
+    f->edit_hook(f, offset, result, 0);
+  return result;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+char vf_get_char(file_manager_t * f, char *result, off_t offset)
+{
+  if (f == NULL)
+  {
+    *result = 0;
+    return 0;
+  }
+
+  return _get_char(f, result, offset);
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+size_t vf_get_buf(file_manager_t * f, char *dest, off_t offset, size_t len)
+{
+  if (f == NULL)
+    return 0;
+
+  return _get_buf(f, dest, offset, len);
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+void vf_iter_init(vf_iter_t * it, file_manager_t * f, off_t offset, off_t len)
+{
+  it->f = f;
+  it->offset = offset;
+  it->end = offset + len;
+  it->bounce = NULL;
+}
+
+
+/*---------------------------
+  The next span of the range,
+  returns its length or 0 at the
+  end
+  ---------------------------*/
+size_t vf_iter_next(vf_iter_t * it, const char **span)
+{
+  size_t len;
+
+  if (it->f == NULL || it->offset >= it->end)
+    return 0;
+
+  if (NULL == it->f->map && NULL == it->bounce)
+  {
+    it->bounce = (char *)malloc(VF_ITER_BOUNCE);
+    if (NULL == it->bounce)
+      return 0;
+  }
+
+  len = _get_span(it->f, span, it->bounce, it->offset, it->end - it->offset);
+  it->offset += len;
+
+  return len;
+}
+
+
+/*---------------------------
+
+  ---------------------------*/
+void vf_iter_term(vf_iter_t * it)
+{
+  free(it->bounce);
+  it->bounce = NULL;
+}
+
+
+/*---------------------------
+  The range as one read only
+  buffer, in place when a single
+  piece holds it and otherwise
+  copied into *copy, which the
+  caller frees. len is cut to
+  what is in the file.
+  ---------------------------*/
+const char *vf_get_range(file_manager_t * f, off_t offset, size_t * len,
+                         char **copy)
+{
+  const char *span;
+  size_t got;
+
+  *copy = NULL;
+  if (f == NULL)
+  {
+    *len = 0;
+    return NULL;
+  }
+
+  got = _get_span(f, &span, NULL, offset, *len);
+  if (got > 0 && got == *len)
+    return span;
+
+  *copy = (char *)malloc(*len ? *len : 1);
+  if (NULL == *copy)
+  {
+    *len = 0;
+    return NULL;
+  }
+  *len = _get_buf(f, *copy, offset, *len);
+
+  return *copy;
+}
+
+
+/*---------------------------
+  As vf_get_range but copied,
+  when it has to be, into the
+  caller's buf of *len bytes, so
+  a buffer can be used again
+  ---------------------------*/
+const char *vf_read_range(file_manager_t * f, off_t offset, size_t * len,
+                          char *buf)
+{
+  const char *span;
+  size_t got;
+
+  if (f == NULL)
+  {
+    *len = 0;
+    return NULL;
+  }
+
+  got = _get_span(f, &span, NULL, offset, *len);
+  if (got > 0 && got == *len)
+    return span;
+
+  *len = _get_buf(f, buf, offset, *len);
+
+  return buf;
+}
+
+
+/*---------------------------
+  Hint that the range will be
+  read soon, the reads start in
+  the background
+  ---------------------------*/
+void vf_prefetch(file_manager_t * f, off_t offset, size_t len)
+{
+  if (f == NULL)
+    return;
+
+  _prefetch(f, offset, len);
+}
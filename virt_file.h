@@ -31,7 +31,11 @@
     INCLUDES
  ***************/
 #include <stdio.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include "vf_cache.h"
+#include "vf_journal.h"
 
 /****************
   MACROS/DEFINES
@@ -46,6 +50,14 @@
 # define FALSE 0
 
 #define MAX_PATH_LEN 1024
+#define SLAB_ITEMS   1024  /* items carved from each slab chunk */
+#define SWAP_PIECES  2     /* pieces an edit may cut in two */
+#define MERGE_LIMIT  (64 * 1024) /* largest payload later edits may grow */
+#define ADD_BUF_MIN  (64 * 1024)        /* first allocation of the add buffer */
+#define ADD_SPILL    (64 * 1024 * 1024) /* past this it moves to a temp file */
+#define ADD_COMPACT  (1024 * 1024)      /* unused bytes worth compacting away */
+#define UNDO_DEFAULT_BYTES (256 * 1024 * 1024)
+#define SAVE_SHIFT_RATIO 4 /* in place must beat a rewrite by this much */
 
 /****************
      TYPES
@@ -61,51 +73,200 @@ typedef enum
   MAX_TYPES
 } buf_type_e;
 
+/* Fixed size items handed out from large chunks, so the many small
+   nodes of a session cost one malloc per SLAB_ITEMS and can all be
+   released at once. */
+typedef struct slab_s slab_t;
+struct slab_s
+{
+  void *free_list;
+  void *chunks;                 /* first item of each chunk links the next */
+  size_t item_size;
+  int carved;                   /* items used from the newest chunk */
+  long count;                   /* items in use */
+};
+
+/* Every byte typed, pasted or replaced is appended here and never moved
+   or freed until the file is saved or closed, so edit pieces are just
+   spans of it. Small buffers live on the heap, large ones are mapped
+   from an unlinked temp file so the page cache can hold them. */
+typedef struct add_buf_s add_buf_t;
+struct add_buf_s
+{
+  char *data;
+  off_t size;                   /* bytes appended so far */
+  off_t alloc;                  /* bytes available at data */
+  off_t dead;                   /* bytes no piece refers to any more */
+  int fd;                       /* temp file backing data, or -1 */
+};
+
+/* The logical file is an ordered sequence of pieces, each a span of either
+   the original file (TYPE_FILE) or the add buffer (TYPE_INSERT,
+   TYPE_REPLACE). Pieces are kept in a treap ordered by logical offset, and
+   every node carries the logical size of its subtree so that an offset can
+   be found, and the tree split or joined at it, in O(log pieces). */
 typedef struct vbuf_s vbuf_t;
 struct vbuf_s
 {
-  vbuf_t *parent;
-  vbuf_t *first_child;
-  vbuf_t *next;
-  vbuf_t *prev;
-  char *buf;
-  off_t start;
-  off_t size;
+  vbuf_t *left;
+  vbuf_t *right;
+  off_t start;                  /* offset of the piece within its source */
+  off_t size;                   /* logical size of this piece */
+  off_t subtree_size;           /* logical size of this piece and its children */
+  unsigned int priority;
   buf_type_e buf_type;
-  FILE *fp;
-  BOOL active;
 };
 
-typedef struct vbuf_list_s vbuf_list_t;
-struct vbuf_list_s
+/* A change swaps a range of the logical file for another. While applied,
+   vb holds the pieces the change displaced. While undone, vb holds the
+   pieces the change introduced, so undo and redo are the same swap.
+   Until it is closed, the newest change absorbs inserts and replaces
+   that run on from it, so one command is one piece and one undo. */
+typedef struct vbuf_undo_list_s vbuf_undo_list_t;
+struct vbuf_undo_list_s
 {
-  /* move fp from vb up to here? or integrate fname into vb? do we want to support inserting a file into a file? */
+  vbuf_undo_list_t *last;       /* older change */
+  vbuf_undo_list_t *next;       /* newer change */
   vbuf_t *vb;
-  vbuf_list_t *next;            /* move across this list */
+  off_t add_start;              /* payload position in the add buffer */
+  off_t offset;
+  off_t old_size;               /* logical bytes before the change */
+  off_t new_size;               /* logical bytes after the change */
+  off_t held;                   /* memory the change keeps for undo */
+  BOOL open;                    /* may still absorb contiguous edits */
 };
 
-typedef struct vbuf_undo_list_s vbuf_undo_list_t;
-struct vbuf_undo_list_s
+/* Changes from oldest to newest. Those up to current are applied, the
+   ones after it were undone and are what redo steps through, so undo,
+   redo and knowing whether the file is dirty never walk the list.
+   When count or bytes pass the undo budget the oldest changes are
+   folded into the tree for good. */
+typedef struct vf_history_s vf_history_t;
+struct vf_history_s
 {
-  vbuf_undo_list_t *last;
-  vbuf_list_t *vb_list;
-  BOOL applied;
-  BOOL saved;
+  vbuf_undo_list_t *oldest;
+  vbuf_undo_list_t *newest;
+  vbuf_undo_list_t *current;    /* newest change applied, NULL if none */
+  vbuf_undo_list_t *saved;      /* current when the file matched the disk */
+  BOOL saved_lost;              /* the change saved pointed at was pruned */
+  vbuf_undo_list_t *saving;     /* current when a running save began */
+  BOOL saving_lost;
+  BOOL saving_crossed;          /* an undo went back past saving since */
+  long count;                   /* changes in the list */
+  off_t bytes;                  /* sum of their held */
+};
+
+/* A save running on its own thread. The edits are already in the temp
+   file when it starts, what is left is copying the extents of the
+   original, which never change under it, so editing can carry on. */
+typedef struct save_extent_s save_extent_t;
+struct save_extent_s
+{
+  off_t from;                   /* offset in the original */
+  off_t to;                     /* offset in the temp file */
+  off_t len;
+};
+
+typedef struct vf_save_job_s vf_save_job_t;
+struct vf_save_job_s
+{
+  pthread_t thread;
+  pthread_mutex_t lock;         /* guards finished and *complete */
+  char path[PATH_MAX];          /* file the temp file is renamed over */
+  char tmp_name[PATH_MAX + 16];
+  int in;
+  int out;
+  char *map;
+  BOOL use_range;               /* copy_file_range has not failed on them */
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  save_extent_t *extents;
+  long count;
+  off_t size;                   /* logical size being saved */
+  int percent;
+  int *complete;                /* percent, or the caller's progress */
+  BOOL threaded;                /* or ran on the caller's thread */
+  BOOL failed;
+  BOOL finished;
 };
 
 typedef struct file_manager_s file_manager_t;
+
+/* Told after each change to the logical file that len bytes at offset
+   are now new_len bytes, and with offset -1 when the file is closed */
+typedef void (*vf_edit_hook_t)(file_manager_t * f, off_t offset, off_t len,
+                               off_t new_len);
+
 struct file_manager_s
 {
   char fname[MAX_PATH_LEN + 1];
-  vbuf_t fm;
-  vbuf_undo_list_t ul;
+  FILE *fp;
+  char *map;                    /* file mapped read only */
+  block_cache_t *cache;         /* or read through the block cache */
+  off_t file_size;              /* size of the file on disk */
+  vbuf_t *root;
+  add_buf_t add;
+  slab_t vb_slab;
+  slab_t ul_slab;
+  unsigned int seed;
+  vf_history_t hist;
+  vf_save_job_t *job;           /* save in the background, or NULL */
+  BOOL stale;                   /* fp was replaced on disk by a save */
+  BOOL partial;                 /* a failed save left the file part written */
+  vf_journal_t journal;
+  BOOL recoverable;             /* an earlier session left a journal */
+  vf_edit_hook_t edit_hook;     /* or NULL */
   void *private_data;
 };
 
+/* Walks a range of the logical file as read only spans in file order,
+   straight out of the mapped file and the add buffer. File pieces that
+   are not mapped are read into a bounce buffer a bit at a time. A span
+   is good until the next call or the next edit. */
+#define VF_ITER_BOUNCE (256 * 1024)
+typedef struct vf_iter_s vf_iter_t;
+struct vf_iter_s
+{
+  file_manager_t *f;
+  off_t offset;                 /* logical offset of the next span */
+  off_t end;
+  char *bounce;
+};
+
 typedef struct vf_stat_s vf_stat_t;
 struct vf_stat_s
 {
   off_t file_size;
+  off_t disk_size;
+  long undo_changes;
+  off_t undo_bytes;
+  off_t add_size;
+  off_t add_dead;
+  unsigned long cache_hits;
+  unsigned long cache_misses;
+};
+
+typedef enum
+{
+  SAVE_EXTENTS,                 /* overwrite just the edited bytes */
+  SAVE_IN_PLACE,                /* shift data within the file */
+  SAVE_REWRITE,                 /* write a temp file and rename it */
+  SAVE_RANGES,                  /* open and collapse block ranges */
+  MAX_SAVE_PLANS
+} save_plan_e;
+
+/* How vf_save will go about it and roughly how much I/O that takes,
+   counting data moved within the file once for the read and once for
+   the write. */
+typedef struct vf_save_plan_s vf_save_plan_t;
+struct vf_save_plan_s
+{
+  save_plan_e plan;
+  save_plan_e fallback;         /* if the filesystem can't do plan */
+  off_t edit_bytes;             /* bytes of edits to write */
+  off_t move_bytes;             /* original bytes not at their old offset */
+  off_t io_bytes;               /* estimated bytes read and written */
 };
 
 typedef struct vf_ring_s vf_ring_t;
@@ -135,21 +296,46 @@ BOOL   vf_parse_path(char *out, const char *in);
 BOOL   vf_init(file_manager_t * f, const char *file_name);
 void   vf_term(file_manager_t * f);
 void   vf_stat(file_manager_t * f, vf_stat_t * s);
+void   vf_set_cache_size(size_t size);
+void   vf_set_undo_limit(long changes, off_t bytes);
 char   vf_get_char(file_manager_t * f, char *result, off_t offset);
 size_t vf_get_buf(file_manager_t * f, char *dest, off_t offset, size_t len);
+void   vf_iter_init(vf_iter_t * it, file_manager_t * f, off_t offset, off_t len);
+size_t vf_iter_next(vf_iter_t * it, const char **span);
+void   vf_iter_term(vf_iter_t * it);
+const char *vf_get_range(file_manager_t * f, off_t offset, size_t * len,
+                         char **copy);
+const char *vf_read_range(file_manager_t * f, off_t offset, size_t * len,
+                          char *buf);
+void   vf_prefetch(file_manager_t * f, off_t offset, size_t len);
 size_t vf_insert_before(file_manager_t * f, char *buf, off_t offset, size_t len);
 size_t vf_insert_after(file_manager_t * f, char *buf, off_t offset, size_t len);
 size_t vf_replace(file_manager_t * f, char *buf, off_t offset, size_t len);
 size_t vf_delete(file_manager_t * f, off_t offset, size_t len);
 int    vf_undo(file_manager_t * f, int count, off_t * undo_addr);
 int    vf_redo(file_manager_t * f, int count, off_t * redo_addr);
+void   vf_close_change(file_manager_t * f);
+void   vf_set_edit_hook(file_manager_t * f, vf_edit_hook_t hook);
 BOOL   vf_need_create(file_manager_t * f);
 BOOL   vf_need_save(file_manager_t * f);
 char *vf_get_fname(file_manager_t * f);
 char *vf_get_fname_file(file_manager_t * f);
 BOOL   vf_create_file(file_manager_t * f, const char *file_name);
-BOOL   vf_copy_file(file_manager_t * f, const char *file_name, BOOL keep_newname);
+BOOL   vf_copy_file(file_manager_t * f, const char *file_name, BOOL keep_newname,
+                    int *complete);
+void   vf_plan_save(file_manager_t * f, vf_save_plan_t * p);
+const char *vf_plan_name(save_plan_e plan);
 off_t  vf_save(file_manager_t * f, int *complete);
+BOOL   vf_save_start(file_manager_t * f);
+BOOL   vf_save_pending(file_manager_t * f);
+BOOL   vf_save_partial(file_manager_t * f);
+int    vf_save_progress(file_manager_t * f);
+BOOL   vf_save_poll(file_manager_t * f, off_t * size);
+off_t  vf_save_wait(file_manager_t * f);
+BOOL   vf_journal_found(file_manager_t * f);
+long   vf_journal_recover(file_manager_t * f);
+void   vf_journal_discard(file_manager_t * f);
+BOOL   vf_journal_sync(file_manager_t * f);
 
 #endif /* __VIRT_FILE_H */
 